@@ -0,0 +1,334 @@
+/*
+ * affinity.c
+ *
+ * CPU affinity and NUMA placement. Worker i runs on CPU
+ * flag->cpus[i % flag->ncpus] and prefers memory of the NUMA node of that
+ * CPU, so that connection buffers it allocates are local. Connections are
+ * steered to the worker on the CPU that handled their SYN, either with
+ * SO_INCOMING_CPU or with a classic BPF program that selects the socket of
+ * the SO_REUSEPORT group.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity */
+#endif
+
+#include "affinity.h"
+
+#ifdef HAVE_AFFINITY
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define CPU_SYSFS_PATH "/sys/devices/system/cpu/cpu%d"
+#define NODE_PREFIX "node"
+/* MPOL_LOCAL of <linux/mempolicy.h>, an enum constant there */
+#define AFFINITY_MPOL_LOCAL 4
+
+static int
+affinity_add(struct flags *, int);
+static int
+affinity_node(int);
+static int
+steer_cbpf(struct flags *, int *, int);
+
+/**
+ * Appends a CPU to the CPU list of the flags.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+affinity_add(struct flags * flag, int cpu)
+{
+  int *cpus;
+
+  if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+    warnx("invalid CPU %d", cpu);
+    return -1;
+  }
+  if ((cpus = realloc(flag->cpus, (flag->ncpus + 1) * sizeof(*cpus)))
+      == NULL) {
+    warn("cannot allocate CPU list");
+    return -1;
+  }
+  cpus[flag->ncpus++] = cpu;
+  flag->cpus = cpus;
+
+  return 0;
+}
+
+/**
+ * Parses the CPUs to place workers on. The list is either "auto" for all
+ * CPUs this process may run on, or comma-separated CPU numbers and ranges
+ * such as "0-3,8".
+ *
+ * @param flag the flags to store the CPU list in.
+ * @param list the CPU list.
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+affinity_parse(struct flags * flag, const char * list)
+{
+  const char *pos = list;
+  char *end;
+  long first;
+  long last;
+  long cpu;
+
+  if (strcmp(list, "auto") == 0) {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+      warn("sched_getaffinity");
+      return -1;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set) && (affinity_add(flag, cpu) < 0)) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  for (;;) {
+    errno = 0;
+    first = last = strtol(pos, &end, 10);
+    if ((end == pos) || (errno != 0)) {
+      warnx("invalid CPU list %s", list);
+      return -1;
+    }
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if ((end == pos) || (errno != 0) || (last < first)) {
+        warnx("invalid CPU range in %s", list);
+        return -1;
+      }
+    }
+    for (cpu = first; cpu <= last; cpu++) {
+      if (affinity_add(flag, cpu) < 0) {
+        return -1;
+      }
+    }
+    if (*end == '\0') {
+      return 0;
+    } else if (*end != ',') {
+      warnx("invalid CPU list %s", list);
+      return -1;
+    }
+    pos = end + 1;
+  }
+}
+
+/**
+ * Determines the CPU of worker or thread number i.
+ *
+ * @param flag user-provided flags.
+ * @param i the number of the worker.
+ * @return the CPU, or -1 if no CPUs were configured.
+ */
+int
+affinity_cpu(struct flags * flag, int i)
+{
+  if (flag->ncpus == 0) {
+    return -1;
+  }
+  return flag->cpus[i % flag->ncpus];
+}
+
+/**
+ * Determines the NUMA node of a CPU from sysfs.
+ *
+ * @return the node, or -1 if it is unknown.
+ */
+static int
+affinity_node(int cpu)
+{
+  char path[64];
+  struct dirent *entry;
+  DIR *dir;
+  int node = -1;
+
+  (void) snprintf(path, sizeof(path), CPU_SYSFS_PATH, cpu);
+  if ((dir = opendir(path)) == NULL) {
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, NODE_PREFIX, strlen(NODE_PREFIX)) == 0) {
+      node = atoi(entry->d_name + strlen(NODE_PREFIX));
+      break;
+    }
+  }
+  (void) closedir(dir);
+
+  return node;
+}
+
+/**
+ * Pins the calling thread to the CPU of worker number i and makes it
+ * allocate memory on the local NUMA node. Must be called before the worker
+ * allocates its buffers. Does nothing, if no CPUs were configured.
+ *
+ * @param flag user-provided flags.
+ * @param i the number of the worker or thread.
+ * @param what "worker", "thread" or "server", for the startup report.
+ */
+void
+affinity_pin(struct flags * flag, int i, const char * what)
+{
+  cpu_set_t set;
+  int cpu;
+
+  if ((cpu = affinity_cpu(flag, i)) < 0) {
+    return;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  /* pid 0 is the calling thread */
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    warn("cannot pin %s %d to CPU %d", what, i, cpu);
+    return;
+  }
+#ifdef SYS_set_mempolicy
+  /* override a policy inherited from e.g. numactl --interleave */
+  if (syscall(SYS_set_mempolicy, AFFINITY_MPOL_LOCAL, NULL, 0) < 0) {
+    warn("cannot set local memory policy");
+  }
+#endif
+
+  if (flag->dflag) {
+    (void) printf("%s %d: cpu %d, node %d\n", what, i, cpu,
+        affinity_node(cpu));
+    (void) fflush(stdout);
+  }
+}
+
+/**
+ * Attaches a classic BPF program to the SO_REUSEPORT group that returns the
+ * index of the socket whose worker runs on the CPU handling the
+ * connection. With more workers than CPUs, worker i shares the CPU of
+ * worker i % ncpus, and the connections of that CPU are spread over its
+ * workers at random. Connections arriving on other CPUs are spread by CPU
+ * number. The index of a socket in the group is the order in which it
+ * started listening.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+steer_cbpf(struct flags * flag, int * socks, int n)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter *code;
+  struct sock_fprog prog;
+  int len = 0;
+  int retval;
+  int shared; /* workers on the CPU of worker i */
+  int i;
+
+  if ((code = calloc(6 * n + 3, sizeof(*code))) == NULL) {
+    warn("cannot allocate steering program");
+    return -1;
+  }
+  code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+      SKF_AD_OFF + SKF_AD_CPU);
+  for (i = 0; (i < n) && (i < flag->ncpus); i++) {
+    shared = (n - i + flag->ncpus - 1) / flag->ncpus;
+    if (shared == 1) {
+      code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+          affinity_cpu(flag, i), 0, 1);
+      code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+      continue;
+    }
+    /* i + ncpus * (random % shared) */
+    code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+        affinity_cpu(flag, i), 0, 5);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+        SKF_AD_OFF + SKF_AD_RANDOM);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+        shared);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MUL | BPF_K,
+        flag->ncpus);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, i);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+  }
+  code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+  code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+  prog.len = len;
+  prog.filter = code;
+  /* the program applies to the whole group */
+  retval = setsockopt(socks[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+      sizeof(prog));
+  if (retval < 0) {
+    warn("cannot attach steering program");
+  }
+  free(code);
+
+  return retval;
+#else
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+/**
+ * Steers connections to the worker pinned to the CPU that received them.
+ * Uses a BPF program for the SO_REUSEPORT group if flag->steering asks for
+ * it and the system supports it, and SO_INCOMING_CPU otherwise.
+ *
+ * @param flag user-provided flags.
+ * @param socks the listening sockets of the workers, in listen order.
+ * @param n the number of sockets.
+ */
+void
+affinity_steer(struct flags * flag, int * socks, int n)
+{
+  const char *method = "none";
+  int i;
+
+  if ((flag->ncpus == 0) || (flag->steering == STEER_NONE) || (n < 2)) {
+    return;
+  }
+
+  if ((flag->steering == STEER_CBPF) && (steer_cbpf(flag, socks, n) == 0)) {
+    method = "reuseport BPF";
+  } else {
+#ifdef SO_INCOMING_CPU
+    for (i = 0; i < n; i++) {
+      int cpu = affinity_cpu(flag, i);
+
+      if (setsockopt(socks[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+          sizeof(cpu)) < 0) {
+        warn("cannot set SO_INCOMING_CPU");
+        break;
+      }
+    }
+    if (i == n) {
+      method = "SO_INCOMING_CPU";
+    }
+#endif
+  }
+
+  if (flag->dflag) {
+    (void) printf("steering connections by CPU: %s\n", method);
+    (void) fflush(stdout);
+  }
+}
+
+#endif /* HAVE_AFFINITY */
@@ -0,0 +1,26 @@
+/*
+ * affinity.h
+ *
+ * CPU affinity and NUMA placement of workers, and steering of connections
+ * to the worker on the CPU that received them.
+ */
+
+#ifndef _SWS_AFFINITY_H_
+#define _SWS_AFFINITY_H_
+
+#include "util.h"
+
+#ifdef __linux__
+#define HAVE_AFFINITY 1
+#endif
+
+int
+affinity_parse(struct flags *, const char *);
+int
+affinity_cpu(struct flags *, int);
+void
+affinity_pin(struct flags *, int, const char *);
+void
+affinity_steer(struct flags *, int *, int);
+
+#endif /* !_SWS_AFFINITY_H_ */
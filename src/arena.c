@@ -0,0 +1,136 @@
+/*
+ * arena.c
+ *
+ * Bump-pointer allocator. A request allocates its strings, such as the
+ * path and the resolved file name, by advancing a pointer through a chunk.
+ * When the chunk is full, one twice as large is added. Nothing is freed
+ * individually; arena_reset() empties the first chunk for the next request
+ * and releases the others once the response is done, and arena_free()
+ * releases all chunks when the connection closes.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* every allocation is aligned for any type */
+#define ARENA_ALIGN (2 * sizeof(void *))
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/**
+ * A block of arena memory. The data follows the header.
+ */
+struct arena_chunk
+{
+  struct arena_chunk *next; /* the previous, fully used chunk */
+  size_t size; /* bytes of data */
+  size_t used; /* bytes of data handed out */
+};
+
+/**
+ * Initializes an empty arena.
+ *
+ * @param arena the arena.
+ */
+void
+arena_init(struct arena * arena)
+{
+  arena->head = NULL;
+}
+
+/**
+ * Allocates memory that stays valid until the next arena_reset().
+ *
+ * @param arena the arena.
+ * @param size the number of bytes.
+ * @return the memory, or NULL if it cannot be allocated.
+ */
+void *
+arena_alloc(struct arena * arena, size_t size)
+{
+  struct arena_chunk *chunk = arena->head;
+  size_t chunk_size;
+  void *ptr;
+
+  size = ARENA_ROUND(size);
+  if ((chunk == NULL) || (chunk->size - chunk->used < size)) {
+    chunk_size = (chunk == NULL) ? ARENA_CHUNK_SIZE : 2 * chunk->size;
+    if (chunk_size < size) {
+      chunk_size = size;
+    }
+    if ((chunk = malloc(ARENA_ROUND(sizeof(*chunk)) + chunk_size)) == NULL) {
+      return NULL;
+    }
+    chunk->next = arena->head;
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    arena->head = chunk;
+  }
+
+  ptr = (char *) chunk + ARENA_ROUND(sizeof(*chunk)) + chunk->used;
+  chunk->used += size;
+
+  return ptr;
+}
+
+/**
+ * Copies a string that need not be null-terminated into the arena.
+ *
+ * @param arena the arena.
+ * @param str the string.
+ * @param len the length of the string.
+ * @return the null-terminated copy, or NULL if it cannot be allocated.
+ */
+char *
+arena_strndup(struct arena * arena, const char * str, size_t len)
+{
+  char *copy;
+
+  if ((copy = arena_alloc(arena, len + 1)) == NULL) {
+    return NULL;
+  }
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  return copy;
+}
+
+/**
+ * Invalidates all memory of the arena. The first chunk is kept for the next
+ * request, so that a request whose strings fit in it does not allocate.
+ *
+ * @param arena the arena.
+ */
+void
+arena_reset(struct arena * arena)
+{
+  struct arena_chunk *chunk;
+
+  if (arena->head == NULL) {
+    return;
+  }
+  while ((chunk = arena->head)->next != NULL) {
+    arena->head = chunk->next;
+    free(chunk);
+  }
+  chunk->used = 0;
+}
+
+/**
+ * Releases all memory of the arena, which stays usable.
+ *
+ * @param arena the arena.
+ */
+void
+arena_free(struct arena * arena)
+{
+  struct arena_chunk *chunk;
+
+  while ((chunk = arena->head) != NULL) {
+    arena->head = chunk->next;
+    free(chunk);
+  }
+}
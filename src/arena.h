@@ -0,0 +1,37 @@
+/*
+ * arena.h
+ *
+ * Bump-pointer allocator for memory that lives as long as one request.
+ */
+
+#ifndef _SWS_ARENA_H_
+#define _SWS_ARENA_H_
+
+#include <sys/types.h>
+
+#define ARENA_CHUNK_SIZE 1024 /* size of the first chunk of a request */
+
+struct arena_chunk;
+
+/**
+ * Memory of one request. Allocations are carved from chunks, which are
+ * released at once by arena_reset(), except for the first one, which the
+ * next request reuses. arena_free() releases that one as well.
+ */
+struct arena
+{
+  struct arena_chunk *head; /* chunk allocated from, older ones follow */
+};
+
+void
+arena_init(struct arena *);
+void *
+arena_alloc(struct arena *, size_t);
+char *
+arena_strndup(struct arena *, const char *, size_t);
+void
+arena_reset(struct arena *);
+void
+arena_free(struct arena *);
+
+#endif /* !_SWS_ARENA_H_ */
@@ -0,0 +1,132 @@
+/*
+ * bench_scan.c
+ *
+ * Microbenchmark of the delimiter scan: parses a request with typical
+ * browser headers and scans the same bytes for line ends, once with each
+ * scan implementation the CPU supports. Build with "make bench_scan".
+ *
+ * usage: bench_scan [iterations]
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parser.h"
+#include "scan.h"
+
+static const char request[] =
+    "GET /static/js/app.min.js?v=20180412&lang=en-US HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/66.0.3359.139 "
+    "Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/webp,image/apng,*/*;q=0.8\r\n"
+    "Referer: https://www.example.com/articles/2018/04/performance-tuning\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1523456789; _gid=GA1.2.987654321.1523456789;"
+    " session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiw"
+    "ibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ.SflKxwRJSMeKKF2QT4fwpMeJf"
+    "36POk6yJV_adQssw5c; theme=dark; consent=1\r\n"
+    "If-None-Match: \"5ad0c3e1-1f4a\"\r\n"
+    "If-Modified-Since: Fri, 13 Apr 2018 14:22:25 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "X-Request-Id: 7f3c9a2e-41d2-4b8e-9c1f-2a6b5d8e0f13\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "Traceparent: 00-0af7651916cd43dd8448eb211c80319c-b7ad6b7169203331-01\r\n"
+    "\r\n";
+
+static double
+elapsed_ns(const struct timespec *, const struct timespec *);
+static void
+bench(int, long);
+
+/**
+ * Computes the time between two clock readings.
+ *
+ * @param start the first reading.
+ * @param end the second reading.
+ * @return the elapsed nanoseconds.
+ */
+static double
+elapsed_ns(const struct timespec * start, const struct timespec * end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9
+      + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Runs both measurements with one scan implementation and prints them.
+ *
+ * @param kind the implementation, SCAN_?.
+ * @param iterations the number of repetitions.
+ */
+static void
+bench(int kind, long iterations)
+{
+  struct http_parser parser;
+  struct timespec start;
+  struct timespec end;
+  size_t len = sizeof(request) - 1;
+  size_t lines = 0;
+  size_t pos;
+  double ns;
+  long i;
+
+  if (scan_select(kind) == -1) {
+    return;
+  }
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    http_parser_init(&parser, 0);
+    if ((http_parse(&parser, request, len) != 1) || parser.bad) {
+      (void) fprintf(stderr, "request not parsed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = elapsed_ns(&start, &end) / iterations;
+  (void) printf("%-8s parse: %8.1f ns/request %6.2f GB/s (%d headers)\n",
+      scan_name(), ns, len / ns, parser.header_count);
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    for (pos = 0; pos < len; pos++) {
+      pos += scan_find(request + pos, len - pos, '\n', '\n', '\n');
+      lines++;
+    }
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = elapsed_ns(&start, &end) / iterations;
+  (void) printf("%-8s scan:  %8.1f ns/request %6.2f GB/s (%lu line ends)\n",
+      scan_name(), ns, len / ns, (unsigned long) (lines / iterations));
+}
+
+int
+main(int argc, char ** argv)
+{
+  long iterations = 1000000;
+
+  if (argc > 1) {
+    iterations = strtol(argv[1], NULL, 10);
+    if (iterations <= 0) {
+      (void) fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  (void) printf("request: %lu bytes, %ld iterations\n",
+      (unsigned long) (sizeof(request) - 1), iterations);
+  bench(SCAN_SCALAR, iterations);
+  bench(SCAN_SSE42, iterations);
+  bench(SCAN_AVX2, iterations);
+
+  exit(EXIT_SUCCESS);
+}
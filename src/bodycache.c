@@ -0,0 +1,407 @@
+/*
+ * bodycache.c
+ *
+ * The contents of files up to BODYCACHE_FILE_MAX bytes are kept in memory,
+ * together with their Last-Modified, Content-Type and Content-Length
+ * fields, so that answering a request for them is a copy into the output
+ * queue. An entry is valid as long as device, inode, size and mtime of the
+ * file match those the caller found, e.g. in the file cache.
+ *
+ * Entries are evicted with S3-FIFO: new files enter a small FIFO queue of
+ * a tenth of the budget. A file that is requested again before it reaches
+ * the tail moves to the main queue, others leave and are remembered as
+ * ghosts, by path only. A ghost that is requested again enters the main
+ * queue directly. The main queue is a CLOCK: a file that was requested
+ * since it was last at the tail goes around again. Files that are
+ * requested once, e.g. by a crawler, thus never displace the files that
+ * are requested all the time.
+ *
+ * The cache is shared by the threads of a process.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bodycache.h"
+
+#define BODYCACHE_QUEUE_SMALL 0 /* new entries */
+#define BODYCACHE_QUEUE_MAIN  1 /* entries requested more than once */
+#define BODYCACHE_QUEUE_GHOST 2 /* evicted entries, without contents */
+#define BODYCACHE_QUEUES 3
+
+#define BODYCACHE_FREQ_MAX 3
+#define BODYCACHE_MIN_GHOSTS 64
+
+/**
+ * A FIFO queue of entries.
+ */
+struct bodycache_queue
+{
+  struct bodycache_entry *head; /* newest entry */
+  struct bodycache_entry *tail; /* oldest entry */
+  size_t bytes; /* memory of the entries */
+  int count; /* number of entries */
+};
+
+static unsigned int
+bodycache_hash(const char *);
+static struct bodycache_entry *
+bodycache_find(const char *, unsigned int);
+static void
+bodycache_push(struct bodycache_entry *, int);
+static void
+bodycache_pop(struct bodycache_entry *);
+static void
+bodycache_release(struct bodycache_entry *);
+static void
+bodycache_remove(struct bodycache_entry *);
+static void
+bodycache_evict(void);
+static int
+bodycache_matches(const struct bodycache_entry *, const struct stat *);
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_budget; /* bytes, 0 if the cache is disabled */
+static struct bodycache_entry **cache_buckets;
+static size_t cache_nbuckets; /* a power of two */
+static struct bodycache_queue queues[BODYCACHE_QUEUES];
+
+/**
+ * Hashes a path with FNV-1a.
+ *
+ * @param path the path.
+ * @return the hash.
+ */
+static unsigned int
+bodycache_hash(const char * path)
+{
+  unsigned int hash = 2166136261U;
+
+  while (*path != '\0') {
+    hash = (hash ^ (unsigned char) *path++) * 16777619U;
+  }
+
+  return hash;
+}
+
+/**
+ * Finds the entry of a path, which may be a ghost.
+ *
+ * @return the entry, or NULL if the path is not cached.
+ */
+static struct bodycache_entry *
+bodycache_find(const char * path, unsigned int hash)
+{
+  struct bodycache_entry *entry;
+
+  for (entry = cache_buckets[hash & (cache_nbuckets - 1)]; entry != NULL;
+      entry = entry->next) {
+    if ((entry->hash == hash) && (strcmp(entry->path, path) == 0)) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Adds an entry at the head of a queue.
+ *
+ * @param entry the entry, in no queue.
+ * @param queue BODYCACHE_QUEUE_?.
+ */
+static void
+bodycache_push(struct bodycache_entry * entry, int queue)
+{
+  struct bodycache_queue *q = &queues[queue];
+
+  entry->queue = queue;
+  entry->newer = NULL;
+  entry->older = q->head;
+  if (q->head != NULL) {
+    q->head->newer = entry;
+  } else {
+    q->tail = entry;
+  }
+  q->head = entry;
+  q->bytes += entry->bytes;
+  q->count++;
+}
+
+/**
+ * Takes an entry out of its queue.
+ */
+static void
+bodycache_pop(struct bodycache_entry * entry)
+{
+  struct bodycache_queue *q = &queues[entry->queue];
+
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    q->head = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    q->tail = entry->newer;
+  }
+  entry->newer = entry->older = NULL;
+  q->bytes -= entry->bytes;
+  q->count--;
+}
+
+/**
+ * Drops a reference to an entry. The last reference frees it.
+ */
+static void
+bodycache_release(struct bodycache_entry * entry)
+{
+  if (--entry->refs > 0) {
+    return;
+  }
+  free(entry->path);
+  free(entry->headers);
+  free(entry->body);
+  free(entry);
+}
+
+/**
+ * Removes an entry from the hash table and its queue. Holders may still
+ * use its contents.
+ */
+static void
+bodycache_remove(struct bodycache_entry * entry)
+{
+  struct bodycache_entry **link;
+
+  link = &cache_buckets[entry->hash & (cache_nbuckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  bodycache_pop(entry);
+  bodycache_release(entry);
+}
+
+/**
+ * Evicts one entry, or moves entries until one can be evicted. Ghosts are
+ * trimmed to the number of entries of the main queue.
+ */
+static void
+bodycache_evict(void)
+{
+  struct bodycache_entry *entry;
+
+  if ((queues[BODYCACHE_QUEUE_SMALL].bytes > cache_budget / 10)
+      || (queues[BODYCACHE_QUEUE_MAIN].tail == NULL)) {
+    entry = queues[BODYCACHE_QUEUE_SMALL].tail;
+    if (entry->freq > 0) {
+      /* requested again while in the small queue */
+      bodycache_pop(entry);
+      entry->freq = 0;
+      bodycache_push(entry, BODYCACHE_QUEUE_MAIN);
+    } else if (entry->refs > 1) {
+      /* in use, the last holder frees the contents; no ghost */
+      bodycache_remove(entry);
+    } else {
+      /* keep the path only */
+      bodycache_pop(entry);
+      free(entry->headers);
+      free(entry->body);
+      entry->headers = entry->body = NULL;
+      entry->bytes = 0;
+      bodycache_push(entry, BODYCACHE_QUEUE_GHOST);
+    }
+  } else {
+    entry = queues[BODYCACHE_QUEUE_MAIN].tail;
+    if (entry->freq > 0) {
+      entry->freq--;
+      bodycache_pop(entry);
+      bodycache_push(entry, BODYCACHE_QUEUE_MAIN);
+    } else {
+      bodycache_remove(entry);
+    }
+  }
+
+  while (queues[BODYCACHE_QUEUE_GHOST].count
+      > ((queues[BODYCACHE_QUEUE_MAIN].count > BODYCACHE_MIN_GHOSTS) ?
+          queues[BODYCACHE_QUEUE_MAIN].count : BODYCACHE_MIN_GHOSTS)) {
+    bodycache_remove(queues[BODYCACHE_QUEUE_GHOST].tail);
+  }
+}
+
+/**
+ * Checks that an entry holds the current contents of a file.
+ *
+ * @param entry the entry.
+ * @param st the current stat result of the file.
+ * @return 1, if the file is unchanged. Otherwise, 0.
+ */
+static int
+bodycache_matches(const struct bodycache_entry * entry,
+    const struct stat * st)
+{
+  return (entry->dev == st->st_dev) && (entry->ino == st->st_ino)
+      && (entry->size == st->st_size)
+      && (entry->mtime.tv_sec == st->st_mtim.tv_sec)
+      && (entry->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+/**
+ * Sets the memory budget and allocates the hash table.
+ *
+ * @param budget the budget in bytes, 0 to disable the cache.
+ */
+void
+bodycache_init(size_t budget)
+{
+  cache_budget = budget;
+  if (budget == 0) {
+    return;
+  }
+  /* a load factor of at most 1/2 for files of 1 KB */
+  for (cache_nbuckets = 64; cache_nbuckets < budget / 512;
+      cache_nbuckets *= 2) {
+  }
+  if ((cache_buckets = calloc(cache_nbuckets, sizeof(*cache_buckets)))
+      == NULL) {
+    warn("cannot allocate content cache");
+    cache_budget = 0;
+  }
+}
+
+/**
+ * Looks up the contents of a file. An entry of a changed file is dropped.
+ *
+ * @param path the resolved path of the file.
+ * @param st the current stat result of the file.
+ * @return the entry, to be released with bodycache_put(), or NULL if the
+ * file is not cached.
+ */
+struct bodycache_entry *
+bodycache_get(const char * path, const struct stat * st)
+{
+  struct bodycache_entry *entry;
+
+  if ((cache_budget == 0) || (st->st_size > BODYCACHE_FILE_MAX)) {
+    return NULL;
+  }
+  (void) pthread_mutex_lock(&cache_lock);
+  if ((entry = bodycache_find(path, bodycache_hash(path))) != NULL) {
+    if (entry->queue == BODYCACHE_QUEUE_GHOST) {
+      entry = NULL;
+    } else if (!bodycache_matches(entry, st)) {
+      bodycache_remove(entry);
+      entry = NULL;
+    } else {
+      if (entry->freq < BODYCACHE_FREQ_MAX) {
+        entry->freq++;
+      }
+      entry->refs++;
+    }
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+
+  return entry;
+}
+
+/**
+ * Reads a small file into the cache. A ghost of the file, or an outdated
+ * entry, makes it enter the main queue.
+ *
+ * @param path the resolved path of the file.
+ * @param st the stat result of the file.
+ * @param headers the rendered entity header fields of the file.
+ * @param headers_len the length of headers.
+ * @param fd the file, which is read with pread(2).
+ * @return the new entry, to be released with bodycache_put(), or NULL if
+ * the file is not cached.
+ */
+struct bodycache_entry *
+bodycache_insert(const char * path, const struct stat * st,
+    const char * headers, size_t headers_len, int fd)
+{
+  struct bodycache_entry *entry;
+  struct bodycache_entry *old;
+  ssize_t n_bytes;
+  size_t len;
+  int queue;
+
+  if ((cache_budget == 0) || !S_ISREG(st->st_mode)
+      || (st->st_size > BODYCACHE_FILE_MAX)) {
+    return NULL;
+  }
+  if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+    warn("cannot cache %s", path);
+    return NULL;
+  }
+  entry->size = st->st_size;
+  if (((entry->path = strdup(path)) == NULL)
+      || ((entry->headers = malloc(headers_len)) == NULL)
+      || ((entry->body = malloc((entry->size > 0) ? entry->size : 1))
+          == NULL)) {
+    warn("cannot cache %s", path);
+    entry->refs = 1;
+    bodycache_release(entry);
+    return NULL;
+  }
+  for (len = 0; len < (size_t) entry->size; len += n_bytes) {
+    n_bytes = pread(fd, entry->body + len, entry->size - len, len);
+    if (n_bytes <= 0) {
+      if ((n_bytes < 0) && (errno == EINTR)) {
+        n_bytes = 0;
+        continue;
+      }
+      /* the file shrank, it is sent without the cache */
+      entry->refs = 1;
+      bodycache_release(entry);
+      return NULL;
+    }
+  }
+  memcpy(entry->headers, headers, headers_len);
+  entry->headers_len = headers_len;
+  entry->hash = bodycache_hash(path);
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->mtime = st->st_mtim;
+  entry->bytes = sizeof(*entry) + strlen(path) + headers_len + entry->size;
+  /* one reference for the cache, one for the caller */
+  entry->refs = 2;
+
+  (void) pthread_mutex_lock(&cache_lock);
+  queue = BODYCACHE_QUEUE_SMALL;
+  if ((old = bodycache_find(path, entry->hash)) != NULL) {
+    /* seen before */
+    queue = BODYCACHE_QUEUE_MAIN;
+    bodycache_remove(old);
+  }
+  entry->next = cache_buckets[entry->hash & (cache_nbuckets - 1)];
+  cache_buckets[entry->hash & (cache_nbuckets - 1)] = entry;
+  bodycache_push(entry, queue);
+  while (queues[BODYCACHE_QUEUE_SMALL].bytes
+      + queues[BODYCACHE_QUEUE_MAIN].bytes > cache_budget) {
+    bodycache_evict();
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+
+  return entry;
+}
+
+/**
+ * Releases an entry returned by bodycache_get() or bodycache_insert().
+ */
+void
+bodycache_put(struct bodycache_entry * entry)
+{
+  (void) pthread_mutex_lock(&cache_lock);
+  bodycache_release(entry);
+  (void) pthread_mutex_unlock(&cache_lock);
+}
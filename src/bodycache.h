@@ -0,0 +1,55 @@
+/*
+ * bodycache.h
+ *
+ * Cache of the contents of small files, with their entity header fields
+ * rendered, within a memory budget.
+ */
+
+#ifndef _SWS_BODYCACHE_H_
+#define _SWS_BODYCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <time.h>
+
+#define BODYCACHE_FILE_MAX (16 * 1024) /* largest file cached */
+#define BODYCACHE_DEFAULT_BUDGET (16 * 1024 * 1024) /* default memory */
+#define BODYCACHE_MAX_BUDGET (4096 * 1024) /* largest budget in KB */
+
+/**
+ * A cached file. Found with bodycache_get() and released with
+ * bodycache_put(); the contents stay valid until then, even if the entry
+ * is evicted meanwhile.
+ */
+struct bodycache_entry
+{
+  char *path; /* resolved path */
+  unsigned int hash; /* hash of path */
+  dev_t dev; /* device, inode, size and mtime of the file when cached */
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char *headers; /* Last-Modified, Content-Type and Content-Length fields */
+  size_t headers_len;
+  char *body; /* contents of the file, size bytes */
+  size_t bytes; /* memory charged to the budget */
+  int queue; /* BODYCACHE_QUEUE_?, in bodycache.c */
+  int freq; /* hits since the entry was last moved, up to 3 */
+  int refs; /* holders, plus 1 while the entry is cached */
+  struct bodycache_entry *next; /* next entry in the bucket */
+  struct bodycache_entry *newer; /* next entry towards the queue head */
+  struct bodycache_entry *older; /* next entry towards the queue tail */
+};
+
+void
+bodycache_init(size_t);
+struct bodycache_entry *
+bodycache_get(const char *, const struct stat *);
+struct bodycache_entry *
+bodycache_insert(const char *, const struct stat *, const char *, size_t,
+    int);
+void
+bodycache_put(struct bodycache_entry *);
+
+#endif /* !_SWS_BODYCACHE_H_ */
@@ -0,0 +1,167 @@
+/*
+ * bufpool.c
+ *
+ * Request input buffers come in tiers of 4 KB, 16 KB, 64 KB and so on, up
+ * to a limit, which caps the size of a request header. A connection starts
+ * with the smallest buffer and moves to the next tier only when a header
+ * does not fit. Free buffers are kept per tier, up to BUFPOOL_CACHE bytes,
+ * so that the rare large header does not cost a malloc(3) and free(3) of a
+ * large block every time. The pool is shared by the threads of a process.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+/**
+ * A free buffer, linked through its own memory.
+ */
+struct bufpool_free
+{
+  struct bufpool_free *next;
+};
+
+/**
+ * Free buffers of one tier.
+ */
+struct bufpool_tier
+{
+  struct bufpool_free *head;
+  int count;
+};
+
+static int
+bufpool_tier_of(size_t);
+static size_t
+bufpool_tier_size(int);
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_tier pool[BUFPOOL_TIERS];
+static size_t pool_limit = BUFPOOL_DEFAULT_LIMIT;
+
+/**
+ * Computes the size of the buffers of a tier. The last tier is cut to the
+ * limit.
+ *
+ * @param tier the tier, 0 for the smallest.
+ * @return the size in bytes.
+ */
+static size_t
+bufpool_tier_size(int tier)
+{
+  size_t size = (size_t) BUFPOOL_MIN << (2 * tier);
+
+  return (size < pool_limit) ? size : pool_limit;
+}
+
+/**
+ * Finds the smallest tier with buffers of at least the given size.
+ *
+ * @param size the size in bytes.
+ * @return the tier, or -1 if the size exceeds the limit.
+ */
+static int
+bufpool_tier_of(size_t size)
+{
+  int tier;
+
+  for (tier = 0; tier < BUFPOOL_TIERS; tier++) {
+    if (bufpool_tier_size(tier) >= size) {
+      return tier;
+    }
+    if (bufpool_tier_size(tier) == pool_limit) {
+      break;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Sets the largest buffer size. Must be called before buffers are handed
+ * out.
+ *
+ * @param limit the size in bytes, between BUFPOOL_MIN and BUFPOOL_MAX.
+ */
+void
+bufpool_init(size_t limit)
+{
+  pool_limit = limit;
+}
+
+/**
+ * Returns the largest buffer size.
+ *
+ * @return the size in bytes.
+ */
+size_t
+bufpool_limit(void)
+{
+  return pool_limit;
+}
+
+/**
+ * Takes a buffer of the smallest tier that holds the given size.
+ *
+ * @param min_size the least size in bytes.
+ * @param size set to the size of the buffer.
+ * @return the buffer. NULL, if min_size exceeds the limit (errno ENOBUFS)
+ * or no memory is left.
+ */
+char *
+bufpool_get(size_t min_size, size_t * size)
+{
+  struct bufpool_free *buf;
+  int tier;
+
+  if ((tier = bufpool_tier_of(min_size)) < 0) {
+    errno = ENOBUFS;
+    return NULL;
+  }
+  *size = bufpool_tier_size(tier);
+
+  pthread_mutex_lock(&pool_lock);
+  if ((buf = pool[tier].head) != NULL) {
+    pool[tier].head = buf->next;
+    pool[tier].count--;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  if (buf == NULL) {
+    return malloc(*size);
+  }
+  return (char *) buf;
+}
+
+/**
+ * Returns a buffer to the pool.
+ *
+ * @param buf the buffer from bufpool_get(), may be NULL.
+ * @param size the size of the buffer.
+ */
+void
+bufpool_put(char * buf, size_t size)
+{
+  struct bufpool_free *entry = (struct bufpool_free *) buf;
+  int tier;
+
+  if (buf == NULL) {
+    return;
+  }
+  tier = bufpool_tier_of(size);
+
+  pthread_mutex_lock(&pool_lock);
+  if ((size_t) (pool[tier].count + 1) * size <= BUFPOOL_CACHE) {
+    entry->next = pool[tier].head;
+    pool[tier].head = entry;
+    pool[tier].count++;
+    entry = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  free(entry);
+}
@@ -0,0 +1,27 @@
+/*
+ * bufpool.h
+ *
+ * Pool of request input buffers in sizes growing by a factor of four.
+ */
+
+#ifndef _SWS_BUFPOOL_H_
+#define _SWS_BUFPOOL_H_
+
+#include <sys/types.h>
+
+#define BUFPOOL_MIN (4 * 1024) /* smallest buffer, the first of a connection */
+#define BUFPOOL_MAX (1024 * 1024) /* largest buffer limit */
+#define BUFPOOL_DEFAULT_LIMIT (64 * 1024) /* default largest buffer */
+#define BUFPOOL_TIERS 5 /* 4 KB, 16 KB, 64 KB, 256 KB and 1 MB */
+#define BUFPOOL_CACHE (1024 * 1024) /* bytes of free buffers kept per size */
+
+void
+bufpool_init(size_t);
+size_t
+bufpool_limit(void);
+char *
+bufpool_get(size_t, size_t *);
+void
+bufpool_put(char *, size_t);
+
+#endif /* !_SWS_BUFPOOL_H_ */
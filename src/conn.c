@@ -0,0 +1,1228 @@
+/*
+ * conn.c
+ *
+ * Client connection handling: buffered output for non-blocking
+ * connections and direct output for blocking ones, and buffered input.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef sun
+#include <strings.h>
+#endif
+
+#include "bufpool.h"
+#include "conn.h"
+#include "coro.h"
+#include "mapcache.h"
+#include "net.h"
+#include "scan.h"
+#include "task.h"
+#include "util.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#endif
+
+static int
+conn_queue(struct connection *, const void *, size_t);
+static int
+conn_queue_file(struct connection *, int, off_t, off_t);
+static int
+conn_write_all(struct connection *, const void *, size_t);
+static int
+conn_blocked(struct connection *);
+#ifdef HAVE_SENDFILE
+static int
+conn_sendfile(struct connection *, int, off_t *, off_t);
+#endif
+static int
+conn_copies_files(struct connection *);
+static int
+conn_send_range(struct connection *, int, off_t, off_t);
+static int
+conn_flush_range(struct connection *, int);
+static int
+conn_chunk_size(const char *, off_t *);
+
+/**
+ * Initializes a connection for the given client socket. The connection is
+ * blocking by default.
+ *
+ * @param conn the connection to initialize.
+ * @param socket the client socket.
+ * @param client_ip the client address as a string.
+ */
+void
+conn_init(struct connection * conn, int socket, const char * client_ip)
+{
+  assert(conn != NULL);
+
+  bzero(conn, sizeof(*conn));
+  conn->socket = socket;
+  if (client_ip != NULL) {
+    strncpy(conn->client_ip, client_ip, sizeof(conn->client_ip) - 1);
+  }
+  conn->state = CONN_STATE_READING;
+  conn->body_fd = -1;
+  http_parser_init(&conn->parser, 0);
+  arena_init(&conn->arena);
+}
+
+/**
+ * Releases all resources held by the connection and closes the socket.
+ *
+ * @param conn the connection to close.
+ */
+void
+conn_close(struct connection * conn)
+{
+  conn_end_body(conn);
+  free(conn->out);
+  conn->out = NULL;
+  conn->out_len = conn->out_size = conn->out_sent = 0;
+  if (conn->task != NULL) {
+    task_free(conn->task);
+    conn->task = NULL;
+  }
+  arena_free(&conn->arena);
+  bufpool_put(conn->buf, conn->buf_size);
+  conn->buf = NULL;
+  conn->buf_len = conn->buf_size = conn->request_len = 0;
+  if (conn->socket >= 0) {
+    (void) close(conn->socket);
+    conn->socket = -1;
+  }
+}
+
+/**
+ * Appends data to the output queue of the connection.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+conn_queue(struct connection * conn, const void * buf, size_t len)
+{
+  if (conn->out_len + len > conn->out_size) {
+    size_t size;
+    char *out;
+
+    size = (conn->out_size == 0) ? BUF_SIZE : conn->out_size;
+    while (size < conn->out_len + len) {
+      size *= 2;
+    }
+    if ((out = realloc(conn->out, size)) == NULL) {
+      warn("cannot grow output buffer");
+      return -1;
+    }
+    conn->out = out;
+    conn->out_size = size;
+  }
+  if (buf != NULL) {
+    memcpy(conn->out + conn->out_len, buf, len);
+  }
+  conn->out_len += len;
+
+  return 0;
+}
+
+/**
+ * Appends len bytes of the given file, from offset on, to the output queue.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+conn_queue_file(struct connection * conn, int fd, off_t offset, off_t len)
+{
+  ssize_t n_bytes;
+
+  if (conn_queue(conn, NULL, len) < 0) {
+    return -1;
+  }
+  conn->out_len -= len;
+  while (len > 0) {
+    n_bytes = pread(fd, conn->out + conn->out_len, len, offset);
+    if (n_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("pread");
+      return -1;
+    } else if (n_bytes == 0) {
+      warnx("file shrank while sending it");
+      return -1;
+    }
+    conn->out_len += n_bytes;
+    offset += n_bytes;
+    len -= n_bytes;
+  }
+
+  return 0;
+}
+
+/**
+ * Writes data to the client. Blocking connections write all data before
+ * returning. Non-blocking and batching connections queue the data for
+ * conn_flush(); batching connections flush once CONN_BATCH_MAX bytes are
+ * queued.
+ *
+ * @param conn the client connection.
+ * @param buf the data to write.
+ * @param len the number of bytes to write.
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+conn_write(struct connection * conn, const void * buf, size_t len)
+{
+  if (conn->nonblocking) {
+    return conn_queue(conn, buf, len);
+  } else if (conn->batching) {
+    if (conn_queue(conn, buf, len) < 0) {
+      return -1;
+    }
+    if ((conn->out_len >= CONN_BATCH_MAX) && (conn_flush(conn) < 0)) {
+      return -1;
+    }
+    return 0;
+  }
+
+  return conn_write_all(conn, buf, len);
+}
+
+/**
+ * Writes all data to a blocking connection. The socket of a coroutine is
+ * non-blocking, the coroutine waits for it to become writable.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+conn_write_all(struct connection * conn, const void * buf, size_t len)
+{
+  return (coro_write(conn->socket, buf, len, CLIENT_TIMEOUT_SEC) < 0) ? -1
+      : 0;
+}
+
+/**
+ * Handles a send that would block. Non-blocking connections give up, other
+ * connections wait until the socket is writable.
+ *
+ * @param conn the client connection.
+ * @return 1, if the send is to be retried. 0, if the connection is
+ * non-blocking. -1 on error or timeout.
+ */
+static int
+conn_blocked(struct connection * conn)
+{
+  if (conn->nonblocking) {
+    return 0;
+  }
+  return (coro_wait(conn->socket, POLLOUT, CLIENT_TIMEOUT_SEC) == 0) ? 1 : -1;
+}
+
+/**
+ * Tells whether file bodies of a connection are copied to the socket,
+ * because the engine sends them itself or there is no sendfile(2).
+ *
+ * @param conn the client connection.
+ * @return 1, if file bodies are copied. Otherwise, 0.
+ */
+static int
+conn_copies_files(struct connection * conn)
+{
+#ifdef HAVE_SENDFILE
+  return conn->no_sendfile;
+#else
+  (void) conn;
+  return 1;
+#endif
+}
+
+#ifdef HAVE_SENDFILE
+/**
+ * Sends part of a file with sendfile(2), which hands the pages of the file
+ * to the socket without copying them through user space.
+ *
+ * @param conn the client connection.
+ * @param fd the file.
+ * @param offset the offset of the next byte to send, advanced as bytes are
+ * sent.
+ * @param end the offset one past the last byte to send.
+ * @return 1, if all bytes were sent. 0, if the socket would block. -1 on
+ * error; errno EINVAL or ENOSYS means that sendfile does not support the
+ * file and it is to be copied.
+ */
+static int
+conn_sendfile(struct connection * conn, int fd, off_t * offset, off_t end)
+{
+  ssize_t sent;
+  int blocked;
+
+  while (*offset < end) {
+    sent = sendfile(conn->socket, fd, offset, end - *offset);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        return -1;
+      } else if ((blocked = conn_blocked(conn)) <= 0) {
+        return blocked;
+      }
+    } else if (sent == 0) {
+      warnx("file shrank while sending it");
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  return 1;
+}
+#endif
+
+/**
+ * Sends len bytes of the given file, from offset on, to the client. The file
+ * descriptor is owned by the connection afterwards and closed once the file
+ * is sent.
+ *
+ * @param conn the client connection.
+ * @param fd the file. The file offset is not used, fd may be shared with
+ * the file cache.
+ * @param offset the first byte to send.
+ * @param len the number of bytes to send.
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+conn_send_file(struct connection * conn, int fd, off_t offset, off_t len)
+{
+  struct conn_part part;
+
+  part.head = NULL;
+  part.head_len = 0;
+  part.offset = offset;
+  part.end = offset + len;
+
+  return conn_send_parts(conn, fd, &part, 1);
+}
+
+/**
+ * Sends parts of the given file to the client, each after its head. The
+ * file descriptor is owned by the connection afterwards and closed once
+ * the parts are sent. Small bodies of non-blocking and batching
+ * connections are copied into the output queue, so that header and body go
+ * out with one send. Larger ones follow the queued output: non-blocking
+ * connections send them from conn_flush() later, batching connections
+ * right away. Where available, ranges go out with sendfile(2); a file that
+ * sendfile does not support is sent from its mapping, or copied through a
+ * buffer if it cannot be mapped.
+ *
+ * @param conn the client connection.
+ * @param fd the file. The file offset is not used, fd may be shared with
+ * the file cache.
+ * @param parts the parts, which must stay valid until they are sent, i.e.
+ * until the next request.
+ * @param count the number of parts.
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+conn_send_parts(struct connection * conn, int fd,
+    const struct conn_part * parts, int count)
+{
+  off_t len = 0;
+  off_t end = 0;
+  int retval = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    len += parts[i].head_len + (parts[i].end - parts[i].offset);
+    if (parts[i].end > end) {
+      end = parts[i].end;
+    }
+  }
+
+  if ((conn->nonblocking || conn->batching) && (conn->body_fd < 0)
+      && (len <= CONN_INLINE_FILE_MAX)) {
+    for (i = 0; (i < count) && (retval == 0); i++) {
+      if ((conn_queue(conn, parts[i].head, parts[i].head_len) < 0)
+          || (conn_queue_file(conn, fd, parts[i].offset,
+              parts[i].end - parts[i].offset) < 0)) {
+        retval = -1;
+      }
+    }
+    (void) close(fd);
+    return retval;
+  } else if (conn->nonblocking || conn->batching) {
+    if (conn->body_fd >= 0) {
+      warnx("connection already has a pending file");
+      (void) close(fd);
+      return -1;
+    }
+    conn->body_fd = fd;
+    conn->body_offset = conn->body_end = 0;
+    conn->body_parts = parts;
+    conn->body_parts_left = count;
+    conn->body_copy = conn_copies_files(conn);
+    conn->body_map = conn->body_copy ? mapcache_get(fd, end) : NULL;
+    if (conn_next_part(conn) < 0) {
+      return -1;
+    }
+    /* the queued header goes out with the start of the file */
+    return (conn->batching && (conn_flush(conn) < 0)) ? -1 : 0;
+  }
+
+  for (i = 0; (i < count) && (retval == 0); i++) {
+    if ((parts[i].head_len > 0)
+        && (conn_write_all(conn, parts[i].head, parts[i].head_len) < 0)) {
+      perror("write");
+      retval = -1;
+    } else {
+      retval = conn_send_range(conn, fd, parts[i].offset, parts[i].end);
+    }
+  }
+  (void) close(fd);
+
+  return retval;
+}
+
+/**
+ * Sends a range of a file to a blocking connection: with sendfile(2) where
+ * available, else from the mapping of the file or through a buffer.
+ *
+ * @param conn the client connection.
+ * @param fd the file.
+ * @param offset the first byte to send.
+ * @param end the offset one past the last byte to send.
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+conn_send_range(struct connection * conn, int fd, off_t offset, off_t end)
+{
+  struct mapcache_entry *map;
+  char buf[BUF_SIZE];
+  ssize_t n_bytes;
+  int retval;
+
+#ifdef HAVE_SENDFILE
+  off_t start = offset;
+
+  if (conn_sendfile(conn, fd, &offset, end) > 0) {
+    return 0;
+  } else if ((offset > start) || ((errno != EINVAL) && (errno != ENOSYS))) {
+    perror("sendfile");
+    return -1;
+  }
+  /* nothing was sent, the copy below starts at the beginning */
+#endif
+
+  if ((map = mapcache_get(fd, end)) != NULL) {
+    if ((retval = conn_write_all(conn, map->addr + offset, end - offset))
+        < 0) {
+      perror("write");
+    }
+    mapcache_put(map);
+    return retval;
+  }
+  while (offset < end) {
+    n_bytes = pread(fd, buf,
+        (end - offset < sizeof(buf)) ? end - offset : sizeof(buf), offset);
+    if (n_bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("pread");
+      return -1;
+    } else if (n_bytes == 0) {
+      warnx("file shrank while sending it");
+      return -1;
+    }
+    if (conn_write_all(conn, buf, n_bytes) < 0) {
+      perror("write");
+      return -1;
+    }
+    offset += n_bytes;
+  }
+
+  return 0;
+}
+
+/**
+ * Starts the next part of the pending file body: queues its head and makes
+ * its range the one to send.
+ *
+ * @param conn the client connection, whose current range is sent.
+ * @return 1, if a part was started. 0, if no part is left. -1 on error.
+ */
+int
+conn_next_part(struct connection * conn)
+{
+  const struct conn_part *part;
+
+  if (conn->body_parts_left == 0) {
+    return 0;
+  }
+  part = conn->body_parts++;
+  conn->body_parts_left--;
+  if (conn->out_sent == conn->out_len) {
+    conn->out_len = conn->out_sent = 0;
+  }
+  if (conn_queue(conn, part->head, part->head_len) < 0) {
+    return -1;
+  }
+  conn->body_offset = part->offset;
+  conn->body_end = part->end;
+
+  return 1;
+}
+
+/**
+ * Sends as much queued output of a non-blocking connection as the socket
+ * accepts without blocking. Batching connections send all queued output,
+ * waiting for the socket where needed. Output that is followed by a file is
+ * sent with MSG_MORE, so that a response header shares its segment with the
+ * beginning of the body instead of going out alone. A file that is not
+ * sent with sendfile(2) goes out from its mapping, or through a buffer.
+ * The parts of a file body are sent in turn, each head after the range
+ * before.
+ *
+ * @param conn the client connection.
+ * @return 1, if all output was sent. 0, if the socket would block.
+ * -1 on error.
+ */
+int
+conn_flush(struct connection * conn)
+{
+  ssize_t sent;
+  int send_flags;
+  int more;
+  int blocked;
+  int next;
+
+  send_flags = conn->nonblocking ? (MSG_DONTWAIT | MSG_NOSIGNAL)
+      : MSG_NOSIGNAL;
+  do {
+    more = ((conn->body_fd >= 0) && ((conn->body_offset < conn->body_end)
+        || (conn->body_parts_left > 0))) ? MSG_MORE : 0;
+    while (conn->out_sent < conn->out_len) {
+      sent = send(conn->socket, conn->out + conn->out_sent,
+          conn->out_len - conn->out_sent, send_flags | more);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+          return -1;
+        } else if ((blocked = conn_blocked(conn)) <= 0) {
+          return blocked;
+        }
+        continue;
+      }
+      conn->out_sent += sent;
+    }
+    conn->out_len = conn->out_sent = 0;
+
+    if ((blocked = conn_flush_range(conn, send_flags)) <= 0) {
+      return blocked;
+    }
+  } while ((next = conn_next_part(conn)) > 0);
+  if (next < 0) {
+    return -1;
+  }
+  conn_end_body(conn);
+
+  return 1;
+}
+
+/**
+ * Sends the current range of the pending file body, if any, after the
+ * queued output of a connection is sent.
+ *
+ * @param conn the client connection.
+ * @param send_flags the flags for send(2).
+ * @return 1, if the range was sent. 0, if the socket would block. -1 on
+ * error.
+ */
+static int
+conn_flush_range(struct connection * conn, int send_flags)
+{
+  char buf[BUF_SIZE];
+  ssize_t n_bytes;
+  ssize_t sent;
+  int more;
+  int blocked;
+
+#ifdef HAVE_SENDFILE
+  if ((conn->body_fd >= 0) && !conn->body_copy) {
+    off_t start = conn->body_offset;
+
+    if ((blocked = conn_sendfile(conn, conn->body_fd, &conn->body_offset,
+        conn->body_end)) == 0) {
+      return 0;
+    } else if (blocked < 0) {
+      if ((conn->body_offset != start)
+          || ((errno != EINVAL) && (errno != ENOSYS))) {
+        return -1;
+      }
+      /* copied below */
+      conn->body_copy = 1;
+      conn->body_map = mapcache_get(conn->body_fd, conn->body_end);
+    }
+  }
+#endif
+  while ((conn->body_fd >= 0) && (conn->body_offset < conn->body_end)) {
+    off_t remain = conn->body_end - conn->body_offset;
+    const char *data = buf;
+
+    if ((conn->body_map != NULL) && (conn->body_end > conn->body_map->size)) {
+      warnx("file shrank while sending it");
+      return -1;
+    } else if (conn->body_map != NULL) {
+      data = conn->body_map->addr + conn->body_offset;
+      n_bytes = remain;
+    } else if ((n_bytes = pread(conn->body_fd, buf,
+        (remain < sizeof(buf)) ? remain : sizeof(buf), conn->body_offset))
+        <= 0) {
+      if ((n_bytes < 0) && (errno == EINTR)) {
+        continue;
+      }
+      warnx("cannot read file to send");
+      return -1;
+    }
+    more = ((conn->body_offset + n_bytes < conn->body_end)
+        || (conn->body_parts_left > 0)) ? MSG_MORE : 0;
+    sent = send(conn->socket, data, n_bytes, send_flags | more);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        return -1;
+      } else if ((blocked = conn_blocked(conn)) <= 0) {
+        return blocked;
+      }
+      continue;
+    }
+    conn->body_offset += sent;
+  }
+
+  return 1;
+}
+
+/**
+ * Closes the file body of the response, if any, and releases its mapping.
+ *
+ * @param conn the client connection.
+ */
+void
+conn_end_body(struct connection * conn)
+{
+  conn->body_parts = NULL;
+  conn->body_parts_left = 0;
+  if (conn->body_map != NULL) {
+    mapcache_put(conn->body_map);
+    conn->body_map = NULL;
+  }
+  if (conn->body_fd >= 0) {
+    (void) close(conn->body_fd);
+    conn->body_fd = -1;
+  }
+}
+
+/**
+ * Hands a non-blocking connection over to a child process that continues
+ * with blocking I/O. Used for work that cannot be done without blocking,
+ * such as running a CGI.
+ *
+ * @param conn the client connection.
+ * @return 0 in the child, 1 in the parent and -1 if no child was created.
+ */
+int
+conn_fork(struct connection * conn)
+{
+  int sock_flags;
+
+  switch (fork()) {
+  case -1:
+    warn("cannot fork child to handle client");
+    return -1;
+    /* NOTREACHED */
+    break;
+  case 0:
+    conn->state = CONN_STATE_CHILD;
+    conn->nonblocking = 0;
+    /* the socket may have been accepted non-blocking */
+    if (((sock_flags = fcntl(conn->socket, F_GETFL)) >= 0)
+        && (sock_flags & O_NONBLOCK)) {
+      (void) fcntl(conn->socket, F_SETFL, sock_flags & ~O_NONBLOCK);
+    }
+    /* output queued so far is written by the child */
+    if ((conn->out_len > conn->out_sent)
+        && (conn_write(conn, conn->out + conn->out_sent,
+            conn->out_len - conn->out_sent) < 0)) {
+      warn("write failed");
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+    /* NOTREACHED */
+    break;
+  default:
+    conn->state = CONN_STATE_DETACHED;
+    return 1;
+    /* NOTREACHED */
+    break;
+  }
+}
+
+/**
+ * Makes room in buf for more input. A connection without buf gets the
+ * smallest one. Once buf is full, the bytes before request_len, i.e. the
+ * answered request, are dropped, so its views must not be used anymore. A
+ * buf that is still full with an incomplete request header is replaced by
+ * one of the next size.
+ *
+ * @param conn the client connection.
+ * @return the number of bytes that fit into buf, without the terminating
+ * null byte. 0, if buf has reached the size limit or no memory is left.
+ */
+size_t
+conn_input_space(struct connection * conn)
+{
+  size_t size;
+  char *buf;
+
+  if ((conn->buf == NULL)
+      && ((conn->buf = bufpool_get(BUFPOOL_MIN, &conn->buf_size)) == NULL)) {
+    warn("cannot allocate input buffer");
+    return 0;
+  }
+
+  /* leave space for terminating null byte */
+  if ((conn->buf_len == conn->buf_size - 1) && (conn->request_len > 0)) {
+    if (conn->request_len > conn->buf_len) {
+      conn->request_len = conn->buf_len;
+    }
+    conn->buf_len -= conn->request_len;
+    memmove(conn->buf, conn->buf + conn->request_len, conn->buf_len);
+    conn->request_len = 0;
+  }
+  if ((conn->buf_len == conn->buf_size - 1) && !conn_request_complete(conn)) {
+    /* the parser keeps offsets, so the input can move */
+    if ((buf = bufpool_get(conn->buf_size + 1, &size)) == NULL) {
+      if (errno != ENOBUFS) {
+        warn("cannot grow input buffer");
+      }
+      return 0;
+    }
+    memcpy(buf, conn->buf, conn->buf_len);
+    bufpool_put(conn->buf, conn->buf_size);
+    conn->buf = buf;
+    conn->buf_size = size;
+  }
+  conn->buf[conn->buf_len] = '\0';
+
+  return conn->buf_size - 1 - conn->buf_len;
+}
+
+/**
+ * Reads the input available on the socket into buf, with one read, after
+ * making room with conn_input_space().
+ *
+ * @param conn the client connection.
+ * @param timeout_sec the time to wait for input in seconds, or -1 to wait
+ * forever.
+ * @return the number of bytes read, 0 at end of input and -1 on error,
+ * timeout (errno ETIMEDOUT) or a full buffer (errno ENOBUFS).
+ */
+ssize_t
+conn_fill(struct connection * conn, int timeout_sec)
+{
+  ssize_t n_bytes;
+  size_t space;
+  int wait_status;
+
+  if ((space = conn_input_space(conn)) == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  /* a coroutine waits in coro_read(), a blocking socket only here */
+  if (!coro_active() && (timeout_sec >= 0)) {
+    if ((wait_status = coro_wait(conn->socket, POLLIN, timeout_sec)) != 0) {
+      if (wait_status > 0) {
+        errno = ETIMEDOUT;
+      }
+      return -1;
+    }
+  }
+  if ((n_bytes = coro_read(conn->socket, conn->buf + conn->buf_len, space,
+      timeout_sec)) > 0) {
+    conn->buf_len += n_bytes;
+    conn->buf[conn->buf_len] = '\0';
+  }
+
+  return n_bytes;
+}
+
+/**
+ * Returns the buffered input that follows the current request, e.g. its
+ * body, without consuming it.
+ *
+ * @param conn the client connection, whose request has been parsed.
+ * @param len set to the number of bytes available.
+ * @return the start of the input.
+ */
+const char *
+conn_peek(struct connection * conn, size_t * len)
+{
+  if (conn->buf_len <= conn->request_len) {
+    *len = 0;
+    return "";
+  }
+  *len = conn->buf_len - conn->request_len;
+
+  return conn->buf + conn->request_len;
+}
+
+/**
+ * Consumes buffered input, which then belongs to the current request and is
+ * not taken for a pipelined request.
+ *
+ * @param conn the client connection.
+ * @param len the number of bytes, at most what conn_peek() returned.
+ */
+void
+conn_consume(struct connection * conn, size_t len)
+{
+  conn->request_len += len;
+}
+
+/**
+ * Reads a line of input that follows the current request, e.g. a chunk
+ * size line.
+ *
+ * @param conn the client connection, whose request has been parsed.
+ * @param dst the buffer for the line, which is null-terminated and has its
+ * CRLF or LF removed.
+ * @param dst_size the size of dst.
+ * @param timeout_sec the time to wait for each read in seconds, or -1 to
+ * wait forever.
+ * @return the length of the line. -1 on error, timeout, end of input or if
+ * the line does not fit (errno EMSGSIZE).
+ */
+ssize_t
+conn_readline(struct connection * conn, char * dst, size_t dst_size,
+    int timeout_sec)
+{
+  const char *data;
+  size_t scanned = 0;
+  size_t avail;
+  size_t len;
+  ssize_t n_bytes;
+
+  for (;;) {
+    data = conn_peek(conn, &avail);
+    scanned += scan_find(data + scanned, avail - scanned, '\n', '\n', '\n');
+    if (scanned < avail) {
+      break;
+    } else if (avail >= dst_size) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if ((n_bytes = conn_fill(conn, timeout_sec)) <= 0) {
+      if (n_bytes == 0) {
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+  }
+
+  len = scanned;
+  if ((len > 0) && (data[len - 1] == '\r')) {
+    len--;
+  }
+  if (len >= dst_size) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  memcpy(dst, data, len);
+  dst[len] = '\0';
+  conn_consume(conn, scanned + 1);
+
+  return len;
+}
+
+/**
+ * Reads exactly len bytes of input that follows the current request, e.g.
+ * a body of known length. Buffered input is taken first; large remainders
+ * are read straight into dst.
+ *
+ * @param conn the client connection, whose request has been parsed.
+ * @param dst the buffer to fill.
+ * @param len the number of bytes to read.
+ * @param timeout_sec the time to wait for each read in seconds, or -1 to
+ * wait forever.
+ * @return len on success. -1 on error, timeout or end of input.
+ */
+ssize_t
+conn_read_exact(struct connection * conn, void * dst, size_t len,
+    int timeout_sec)
+{
+  char *out = dst;
+  const char *data;
+  size_t done = 0;
+  size_t avail;
+  ssize_t n_bytes;
+  int wait_status;
+
+  while (done < len) {
+    data = conn_peek(conn, &avail);
+    if (avail > 0) {
+      if (avail > len - done) {
+        avail = len - done;
+      }
+      memcpy(out + done, data, avail);
+      conn_consume(conn, avail);
+      done += avail;
+      continue;
+    }
+
+    if (len - done < BUFPOOL_MIN / 2) {
+      n_bytes = conn_fill(conn, timeout_sec);
+    } else {
+      /* not worth copying through buf */
+      if (!coro_active() && (timeout_sec >= 0)
+          && ((wait_status = coro_wait(conn->socket, POLLIN, timeout_sec))
+              != 0)) {
+        if (wait_status > 0) {
+          errno = ETIMEDOUT;
+        }
+        return -1;
+      }
+      if ((n_bytes = coro_read(conn->socket, out + done, len - done,
+          timeout_sec)) > 0) {
+        done += n_bytes;
+      }
+    }
+    if (n_bytes <= 0) {
+      if (n_bytes == 0) {
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+  }
+
+  return len;
+}
+
+/**
+ * Prepares decoding a chunked request body.
+ *
+ * @param chunked the decoder state.
+ */
+void
+conn_chunked_init(struct conn_chunked * chunked)
+{
+  chunked->state = CHUNKED_SIZE;
+  chunked->remain = 0;
+}
+
+/**
+ * Parses a chunk size line: hexadecimal digits, optionally followed by
+ * chunk extensions, which are ignored.
+ *
+ * @param line the line, without CRLF.
+ * @param size set to the chunk size.
+ * @return 0 on success. -1, if the line is malformed or the size too large.
+ */
+static int
+conn_chunk_size(const char * line, off_t * size)
+{
+  const char *pos;
+  off_t value = 0;
+  int digit;
+
+  for (pos = line; *pos != '\0'; pos++) {
+    if ((*pos >= '0') && (*pos <= '9')) {
+      digit = *pos - '0';
+    } else if ((*pos >= 'a') && (*pos <= 'f')) {
+      digit = *pos - 'a' + 10;
+    } else if ((*pos >= 'A') && (*pos <= 'F')) {
+      digit = *pos - 'A' + 10;
+    } else {
+      break;
+    }
+    /* keep clear of the sign bit */
+    if (value >= ((off_t) 1 << (sizeof(off_t) * 8 - 6))) {
+      return -1;
+    }
+    value = value * 16 + digit;
+  }
+  if ((pos == line)
+      || ((*pos != '\0') && (*pos != ';') && (*pos != ' ')
+          && (*pos != '\t'))) {
+    return -1;
+  }
+  *size = value;
+
+  return 0;
+}
+
+/**
+ * Reads the next part of a request body sent with the chunked transfer
+ * coding and returns it decoded. Data is returned as it arrives, at most
+ * what is buffered or one read of the socket, so that a body of any length
+ * passes through buf. Chunk extensions and trailer fields are skipped.
+ *
+ * @param conn the client connection, whose request has been parsed.
+ * @param chunked the decoder state, from conn_chunked_init().
+ * @param dst the buffer for the decoded data.
+ * @param len the size of dst.
+ * @param timeout_sec the time to wait for each read in seconds, or -1 to
+ * wait forever.
+ * @return the number of bytes stored in dst, 0 at the end of the body. -1
+ * on error, timeout, end of input or a malformed body (errno EINVAL).
+ */
+ssize_t
+conn_read_chunked(struct connection * conn, struct conn_chunked * chunked,
+    void * dst, size_t len, int timeout_sec)
+{
+  char line[CONN_CHUNK_LINE_MAX];
+  const char *data;
+  size_t avail;
+  ssize_t n_bytes;
+
+  for (;;) {
+    switch (chunked->state) {
+    case CHUNKED_SIZE:
+      if (conn_readline(conn, line, sizeof(line), timeout_sec) < 0) {
+        return -1;
+      } else if (conn_chunk_size(line, &chunked->remain) < 0) {
+        errno = EINVAL;
+        return -1;
+      }
+      chunked->state = (chunked->remain > 0) ? CHUNKED_DATA : CHUNKED_TRAILER;
+      break;
+    case CHUNKED_DATA:
+      data = conn_peek(conn, &avail);
+      if (avail == 0) {
+        if ((n_bytes = conn_fill(conn, timeout_sec)) <= 0) {
+          if (n_bytes == 0) {
+            errno = ECONNRESET;
+          }
+          return -1;
+        }
+        data = conn_peek(conn, &avail);
+      }
+      if ((off_t) avail > chunked->remain) {
+        avail = chunked->remain;
+      }
+      if (avail > len) {
+        avail = len;
+      }
+      memcpy(dst, data, avail);
+      conn_consume(conn, avail);
+      if ((chunked->remain -= avail) == 0) {
+        chunked->state = CHUNKED_DATA_END;
+      }
+      return avail;
+      /* NOTREACHED */
+      break;
+    case CHUNKED_DATA_END:
+      if ((n_bytes = conn_readline(conn, line, sizeof(line), timeout_sec))
+          != 0) {
+        if (n_bytes > 0) {
+          errno = EINVAL;
+        }
+        return -1;
+      }
+      chunked->state = CHUNKED_SIZE;
+      break;
+    case CHUNKED_TRAILER:
+      if ((n_bytes = conn_readline(conn, line, sizeof(line), timeout_sec))
+          < 0) {
+        return -1;
+      } else if (n_bytes == 0) {
+        chunked->state = CHUNKED_DONE;
+      }
+      break;
+    default:
+      return 0;
+      /* NOTREACHED */
+      break;
+    }
+  }
+}
+
+/**
+ * Checks whether buf holds a complete request header. Only parses the bytes
+ * received since the last call.
+ *
+ * @param conn the client connection.
+ * @return 1, if the request is complete. Otherwise, 0.
+ */
+int
+conn_request_complete(struct connection * conn)
+{
+  return http_parse(&conn->parser, conn->buf, conn->buf_len);
+}
+
+/**
+ * Checks whether a complete pipelined request follows the current one. The
+ * parser moves on to the next request, which is kept parsed for
+ * conn_next_request().
+ *
+ * @param conn the client connection, whose request has been answered.
+ * @return 1, if the next request is complete. Otherwise, 0.
+ */
+int
+conn_pipelined(struct connection * conn)
+{
+  if (conn->parser.base != conn->request_len) {
+    http_parser_init(&conn->parser, conn->request_len);
+  }
+  return http_parse(&conn->parser, conn->buf, conn->buf_len);
+}
+
+/**
+ * Gives a buf larger than BUFPOOL_MIN back to the pool once the request
+ * header in it has been taken apart. The input that follows the request,
+ * e.g. a body or pipelined requests, moves to the smallest buffer that
+ * holds it. The request and its views are dropped.
+ *
+ * @param conn the client connection, whose request has been parsed.
+ */
+void
+conn_shrink(struct connection * conn)
+{
+  size_t remain;
+  size_t size;
+  char *buf;
+
+  if (conn->buf_size <= BUFPOOL_MIN) {
+    return;
+  }
+  if (conn->request_len > conn->buf_len) {
+    conn->request_len = conn->buf_len;
+  }
+  remain = conn->buf_len - conn->request_len;
+  if ((buf = bufpool_get(remain + 1, &size)) == NULL) {
+    /* keep the large buffer */
+    return;
+  } else if (size >= conn->buf_size) {
+    bufpool_put(buf, size);
+    return;
+  }
+  memcpy(buf, conn->buf + conn->request_len, remain);
+  buf[remain] = '\0';
+  bufpool_put(conn->buf, conn->buf_size);
+  conn->buf = buf;
+  conn->buf_size = size;
+  conn->buf_len = remain;
+  conn->request_len = 0;
+  http_parser_init(&conn->parser, 0);
+}
+
+/**
+ * Prepares a connection that stays open for the next request. The answered
+ * request is dropped from buf, pipelined input that follows it is kept.
+ * Output that is still queued is kept as well. The memory of the answered
+ * request is released, and buf as well if no input is left.
+ *
+ * @param conn the client connection, whose request has been answered.
+ */
+void
+conn_next_request(struct connection * conn)
+{
+  if (conn->request_len > conn->buf_len) {
+    conn->request_len = conn->buf_len;
+  }
+  conn->buf_len -= conn->request_len;
+  if (conn->buf_len > 0) {
+    memmove(conn->buf, conn->buf + conn->request_len, conn->buf_len);
+    conn->buf[conn->buf_len] = '\0';
+  } else {
+    /* an idle connection holds no buffer */
+    bufpool_put(conn->buf, conn->buf_size);
+    conn->buf = NULL;
+    conn->buf_size = 0;
+  }
+  /* keep what conn_pipelined() parsed of the next request */
+  if ((conn->request_len > 0) && (conn->parser.base == conn->request_len)) {
+    http_parser_rebase(&conn->parser, 0);
+  } else {
+    http_parser_init(&conn->parser, 0);
+  }
+  conn->request_len = 0;
+  conn->keep_alive = 0;
+  conn->state = CONN_STATE_READING;
+  if (conn->task != NULL) {
+    task_free(conn->task);
+    conn->task = NULL;
+  }
+  arena_reset(&conn->arena);
+}
+
+/**
+ * Appends the connection to the list with the given deadline.
+ *
+ * @param list the list ordered by deadline.
+ * @param conn the connection to append.
+ * @param deadline the new deadline of the connection.
+ */
+void
+conn_list_append(struct conn_list * list, struct connection * conn,
+    time_t deadline)
+{
+  conn->deadline = deadline;
+  conn->list = list;
+  conn->next = NULL;
+  conn->prev = list->tail;
+  if (list->tail != NULL) {
+    list->tail->next = conn;
+  } else {
+    list->head = conn;
+  }
+  list->tail = conn;
+}
+
+/**
+ * Removes the connection from the list holding it, if any.
+ *
+ * @param conn the connection to remove.
+ */
+void
+conn_list_remove(struct connection * conn)
+{
+  struct conn_list *list = conn->list;
+
+  if (list == NULL) {
+    return;
+  }
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    list->head = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  } else {
+    list->tail = conn->prev;
+  }
+  conn->prev = conn->next = NULL;
+  conn->list = NULL;
+}
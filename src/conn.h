@@ -0,0 +1,175 @@
+/*
+ * conn.h
+ *
+ * Per-connection state shared by the server engines and the HTTP code.
+ */
+
+#ifndef _SWS_CONN_H_
+#define _SWS_CONN_H_
+
+#include <sys/types.h>
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include "arena.h"
+#include "mapcache.h"
+#include "parser.h"
+#include "util.h"
+
+#define CONN_STATE_READING  1 /* waiting for a complete request */
+#define CONN_STATE_WRITING  2 /* flushing queued response data */
+#define CONN_STATE_CLOSING  3 /* done, connection is to be closed */
+#define CONN_STATE_DETACHED 4 /* a child process took over the connection */
+#define CONN_STATE_CHILD    5 /* this process is the child that took over */
+#define CONN_STATE_TASK     6 /* waiting for the task pool, see run_stage() */
+
+#define CONN_INLINE_FILE_MAX (16 * 1024) /* files copied into the queue */
+#define CONN_CHUNK_LINE_MAX 1024 /* longest chunk size or trailer line */
+
+#define CHUNKED_SIZE     0 /* expecting a chunk size line */
+#define CHUNKED_DATA     1 /* within the data of a chunk */
+#define CHUNKED_DATA_END 2 /* expecting the CRLF after the data of a chunk */
+#define CHUNKED_TRAILER  3 /* expecting trailer fields or the empty line */
+#define CHUNKED_DONE     4 /* the body is complete */
+#define CONN_BATCH_MAX (64 * 1024) /* queued output that triggers a flush */
+
+struct conn_list;
+struct task;
+
+/**
+ * A client connection.
+ *
+ * Blocking connections write straight to the socket, unless batching is set.
+ * Non-blocking connections (event loop) queue the response in out and
+ * optionally a file body, which are sent by conn_flush() whenever the socket
+ * becomes writable. Queued responses of pipelined requests are sent together.
+ *
+ * buf is taken from the buffer pool when input arrives and given back once
+ * the connection is idle. It starts at BUFPOOL_MIN bytes and grows to the
+ * next size of the pool, up to bufpool_limit(), while a request header does
+ * not fit. buf may hold more than the current request: bytes of pipelined
+ * requests that follow it are kept by conn_next_request(). parser parses
+ * the request in buf as it arrives. Input after the request, such as a
+ * body, is read through buf as well, with conn_peek(), conn_readline() and
+ * conn_read_exact(); consumed input counts towards request_len.
+ *
+ * What the request needs beyond buf, e.g. its path, is allocated from arena,
+ * which is emptied by conn_next_request().
+ */
+struct connection
+{
+  int socket; /* client socket */
+  char client_ip[INET6_ADDRSTRLEN]; /* client address for logging */
+  int nonblocking; /* 1, if output is queued instead of written */
+  int no_sendfile; /* 1, if the engine sends file bodies itself */
+  int batching; /* 1, if a blocking connection queues until conn_flush() */
+  int state; /* CONN_STATE_? */
+  char *buf; /* request input, null-terminated, or NULL */
+  size_t buf_size; /* allocated size of buf */
+  size_t buf_len; /* bytes of request input in buf */
+  size_t request_len; /* bytes of buf taken by the current request */
+  struct http_parser parser; /* parse state of the request in buf */
+  struct arena arena; /* memory of the current request */
+  char *out; /* queued response data */
+  size_t out_len; /* bytes queued in out */
+  size_t out_size; /* allocated size of out */
+  size_t out_sent; /* bytes of out already sent */
+  int body_fd; /* file to send after out, or -1 */
+  off_t body_offset; /* next byte of body_fd to send */
+  off_t body_end; /* offset one past the last byte of body_fd to send */
+  int body_copy; /* 1, if body_fd is copied because sendfile fails on it */
+  struct mapcache_entry *body_map; /* mapping of body_fd, or NULL */
+  const struct conn_part *body_parts; /* parts after the current range */
+  int body_parts_left; /* number of body_parts */
+  int keep_alive; /* 1, if the connection stays open after the response */
+  int version_minor; /* HTTP/1.x version of the current request */
+  int requests; /* number of requests received on the connection */
+  struct task *task; /* stage of the current request on the pool, or NULL */
+  time_t deadline; /* time at which the connection times out */
+  struct conn_list *list; /* list holding the connection, or NULL */
+  struct connection *prev; /* struct conn_list links */
+  struct connection *next;
+};
+
+/**
+ * A part of a file body: text sent before it, then a range of the file.
+ * The parts of a multipart/byteranges body each start with a boundary.
+ */
+struct conn_part
+{
+  const char *head; /* text sent before the range */
+  size_t head_len; /* length of head, may be 0 */
+  off_t offset; /* first byte of the range */
+  off_t end; /* offset one past the last byte of the range */
+};
+
+/**
+ * State of decoding a request body with the chunked transfer coding.
+ */
+struct conn_chunked
+{
+  int state; /* CHUNKED_? */
+  off_t remain; /* bytes left of the current chunk */
+};
+
+/**
+ * Connections ordered by deadline. Every deadline in a list is the time of
+ * the last activity plus the same timeout, so appending keeps the list
+ * sorted. Connections with a different timeout go into another list.
+ */
+struct conn_list
+{
+  struct connection *head;
+  struct connection *tail;
+};
+
+void
+conn_init(struct connection *, int, const char *);
+void
+conn_close(struct connection *);
+int
+conn_write(struct connection *, const void *, size_t);
+int
+conn_send_file(struct connection *, int, off_t, off_t);
+int
+conn_send_parts(struct connection *, int, const struct conn_part *, int);
+int
+conn_next_part(struct connection *);
+int
+conn_flush(struct connection *);
+void
+conn_end_body(struct connection *);
+int
+conn_fork(struct connection *);
+size_t
+conn_input_space(struct connection *);
+ssize_t
+conn_fill(struct connection *, int);
+const char *
+conn_peek(struct connection *, size_t *);
+void
+conn_consume(struct connection *, size_t);
+ssize_t
+conn_readline(struct connection *, char *, size_t, int);
+ssize_t
+conn_read_exact(struct connection *, void *, size_t, int);
+void
+conn_chunked_init(struct conn_chunked *);
+ssize_t
+conn_read_chunked(struct connection *, struct conn_chunked *, void *, size_t,
+    int);
+int
+conn_request_complete(struct connection *);
+int
+conn_pipelined(struct connection *);
+void
+conn_shrink(struct connection *);
+void
+conn_next_request(struct connection *);
+void
+conn_list_append(struct conn_list *, struct connection *, time_t);
+void
+conn_list_remove(struct connection *);
+
+#endif /* !_SWS_CONN_H_ */
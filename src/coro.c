@@ -0,0 +1,625 @@
+/*
+ * coro.c
+ *
+ * Coroutine server engine. Every client is served by the sequential
+ * handle_client() running as a coroutine on its own stack. Reads and writes
+ * that would block register the descriptor with epoll and switch back to the
+ * scheduler, which resumes the coroutine once the descriptor is ready or its
+ * timeout passed. The request handling code stays straight-line blocking
+ * code, while one process serves many clients with a small stack each.
+ *
+ * Outside of a coroutine, coro_wait(), coro_read() and coro_write() simply
+ * block, so the same code serves the fork and thread pool engines.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "coro.h"
+
+#ifdef HAVE_CORO
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "net.h"
+#include "task.h"
+#include "util.h"
+
+#define CORO_EVENT_MAX 64 /* events fetched per epoll_wait */
+
+/**
+ * A coroutine and the descriptor it waits for.
+ */
+struct coro
+{
+  ucontext_t ctx; /* saved context while suspended */
+  char *stack; /* stack mapping, starting with a guard page */
+  void (*fn)(void *); /* function run by the coroutine */
+  void *arg;
+  int fd; /* descriptor last registered with epoll, or -1 */
+  int timed_out; /* 1, if the last wait ended by timeout */
+  int done; /* 1, once fn returned */
+  time_t deadline; /* end of the current wait */
+  int heap_index; /* position in the timeout heap, or -1 */
+};
+
+/**
+ * State of the scheduler. There is one per process.
+ */
+struct coro_sched
+{
+  int epfd; /* epoll instance */
+  ucontext_t ctx; /* scheduler context */
+  struct coro *current; /* running coroutine, or NULL */
+  struct coro **heap; /* waiting coroutines, min-heap by deadline */
+  int heap_len;
+  int heap_size;
+  char *pool[CORO_POOL_MAX]; /* unused stacks */
+  int pool_len;
+  size_t page_size;
+};
+
+/**
+ * Arguments of a client coroutine.
+ */
+struct coro_client
+{
+  int sock;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  struct flags *flag;
+};
+
+static struct coro_sched sched;
+
+static void
+heap_swap(int, int);
+static void
+heap_up(int);
+static void
+heap_down(int);
+static int
+heap_push(struct coro *);
+static void
+heap_remove(struct coro *);
+static struct coro *
+coro_create(void (*)(void *), void *);
+static void
+coro_entry(void);
+static void
+coro_free(struct coro *);
+static void
+coro_resume(struct coro *);
+static int
+coro_yield_fd(int, int, int);
+static void
+coro_client_main(void *);
+static void
+coro_accept(struct flags *, int);
+
+/**
+ * Swaps two entries of the timeout heap.
+ */
+static void
+heap_swap(int i, int j)
+{
+  struct coro *tmp = sched.heap[i];
+
+  sched.heap[i] = sched.heap[j];
+  sched.heap[j] = tmp;
+  sched.heap[i]->heap_index = i;
+  sched.heap[j]->heap_index = j;
+}
+
+/**
+ * Moves entry i of the timeout heap up to its place.
+ */
+static void
+heap_up(int i)
+{
+  while ((i > 0)
+      && (sched.heap[(i - 1) / 2]->deadline > sched.heap[i]->deadline)) {
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+/**
+ * Moves entry i of the timeout heap down to its place.
+ */
+static void
+heap_down(int i)
+{
+  int child;
+
+  while ((child = 2 * i + 1) < sched.heap_len) {
+    if ((child + 1 < sched.heap_len)
+        && (sched.heap[child + 1]->deadline < sched.heap[child]->deadline)) {
+      child++;
+    }
+    if (sched.heap[i]->deadline <= sched.heap[child]->deadline) {
+      break;
+    }
+    heap_swap(i, child);
+    i = child;
+  }
+}
+
+/**
+ * Adds a waiting coroutine to the timeout heap.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+heap_push(struct coro * coro)
+{
+  if (sched.heap_len == sched.heap_size) {
+    int size = (sched.heap_size == 0) ? CORO_EVENT_MAX : sched.heap_size * 2;
+    struct coro **heap;
+
+    if ((heap = realloc(sched.heap, size * sizeof(*heap))) == NULL) {
+      warn("cannot grow timeout heap");
+      return -1;
+    }
+    sched.heap = heap;
+    sched.heap_size = size;
+  }
+  coro->heap_index = sched.heap_len++;
+  sched.heap[coro->heap_index] = coro;
+  heap_up(coro->heap_index);
+
+  return 0;
+}
+
+/**
+ * Removes a coroutine from the timeout heap, if it is in there.
+ */
+static void
+heap_remove(struct coro * coro)
+{
+  int i = coro->heap_index;
+
+  if (i < 0) {
+    return;
+  }
+  coro->heap_index = -1;
+  if (i != --sched.heap_len) {
+    sched.heap[i] = sched.heap[sched.heap_len];
+    sched.heap[i]->heap_index = i;
+    heap_up(i);
+    heap_down(sched.heap[i]->heap_index);
+  }
+}
+
+/**
+ * Creates a coroutine that runs fn(arg) once resumed. Stacks are taken from
+ * the pool or mapped with a guard page below them, so that an overflow
+ * faults instead of corrupting other memory. Only the pages a coroutine
+ * touches take up memory.
+ *
+ * @return the coroutine, or NULL on error.
+ */
+static struct coro *
+coro_create(void (*fn)(void *), void * arg)
+{
+  struct coro *coro;
+
+  if ((coro = calloc(1, sizeof(*coro))) == NULL) {
+    warn("cannot allocate coroutine");
+    return NULL;
+  }
+  if (sched.pool_len > 0) {
+    coro->stack = sched.pool[--sched.pool_len];
+  } else {
+    coro->stack = mmap(NULL, sched.page_size + CORO_STACK_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (coro->stack == MAP_FAILED) {
+      warn("cannot map coroutine stack");
+      free(coro);
+      return NULL;
+    }
+    if (mprotect(coro->stack, sched.page_size, PROT_NONE) < 0) {
+      warn("cannot protect coroutine stack");
+    }
+  }
+  coro->fn = fn;
+  coro->arg = arg;
+  coro->fd = -1;
+  coro->heap_index = -1;
+
+  if (getcontext(&coro->ctx) < 0) {
+    warn("getcontext");
+    coro_free(coro);
+    return NULL;
+  }
+  coro->ctx.uc_stack.ss_sp = coro->stack + sched.page_size;
+  coro->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+  /* returning from coro_entry continues in the scheduler */
+  coro->ctx.uc_link = &sched.ctx;
+  makecontext(&coro->ctx, coro_entry, 0);
+
+  return coro;
+}
+
+/**
+ * Start function of every coroutine.
+ */
+static void
+coro_entry(void)
+{
+  struct coro *coro = sched.current;
+
+  coro->fn(coro->arg);
+  coro->done = 1;
+}
+
+/**
+ * Releases a coroutine that is not running. Its stack goes back to the pool.
+ */
+static void
+coro_free(struct coro * coro)
+{
+  heap_remove(coro);
+  if (sched.pool_len < CORO_POOL_MAX) {
+    sched.pool[sched.pool_len++] = coro->stack;
+  } else {
+    (void) munmap(coro->stack, sched.page_size + CORO_STACK_SIZE);
+  }
+  free(coro);
+}
+
+/**
+ * Runs a coroutine until it waits or returns. Releases it if it returned.
+ */
+static void
+coro_resume(struct coro * coro)
+{
+  sched.current = coro;
+  if (swapcontext(&sched.ctx, &coro->ctx) < 0) {
+    err(EXIT_FAILURE, "swapcontext");
+  }
+  sched.current = NULL;
+  if (coro->done) {
+    coro_free(coro);
+  }
+}
+
+/**
+ * Suspends the running coroutine until fd is ready or the timeout passed.
+ *
+ * @param fd the descriptor to wait for.
+ * @param events POLLIN and/or POLLOUT.
+ * @param timeout_sec the time to wait in seconds, or -1 to wait forever.
+ * @return 0, if fd is ready. 1, if a timeout occurred. -1 on error.
+ */
+static int
+coro_yield_fd(int fd, int events, int timeout_sec)
+{
+  struct coro *coro = sched.current;
+  struct epoll_event ev;
+  int op;
+
+  ev.events = EPOLLONESHOT;
+  ev.events |= (events & POLLIN) ? EPOLLIN : 0;
+  ev.events |= (events & POLLOUT) ? EPOLLOUT : 0;
+  ev.data.ptr = coro;
+  /* a descriptor stays registered, disarmed, after its event fired */
+  op = (coro->fd == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(sched.epfd, op, fd, &ev) < 0) {
+    if ((errno != EEXIST) && (errno != ENOENT)) {
+      warn("epoll_ctl");
+      return -1;
+    }
+    op = (op == EPOLL_CTL_ADD) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(sched.epfd, op, fd, &ev) < 0) {
+      warn("epoll_ctl");
+      return -1;
+    }
+  }
+  coro->fd = fd;
+
+  if (timeout_sec >= 0) {
+    coro->deadline = time(NULL) + timeout_sec;
+    if (heap_push(coro) < 0) {
+      return -1;
+    }
+  }
+  coro->timed_out = 0;
+  if (swapcontext(&coro->ctx, &sched.ctx) < 0) {
+    err(EXIT_FAILURE, "swapcontext");
+  }
+
+  if (coro->timed_out) {
+    /* the registration is still armed */
+    (void) epoll_ctl(sched.epfd, EPOLL_CTL_DEL, fd, NULL);
+    coro->fd = -1;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Serves a client in a coroutine.
+ *
+ * @param arg the struct coro_client, freed here.
+ */
+static void
+coro_client_main(void * arg)
+{
+  struct coro_client client = *(struct coro_client *) arg;
+
+  free(arg);
+  handle_client(client.sock, &client.addr, client.addr_len, client.flag);
+}
+
+/**
+ * Accepts pending clients of the non-blocking server socket, at most
+ * flag->accept_batch of them, and starts a coroutine for each.
+ *
+ * @param flag user-provided flags.
+ * @param server_sock the server socket.
+ */
+static void
+coro_accept(struct flags * flag, int server_sock)
+{
+  struct coro_client *client;
+  struct coro *coro;
+  int accepted;
+
+  for (accepted = 0; accepted < flag->accept_batch; accepted++) {
+    if ((client = malloc(sizeof(*client))) == NULL) {
+      warn("cannot allocate client");
+      return;
+    }
+    client->addr_len = sizeof(client->addr);
+    client->sock = accept_socket(server_sock, &client->addr,
+        &client->addr_len, 1);
+    if (client->sock < 0) {
+      free(client);
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        perror("accept");
+      }
+      return;
+    }
+    client->flag = flag;
+
+    if ((coro = coro_create(coro_client_main, client)) == NULL) {
+      (void) close(client->sock);
+      free(client);
+      continue;
+    }
+    coro_resume(coro);
+  }
+}
+
+/**
+ * Serves clients with one coroutine each. Does not return.
+ *
+ * @param flag user-provided flags.
+ * @param server_sock the listening server socket.
+ */
+void
+run_coro_loop(struct flags * flag, int server_sock)
+{
+  struct epoll_event events[CORO_EVENT_MAX];
+  struct epoll_event ev;
+  struct coro *coro;
+  int sock_flags;
+  int threads;
+  int timeout;
+  time_t now;
+  int n;
+  int i;
+
+  /* a write to a closed connection must not kill all clients */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    err(EXIT_FAILURE, "cannot ignore SIGPIPE");
+  }
+
+  /* CPU-heavy stages run on the task pool, so that coroutines yield */
+  threads = (flag->tasks < 0) ? sysconf(_SC_NPROCESSORS_ONLN) : flag->tasks;
+  if ((threads > 0) && (task_pool_start(threads) < 0)) {
+    warnx("running CPU-heavy stages inline");
+  }
+
+  bzero(&sched, sizeof(sched));
+  sched.page_size = sysconf(_SC_PAGESIZE);
+  if ((sock_flags = fcntl(server_sock, F_GETFL)) < 0) {
+    err(EXIT_FAILURE, "fcntl");
+  }
+  if (fcntl(server_sock, F_SETFL, sock_flags | O_NONBLOCK) < 0) {
+    err(EXIT_FAILURE, "cannot make server socket non-blocking");
+  }
+  if ((sched.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    err(EXIT_FAILURE, "epoll_create1");
+  }
+  /* the server socket is the only entry without a coroutine */
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(sched.epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+    err(EXIT_FAILURE, "epoll_ctl");
+  }
+
+  for (;;) {
+    now = time(NULL);
+    if (sched.heap_len == 0) {
+      timeout = -1;
+    } else if (sched.heap[0]->deadline > now) {
+      timeout = (sched.heap[0]->deadline - now) * 1000;
+    } else {
+      timeout = 0;
+    }
+
+    if ((n = epoll_wait(sched.epfd, events, CORO_EVENT_MAX, timeout)) < 0) {
+      if (errno == EINTR) {
+        /* e.g. SIGCHLD of a CGI child */
+        continue;
+      }
+      err(EXIT_FAILURE, "epoll_wait");
+    }
+
+    for (i = 0; i < n; i++) {
+      if ((coro = events[i].data.ptr) == NULL) {
+        coro_accept(flag, server_sock);
+      } else {
+        heap_remove(coro);
+        coro_resume(coro);
+      }
+    }
+
+    now = time(NULL);
+    while ((sched.heap_len > 0) && (sched.heap[0]->deadline <= now)) {
+      coro = sched.heap[0];
+      heap_remove(coro);
+      coro->timed_out = 1;
+      coro_resume(coro);
+    }
+  }
+}
+
+#endif /* HAVE_CORO */
+
+/**
+ * Tells whether the caller runs in a coroutine.
+ *
+ * @return 1 inside a coroutine. Otherwise, 0.
+ */
+int
+coro_active(void)
+{
+#ifdef HAVE_CORO
+  return sched.current != NULL;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Waits until fd is ready for reading or writing. A coroutine yields to the
+ * scheduler meanwhile, other callers block in poll.
+ *
+ * @param fd the descriptor to wait for.
+ * @param events POLLIN and/or POLLOUT.
+ * @param timeout_sec the time to wait in seconds, or -1 to wait forever.
+ * @return 0, if fd is ready. 1, if a timeout occurred. -1 on error.
+ */
+int
+coro_wait(int fd, int events, int timeout_sec)
+{
+  struct pollfd pfd;
+  int retval;
+
+#ifdef HAVE_CORO
+  if (sched.current != NULL) {
+    return coro_yield_fd(fd, events, timeout_sec);
+  }
+#endif
+
+  /* poll, unlike select, works for descriptors beyond FD_SETSIZE */
+  pfd.fd = fd;
+  pfd.events = events;
+  pfd.revents = 0;
+  while (((retval = poll(&pfd, 1,
+      (timeout_sec < 0) ? -1 : timeout_sec * 1000)) < 0)
+      && (errno == EINTR)) {
+    /* interrupted, e.g. by SIGCHLD */
+  }
+
+  if (retval < 0) {
+    perror("poll");
+    return -1;
+  } else if (retval == 0) {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * Reads from fd like read(2), but waits for a non-blocking descriptor to
+ * become readable.
+ *
+ * @param fd the descriptor to read from.
+ * @param buf the buffer to fill.
+ * @param len the size of buf.
+ * @param timeout_sec the time to wait in seconds, or -1 to wait forever.
+ * @return the number of bytes read, 0 at end of file and -1 on error or
+ * timeout (errno ETIMEDOUT).
+ */
+ssize_t
+coro_read(int fd, void * buf, size_t len, int timeout_sec)
+{
+  ssize_t n_bytes;
+  int wait_status;
+
+  for (;;) {
+    if ((n_bytes = read(fd, buf, len)) >= 0) {
+      return n_bytes;
+    } else if (errno == EINTR) {
+      continue;
+    } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      return -1;
+    }
+    if ((wait_status = coro_wait(fd, POLLIN, timeout_sec)) != 0) {
+      if (wait_status > 0) {
+        errno = ETIMEDOUT;
+      }
+      return -1;
+    }
+  }
+}
+
+/**
+ * Writes all data to fd, waiting for a non-blocking descriptor to become
+ * writable where needed.
+ *
+ * @param fd the descriptor to write to.
+ * @param buf the data to write.
+ * @param len the number of bytes to write.
+ * @param timeout_sec the time to wait for each write in seconds, or -1 to
+ * wait forever.
+ * @return len on success. -1 on error or timeout (errno ETIMEDOUT).
+ */
+ssize_t
+coro_write(int fd, const void * buf, size_t len, int timeout_sec)
+{
+  const char *pos = buf;
+  size_t remain = len;
+  ssize_t written;
+  int wait_status;
+
+  while (remain > 0) {
+    if ((written = write(fd, pos, remain)) >= 0) {
+      pos += written;
+      remain -= written;
+      continue;
+    } else if (errno == EINTR) {
+      continue;
+    } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      return -1;
+    }
+    if ((wait_status = coro_wait(fd, POLLOUT, timeout_sec)) != 0) {
+      if (wait_status > 0) {
+        errno = ETIMEDOUT;
+      }
+      return -1;
+    }
+  }
+
+  return len;
+}
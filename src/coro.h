@@ -0,0 +1,33 @@
+/*
+ * coro.h
+ *
+ * Coroutine server engine: every connection runs the sequential httpd() on
+ * its own small stack, and I/O that would block yields to an epoll loop.
+ */
+
+#ifndef _SWS_CORO_H_
+#define _SWS_CORO_H_
+
+#include <sys/types.h>
+
+#include "util.h"
+
+#ifdef __linux__
+#define HAVE_CORO 1
+#endif
+
+#define CORO_STACK_SIZE (64 * 1024) /* stack of a coroutine, mapped lazily */
+#define CORO_POOL_MAX 256 /* unused stacks kept for reuse */
+
+int
+coro_active(void);
+int
+coro_wait(int, int, int);
+ssize_t
+coro_read(int, void *, size_t, int);
+ssize_t
+coro_write(int, const void *, size_t, int);
+void
+run_coro_loop(struct flags *, int);
+
+#endif /* !_SWS_CORO_H_ */
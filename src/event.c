@@ -0,0 +1,496 @@
+/*
+ * event.c
+ *
+ * Event-driven server engine. A single process waits on all client sockets
+ * with epoll and moves each connection through the states
+ * READING -> WRITING -> READING ... -> closed, so that no process has to be
+ * forked per client. Requests are answered by httpd_respond() as soon as the
+ * request header is complete. Persistent connections return to READING after
+ * each response. A request with a CPU-heavy stage leaves the epoll set while
+ * the task pool runs the stage, and is answered again once the notifier of
+ * the pool says it is done.
+ */
+
+#include "event.h"
+
+#ifdef HAVE_EPOLL
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "http.h"
+#include "net.h"
+#include "task.h"
+#include "util.h"
+
+#define EVENT_MAX 64 /* events fetched per epoll_wait */
+
+/**
+ * State of the event loop.
+ */
+struct event_loop
+{
+  int epfd; /* epoll instance */
+  struct flags *flag;
+  struct conn_list active; /* connections within a request, by deadline */
+  struct conn_list idle; /* persistent connections between requests */
+  struct conn_list parked; /* connections waiting for the task pool */
+  int task_fd; /* notifier of the task pool, or -1 */
+};
+
+static void
+event_close(struct event_loop *, struct connection *);
+static void
+event_accept(struct event_loop *, int);
+static void
+event_read(struct event_loop *, struct connection *);
+static void
+event_respond(struct event_loop *, struct connection *);
+static void
+event_park(struct event_loop *, struct connection *);
+static void
+event_resume(struct event_loop *);
+static void
+event_write(struct event_loop *, struct connection *);
+static void
+event_keep_alive(struct event_loop *, struct connection *);
+static void
+event_expire(struct event_loop *, struct conn_list *, time_t);
+
+/**
+ * Stops watching the connection, closes it and releases its memory.
+ *
+ * @param loop the event loop.
+ * @param conn the connection to close.
+ */
+static void
+event_close(struct event_loop * loop, struct connection * conn)
+{
+  /*
+   * Remove explicitly: a forked child may still hold the socket open, which
+   * would keep the registration alive after close.
+   */
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->socket, NULL) < 0) {
+    warn("epoll_ctl");
+  }
+  conn_list_remove(conn);
+  conn_close(conn);
+  free(conn);
+}
+
+/**
+ * Accepts pending clients of the non-blocking server socket, at most
+ * flag->accept_batch of them, so that established connections are served
+ * in between. Clients left over keep the server socket readable.
+ *
+ * @param loop the event loop.
+ * @param server_sock the server socket.
+ */
+static void
+event_accept(struct event_loop * loop, int server_sock)
+{
+  struct sockaddr_storage client;
+  socklen_t client_length;
+  char client_ip[INET6_ADDRSTRLEN];
+  struct epoll_event ev;
+  struct connection *conn;
+  int client_sock;
+  int accepted;
+
+  for (accepted = 0; accepted < loop->flag->accept_batch; accepted++) {
+    client_length = sizeof(client);
+    client_sock = accept_socket(server_sock, &client, &client_length, 1);
+    if (client_sock < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      } else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        perror("accept");
+      }
+      return;
+    }
+
+    if ((conn = malloc(sizeof(*conn))) == NULL) {
+      warn("cannot allocate connection");
+      (void) close(client_sock);
+      continue;
+    }
+    (void) client_address(&client, client_ip, sizeof(client_ip));
+    conn_init(conn, client_sock, client_ip);
+    conn->nonblocking = 1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+      warn("epoll_ctl");
+      conn_close(conn);
+      free(conn);
+      continue;
+    }
+    conn_list_append(&loop->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+  }
+}
+
+/**
+ * Reads available request data. Once the request is complete, it is
+ * answered and the connection moves on to the WRITING state.
+ *
+ * @param loop the event loop.
+ * @param conn the readable connection.
+ */
+static void
+event_read(struct event_loop * loop, struct connection * conn)
+{
+  ssize_t bytes_read;
+  size_t remain_buf;
+  int eof = 0;
+
+  /* grows buf while the request does not fit */
+  while ((remain_buf = conn_input_space(conn)) > 0) {
+    bytes_read = recv(conn->socket, conn->buf + conn->buf_len, remain_buf,
+        MSG_DONTWAIT);
+    if (bytes_read < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+      perror("Reading stream message");
+      event_close(loop, conn);
+      return;
+    } else if (bytes_read == 0) {
+      eof = 1;
+      break;
+    }
+    conn->buf_len += bytes_read;
+    conn->buf[conn->buf_len] = '\0';
+  }
+
+  if (!conn_request_complete(conn) && (remain_buf > 0)) {
+    if (!eof) {
+      /* request incomplete, wait for more */
+      conn_list_remove(conn);
+      conn_list_append(&loop->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+      return;
+    } else if (conn->buf_len == 0) {
+      event_close(loop, conn);
+      return;
+    }
+  }
+
+  /* complete, truncated or oversized requests are answered */
+  event_respond(loop, conn);
+}
+
+/**
+ * Answers the request in the connection buffer and all complete pipelined
+ * requests that follow it. Their responses are queued and sent together.
+ *
+ * @param loop the event loop.
+ * @param conn the connection holding a request.
+ */
+static void
+event_respond(struct event_loop * loop, struct connection * conn)
+{
+  for (;;) {
+    if (httpd_respond(conn, loop->flag) < 0) {
+      warnx("httpd failed for client %s", conn->client_ip);
+    }
+
+    switch (conn->state) {
+    case CONN_STATE_CHILD:
+      /* this process served a request that needed blocking I/O */
+      conn_close(conn);
+      exit(EXIT_SUCCESS);
+      /* NOTREACHED */
+      break;
+    case CONN_STATE_DETACHED:
+      event_close(loop, conn);
+      return;
+      /* NOTREACHED */
+      break;
+    case CONN_STATE_TASK:
+      event_park(loop, conn);
+      return;
+      /* NOTREACHED */
+      break;
+    default:
+      break;
+    }
+
+    /* a pending file body must be sent before the next response */
+    if (!conn->keep_alive || (conn->body_fd >= 0)
+        || (conn->out_len >= CONN_BATCH_MAX) || !conn_pipelined(conn)) {
+      break;
+    }
+    conn_next_request(conn);
+  }
+
+  conn->state = CONN_STATE_WRITING;
+  event_write(loop, conn);
+}
+
+/**
+ * Takes a connection whose request waits for the task pool out of the
+ * epoll set, so that neither input nor a hangup wakes it up meanwhile.
+ * Response data of earlier pipelined requests stays queued until then.
+ *
+ * @param loop the event loop.
+ * @param conn the connection in TASK state.
+ */
+static void
+event_park(struct event_loop * loop, struct connection * conn)
+{
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->socket, NULL) < 0) {
+    warn("epoll_ctl");
+  }
+  conn_list_remove(conn);
+  /* no timeout, the pool finishes every task */
+  conn_list_append(&loop->parked, conn, 0);
+}
+
+/**
+ * Answers the requests of all parked connections whose task is done, after
+ * the notifier of the task pool became readable.
+ *
+ * @param loop the event loop.
+ */
+static void
+event_resume(struct event_loop * loop)
+{
+  struct connection *conn;
+  struct connection *next;
+  struct epoll_event ev;
+  uint64_t count;
+
+  if ((read(loop->task_fd, &count, sizeof(count)) < 0) && (errno != EAGAIN)) {
+    warn("cannot read task notifier");
+  }
+  for (conn = loop->parked.head; conn != NULL; conn = next) {
+    /* the connection may be parked again */
+    next = conn->next;
+    if (!task_done(conn->task)) {
+      continue;
+    }
+    conn_list_remove(conn);
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->socket, &ev) < 0) {
+      warn("epoll_ctl");
+      conn_close(conn);
+      free(conn);
+      continue;
+    }
+    conn_list_append(&loop->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+    conn->state = CONN_STATE_READING;
+    event_respond(loop, conn);
+  }
+}
+
+/**
+ * Sends queued response data. When all data is sent, the connection is
+ * closed or waits for the next request. Waits for the socket to become
+ * writable otherwise.
+ *
+ * @param loop the event loop.
+ * @param conn the connection in WRITING state.
+ */
+static void
+event_write(struct event_loop * loop, struct connection * conn)
+{
+  struct epoll_event ev;
+
+  switch (conn_flush(conn)) {
+  case 0:
+    /* socket buffer full */
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->socket, &ev) < 0) {
+      warn("epoll_ctl");
+      event_close(loop, conn);
+      return;
+    }
+    conn_list_remove(conn);
+    conn_list_append(&loop->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+    break;
+  case 1:
+    /* response complete */
+    if (conn->keep_alive) {
+      event_keep_alive(loop, conn);
+    } else {
+      event_close(loop, conn);
+    }
+    break;
+  default:
+    event_close(loop, conn);
+    break;
+  }
+}
+
+/**
+ * Moves a connection whose response is sent back to READING. A pipelined
+ * request that is already complete is answered right away. Otherwise, the
+ * connection waits for the next request until the idle timeout.
+ *
+ * @param loop the event loop.
+ * @param conn the connection to keep open.
+ */
+static void
+event_keep_alive(struct event_loop * loop, struct connection * conn)
+{
+  struct epoll_event ev;
+
+  conn_next_request(conn);
+  if (conn_request_complete(conn)) {
+    event_respond(loop, conn);
+    return;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->socket, &ev) < 0) {
+    warn("epoll_ctl");
+    event_close(loop, conn);
+    return;
+  }
+  conn_list_remove(conn);
+  if (conn->buf_len > 0) {
+    /* part of the next request is there */
+    conn_list_append(&loop->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+  } else {
+    conn_list_append(&loop->idle, conn, time(NULL) + KEEPALIVE_TIMEOUT_SEC);
+  }
+}
+
+/**
+ * Closes all connections of the list whose deadline has passed. Clients
+ * that did not complete their request are notified of the timeout.
+ *
+ * @param loop the event loop.
+ * @param list the timeout list to check.
+ * @param now the current time.
+ */
+static void
+event_expire(struct event_loop * loop, struct conn_list * list, time_t now)
+{
+  struct connection *conn;
+
+  while (((conn = list->head) != NULL) && (conn->deadline <= now)) {
+    /* idle persistent connections are closed silently */
+    if ((conn->state == CONN_STATE_READING)
+        && ((conn->buf_len > 0) || (conn->requests == 0))) {
+      struct response response;
+
+      init_response(&response, RESPONSE_STATUS_CONNECTION_TIMED_OUT);
+      if (coderesp(&response, conn, 1) == 0) {
+        (void) conn_flush(conn);
+      }
+    }
+    event_close(loop, conn);
+  }
+}
+
+/**
+ * Serves clients with an epoll event loop. Does not return.
+ *
+ * @param flag user-provided flags.
+ * @param server_sock the listening server socket.
+ */
+void
+run_event_loop(struct flags * flag, int server_sock)
+{
+  struct epoll_event events[EVENT_MAX];
+  struct epoll_event ev;
+  struct event_loop loop;
+  int sock_flags;
+  int threads;
+  int timeout;
+  int n;
+  int i;
+
+  bzero(&loop, sizeof(loop));
+  loop.flag = flag;
+  loop.task_fd = -1;
+
+  if ((sock_flags = fcntl(server_sock, F_GETFL)) < 0) {
+    err(EXIT_FAILURE, "fcntl");
+  }
+  if (fcntl(server_sock, F_SETFL, sock_flags | O_NONBLOCK) < 0) {
+    err(EXIT_FAILURE, "cannot make server socket non-blocking");
+  }
+  if ((loop.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    err(EXIT_FAILURE, "epoll_create1");
+  }
+  /* the server socket is the only entry without a connection */
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) {
+    err(EXIT_FAILURE, "epoll_ctl");
+  }
+
+  /* CPU-heavy stages run on the task pool, so that the loop goes on */
+  threads = (flag->tasks < 0) ? sysconf(_SC_NPROCESSORS_ONLN) : flag->tasks;
+  if ((threads > 0) && (task_pool_start(threads) < 0)) {
+    warnx("running CPU-heavy stages inline");
+  } else if ((loop.task_fd = task_notifier()) >= 0) {
+    /* the notifier is the only entry with a list */
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.parked;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.task_fd, &ev) < 0) {
+      err(EXIT_FAILURE, "epoll_ctl");
+    }
+  }
+
+  for (;;) {
+    struct connection *first = loop.active.head;
+    time_t now = time(NULL);
+
+    if ((first == NULL) || ((loop.idle.head != NULL)
+        && (loop.idle.head->deadline < first->deadline))) {
+      first = loop.idle.head;
+    }
+    if (first == NULL) {
+      timeout = -1;
+    } else {
+      timeout = (first->deadline > now) ? (first->deadline - now) * 1000 : 0;
+    }
+
+    if ((n = epoll_wait(loop.epfd, events, EVENT_MAX, timeout)) < 0) {
+      if (errno == EINTR) {
+        /* e.g. SIGCHLD of a CGI child */
+        continue;
+      }
+      err(EXIT_FAILURE, "epoll_wait");
+    }
+
+    for (i = 0; i < n; i++) {
+      struct connection *conn = events[i].data.ptr;
+
+      if (conn == NULL) {
+        event_accept(&loop, server_sock);
+      } else if (events[i].data.ptr == &loop.parked) {
+        event_resume(&loop);
+      } else if (conn->state == CONN_STATE_READING) {
+        event_read(&loop, conn);
+      } else if (conn->state == CONN_STATE_WRITING) {
+        event_write(&loop, conn);
+      }
+    }
+
+    now = time(NULL);
+    event_expire(&loop, &loop.active, now);
+    event_expire(&loop, &loop.idle, now);
+  }
+}
+
+#endif /* HAVE_EPOLL */
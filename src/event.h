@@ -0,0 +1,20 @@
+/*
+ * event.h
+ *
+ * Event-driven server engine: one process multiplexes all client
+ * connections over non-blocking I/O.
+ */
+
+#ifndef _SWS_EVENT_H_
+#define _SWS_EVENT_H_
+
+#include "util.h"
+
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+void
+run_event_loop(struct flags *, int);
+
+#endif /* !_SWS_EVENT_H_ */
@@ -0,0 +1,704 @@
+/*
+ * fdcache.c
+ *
+ * Files that are served again and again are kept open, together with their
+ * stat(2) result and MIME type, so that a request for them costs neither
+ * open(2) and stat(2) nor a run of libmagic. Entries are keyed by the
+ * resolved path and found through a hash table; the least recently used
+ * entry is closed when the cache is full.
+ *
+ * Every directory with cached files is watched with inotify(7), and so is
+ * every directory above it. A change of a file, e.g. a write, chmod,
+ * rename or unlink, drops its entry, and the removal or rename of any
+ * directory on its path drops all entries below that directory. Events
+ * are read before every lookup, so a change is seen by the next request.
+ * Without inotify, nothing is cached.
+ *
+ * A process owns its cache: a child forgets the entries of its parent and
+ * starts an own cache at its first lookup. The cache is shared by the
+ * threads of a process.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY 1
+#endif
+
+#ifdef HAVE_INOTIFY
+
+#define FDCACHE_WATCH_BUCKETS 256
+
+/* changes that drop a cached file or, without a name, the directory */
+#define FDCACHE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+/* changes of a directory further up that drop the files below it */
+#define FDCACHE_PATH_EVENTS (IN_DELETE_SELF | IN_MOVE_SELF)
+
+/**
+ * A watched directory. A directory is watched while it holds cached files
+ * or watched directories.
+ */
+struct fdcache_watch
+{
+  int wd; /* inotify watch descriptor */
+  int refs; /* number of cached files and watches in the directory */
+  int gone; /* 1, if the kernel removed the watch */
+  char *dir; /* path of the directory, with a trailing slash */
+  size_t dir_len; /* length of dir */
+  struct fdcache_watch *parent; /* the directory above, or NULL */
+  struct fdcache_watch *next; /* next watch in the bucket */
+};
+
+/**
+ * A cached file.
+ */
+struct fdcache_entry
+{
+  char *path; /* resolved path */
+  unsigned int hash; /* hash of path */
+  int fd; /* open file, read only */
+  struct stat st; /* stat result when the file was opened */
+  char content_type[FDCACHE_TYPE_MAX]; /* MIME type */
+  struct fdcache_watch *watch; /* the directory of the file */
+  struct fdcache_entry *next; /* next entry in the bucket */
+  struct fdcache_entry *newer; /* more recently used entry, or NULL */
+  struct fdcache_entry *older; /* less recently used entry, or NULL */
+};
+
+static unsigned int
+fdcache_hash(const char *);
+static int
+fdcache_start(void);
+static struct fdcache_entry *
+fdcache_find(const char *, unsigned int);
+static void
+fdcache_touch(struct fdcache_entry *);
+static void
+fdcache_remove(struct fdcache_entry *);
+static struct fdcache_watch *
+fdcache_watch_get(char *, size_t, uint32_t);
+static void
+fdcache_watch_put(struct fdcache_watch *);
+static void
+fdcache_flush_watch(struct fdcache_watch *);
+static void
+fdcache_flush(void);
+static void
+fdcache_invalidate(struct fdcache_watch *, const char *);
+static void
+fdcache_drain(void);
+static int
+fdcache_unchanged(const char *, int, const struct stat *);
+static void
+fdcache_add(const char *, int, const struct stat *, const char *);
+static void
+fdcache_prepare(void);
+static void
+fdcache_parent(void);
+static void
+fdcache_child(void);
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_max = FDCACHE_DEFAULT_FILES; /* 0 to disable */
+static int cache_count;
+static int cache_inotify = -1; /* inotify instance, -1 if not started */
+static int cache_failed; /* 1, if inotify is not available */
+static struct fdcache_entry **cache_buckets;
+static size_t cache_nbuckets; /* a power of two */
+static struct fdcache_entry *cache_newest;
+static struct fdcache_entry *cache_oldest;
+static struct fdcache_watch *cache_watches[FDCACHE_WATCH_BUCKETS];
+
+/**
+ * Hashes a path with FNV-1a.
+ *
+ * @param path the path.
+ * @return the hash.
+ */
+static unsigned int
+fdcache_hash(const char * path)
+{
+  unsigned int hash = 2166136261U;
+
+  while (*path != '\0') {
+    hash = (hash ^ (unsigned char) *path++) * 16777619U;
+  }
+
+  return hash;
+}
+
+/**
+ * Creates the inotify instance and the hash table of this process.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+fdcache_start(void)
+{
+  if (cache_failed) {
+    return -1;
+  }
+  for (cache_nbuckets = 16; cache_nbuckets < (size_t) cache_max * 2;
+      cache_nbuckets *= 2) {
+    /* a load factor of at most 1/2 */
+  }
+  if ((cache_buckets = calloc(cache_nbuckets, sizeof(*cache_buckets)))
+      == NULL) {
+    warn("cannot allocate file cache");
+    cache_failed = 1;
+    return -1;
+  }
+  if ((cache_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    warn("inotify_init1, files are not cached");
+    free(cache_buckets);
+    cache_buckets = NULL;
+    cache_failed = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Finds the entry of a path.
+ *
+ * @return the entry, or NULL if the path is not cached.
+ */
+static struct fdcache_entry *
+fdcache_find(const char * path, unsigned int hash)
+{
+  struct fdcache_entry *entry;
+
+  for (entry = cache_buckets[hash & (cache_nbuckets - 1)]; entry != NULL;
+      entry = entry->next) {
+    if ((entry->hash == hash) && (strcmp(entry->path, path) == 0)) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Makes an entry the most recently used one.
+ */
+static void
+fdcache_touch(struct fdcache_entry * entry)
+{
+  if (entry == cache_newest) {
+    return;
+  }
+  /* unlink, entry has a newer neighbour */
+  entry->newer->older = entry->older;
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    cache_oldest = entry->newer;
+  }
+  entry->newer = NULL;
+  entry->older = cache_newest;
+  cache_newest->newer = entry;
+  cache_newest = entry;
+}
+
+/**
+ * Removes an entry from the cache and closes its file.
+ */
+static void
+fdcache_remove(struct fdcache_entry * entry)
+{
+  struct fdcache_entry **link;
+
+  link = &cache_buckets[entry->hash & (cache_nbuckets - 1)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    cache_newest = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    cache_oldest = entry->newer;
+  }
+
+  fdcache_watch_put(entry->watch);
+  (void) close(entry->fd);
+  free(entry->path);
+  free(entry);
+  cache_count--;
+}
+
+/**
+ * Watches a directory and, through the watch of its parent, every
+ * directory above it. Takes a reference to the watch.
+ *
+ * @param path a path that starts with the directory. The byte after the
+ * directory is replaced while it is watched, and restored.
+ * @param dir_len the length of the directory, including its trailing
+ * slash.
+ * @param mask the events to watch for, added to those of an existing
+ * watch of the directory.
+ * @return the watch, or NULL if the directory or one above it cannot be
+ * watched.
+ */
+static struct fdcache_watch *
+fdcache_watch_get(char * path, size_t dir_len, uint32_t mask)
+{
+  struct fdcache_watch **bucket;
+  struct fdcache_watch *watch;
+  struct fdcache_watch *parent = NULL;
+  size_t parent_len;
+  char saved;
+  int wd;
+
+  /* the kernel keeps one watch per directory, the masks are merged */
+  saved = path[dir_len];
+  path[dir_len] = '\0';
+  wd = inotify_add_watch(cache_inotify, path, mask | IN_MASK_ADD | IN_ONLYDIR);
+  path[dir_len] = saved;
+  if (wd < 0) {
+    if (errno != ENOSPC) {
+      warn("inotify_add_watch %.*s", (int) dir_len, path);
+    }
+    return NULL;
+  }
+
+  bucket = &cache_watches[(unsigned int) wd % FDCACHE_WATCH_BUCKETS];
+  for (watch = *bucket; watch != NULL; watch = watch->next) {
+    if (watch->wd != wd) {
+      continue;
+    }
+    /* a directory renamed to this path is dropped with the next events */
+    if ((watch->dir_len != dir_len)
+        || (strncmp(watch->dir, path, dir_len) != 0)) {
+      return NULL;
+    }
+    watch->refs++;
+    return watch;
+  }
+
+  /* the parent ends at the slash before the trailing one */
+  for (parent_len = dir_len - 1; (parent_len > 0)
+      && (path[parent_len - 1] != '/'); parent_len--) {
+    /* find the slash */
+  }
+  if ((parent_len > 0) && ((parent = fdcache_watch_get(path, parent_len,
+      FDCACHE_PATH_EVENTS)) == NULL)) {
+    (void) inotify_rm_watch(cache_inotify, wd);
+    return NULL;
+  }
+
+  if (((watch = malloc(sizeof(*watch))) == NULL)
+      || ((watch->dir = strndup(path, dir_len)) == NULL)) {
+    warn("cannot allocate directory watch");
+    free(watch);
+    (void) inotify_rm_watch(cache_inotify, wd);
+    if (parent != NULL) {
+      fdcache_watch_put(parent);
+    }
+    return NULL;
+  }
+  watch->wd = wd;
+  watch->refs = 1;
+  watch->gone = 0;
+  watch->dir_len = dir_len;
+  watch->parent = parent;
+  watch->next = *bucket;
+  *bucket = watch;
+
+  return watch;
+}
+
+/**
+ * Drops a reference to a watch. The last reference removes the watch.
+ */
+static void
+fdcache_watch_put(struct fdcache_watch * watch)
+{
+  struct fdcache_watch **link;
+
+  if (--watch->refs > 0) {
+    return;
+  }
+  link = &cache_watches[(unsigned int) watch->wd % FDCACHE_WATCH_BUCKETS];
+  while (*link != watch) {
+    link = &(*link)->next;
+  }
+  *link = watch->next;
+  if (!watch->gone) {
+    (void) inotify_rm_watch(cache_inotify, watch->wd);
+  }
+  if (watch->parent != NULL) {
+    fdcache_watch_put(watch->parent);
+  }
+  free(watch->dir);
+  free(watch);
+}
+
+/**
+ * Removes all entries below a directory, which removes its watch and those
+ * of the directories below it.
+ */
+static void
+fdcache_flush_watch(struct fdcache_watch * watch)
+{
+  struct fdcache_entry *entry;
+  struct fdcache_entry *older;
+
+  /* keep the watch, and its path, until all entries are removed */
+  watch->refs++;
+  for (entry = cache_newest; entry != NULL; entry = older) {
+    older = entry->older;
+    if (strncmp(entry->path, watch->dir, watch->dir_len) == 0) {
+      fdcache_remove(entry);
+    }
+  }
+  fdcache_watch_put(watch);
+}
+
+/**
+ * Removes all entries.
+ */
+static void
+fdcache_flush(void)
+{
+  while (cache_newest != NULL) {
+    fdcache_remove(cache_newest);
+  }
+}
+
+/**
+ * Removes the entry of a file in a watched directory, if it is cached.
+ *
+ * @param watch the directory.
+ * @param name the name of the file in the directory.
+ */
+static void
+fdcache_invalidate(struct fdcache_watch * watch, const char * name)
+{
+  struct fdcache_entry *entry;
+  char path[PATH_MAX];
+
+  if (snprintf(path, sizeof(path), "%s%s", watch->dir, name)
+      >= (int) sizeof(path)) {
+    return;
+  }
+  if ((entry = fdcache_find(path, fdcache_hash(path))) != NULL) {
+    fdcache_remove(entry);
+  }
+}
+
+/**
+ * Reads all pending inotify events and removes the entries they concern.
+ */
+static void
+fdcache_drain(void)
+{
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  struct fdcache_watch *watch;
+  ssize_t n_bytes;
+  char *pos;
+
+  for (;;) {
+    n_bytes = read(cache_inotify, buf, sizeof(buf));
+    if (n_bytes <= 0) {
+      if ((n_bytes < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return;
+    }
+    for (pos = buf; pos < buf + n_bytes;
+        pos += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *) pos;
+      if (event->mask & IN_Q_OVERFLOW) {
+        /* events were lost */
+        fdcache_flush();
+        continue;
+      }
+      for (watch = cache_watches[(unsigned int) event->wd
+          % FDCACHE_WATCH_BUCKETS]; watch != NULL; watch = watch->next) {
+        if (watch->wd == event->wd) {
+          break;
+        }
+      }
+      if (watch == NULL) {
+        /* a removed watch */
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        watch->gone = 1;
+        fdcache_flush_watch(watch);
+      } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        fdcache_flush_watch(watch);
+      } else if (event->len > 0) {
+        fdcache_invalidate(watch, event->name);
+      }
+    }
+  }
+}
+
+/**
+ * Checks that a file did not change between its stat(2) and the moment its
+ * directory is watched. Changes from then on are reported by inotify.
+ *
+ * @param path the path of the file.
+ * @param fd the file, opened after the stat.
+ * @param st the stat result.
+ * @return 1, if path and fd still match st. Otherwise, 0.
+ */
+static int
+fdcache_unchanged(const char * path, int fd, const struct stat * st)
+{
+  struct stat now;
+
+  if ((fstat(fd, &now) < 0) || (now.st_dev != st->st_dev)
+      || (now.st_ino != st->st_ino)) {
+    return 0;
+  }
+  if ((stat(path, &now) < 0) || (now.st_dev != st->st_dev)
+      || (now.st_ino != st->st_ino) || (now.st_size != st->st_size)
+      || (now.st_mtim.tv_sec != st->st_mtim.tv_sec)
+      || (now.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+      || (now.st_ctim.tv_sec != st->st_ctim.tv_sec)
+      || (now.st_ctim.tv_nsec != st->st_ctim.tv_nsec)) {
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Adds a file to the cache, see fdcache_insert(). Called with the cache
+ * locked.
+ */
+static void
+fdcache_add(const char * path, int fd, const struct stat * st,
+    const char * content_type)
+{
+  struct fdcache_entry *entry;
+  struct fdcache_watch *watch;
+  const char *slash;
+  char dir[PATH_MAX];
+  unsigned int hash;
+
+  hash = fdcache_hash(path);
+  if (fdcache_find(path, hash) != NULL) {
+    /* added by another thread meanwhile */
+    return;
+  }
+  if (((slash = strrchr(path, '/')) == NULL)
+      || ((size_t) (slash - path) + 1 >= sizeof(dir))) {
+    return;
+  }
+
+  /* watch first, so that no change after the check below goes unnoticed */
+  memcpy(dir, path, slash - path + 1);
+  dir[slash - path + 1] = '\0';
+  if ((watch = fdcache_watch_get(dir, slash - path + 1, FDCACHE_EVENTS))
+      == NULL) {
+    return;
+  }
+  if (!fdcache_unchanged(path, fd, st)
+      || ((entry = calloc(1, sizeof(*entry))) == NULL)) {
+    fdcache_watch_put(watch);
+    return;
+  }
+  if (((entry->path = strdup(path)) == NULL)
+      || ((entry->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)) {
+    warn("cannot cache %s", path);
+    free(entry->path);
+    free(entry);
+    fdcache_watch_put(watch);
+    return;
+  }
+  entry->hash = hash;
+  entry->st = *st;
+  (void) snprintf(entry->content_type, sizeof(entry->content_type), "%s",
+      content_type);
+  entry->watch = watch;
+
+  if (cache_count >= cache_max) {
+    fdcache_remove(cache_oldest);
+  }
+  entry->next = cache_buckets[hash & (cache_nbuckets - 1)];
+  cache_buckets[hash & (cache_nbuckets - 1)] = entry;
+  entry->older = cache_newest;
+  if (cache_newest != NULL) {
+    cache_newest->newer = entry;
+  } else {
+    cache_oldest = entry;
+  }
+  cache_newest = entry;
+  cache_count++;
+}
+
+/**
+ * Holds the cache while a thread forks, so the child gets it consistent.
+ */
+static void
+fdcache_prepare(void)
+{
+  (void) pthread_mutex_lock(&cache_lock);
+}
+
+/**
+ * Releases the cache in the parent after a fork.
+ */
+static void
+fdcache_parent(void)
+{
+  (void) pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Forgets the cache of the parent in a child. Reading the inherited inotify
+ * instance would take the events of the parent, and the inherited
+ * descriptors are closed on exec; the child starts an own cache.
+ */
+static void
+fdcache_child(void)
+{
+  cache_count = 0;
+  cache_inotify = -1;
+  cache_failed = 0;
+  cache_buckets = NULL;
+  cache_nbuckets = 0;
+  cache_newest = cache_oldest = NULL;
+  memset(cache_watches, 0, sizeof(cache_watches));
+  (void) pthread_mutex_unlock(&cache_lock);
+}
+
+#endif /* HAVE_INOTIFY */
+
+/**
+ * Sets the number of files to keep open. Each file takes a descriptor, so
+ * at most half of the descriptor limit is used for the cache.
+ *
+ * @param files the number of files, 0 to disable the cache.
+ */
+void
+fdcache_init(int files)
+{
+#ifdef HAVE_INOTIFY
+  struct rlimit rl;
+
+  if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY)
+      && ((rlim_t) files > rl.rlim_cur / 2)) {
+    files = (int) (rl.rlim_cur / 2);
+  }
+  cache_max = files;
+  if ((cache_max > 0)
+      && (pthread_atfork(fdcache_prepare, fdcache_parent, fdcache_child)
+          != 0)) {
+    warnx("pthread_atfork failed, files are not cached");
+    cache_max = 0;
+  }
+#else
+  (void) files;
+#endif
+}
+
+/**
+ * Looks up a file in the cache.
+ *
+ * @param path the resolved path of the file.
+ * @param fd if not NULL, set to a new read only descriptor of the file,
+ * which the caller closes.
+ * @param st set to the stat result of the file.
+ * @param content_type if not NULL, set to the MIME type of the file.
+ * @param content_type_len the size of content_type.
+ * @return 0, if the file is cached. Otherwise, -1.
+ */
+int
+fdcache_lookup(const char * path, int * fd, struct stat * st,
+    char * content_type, size_t content_type_len)
+{
+#ifdef HAVE_INOTIFY
+  struct fdcache_entry *entry;
+  int retval = -1;
+
+  if (cache_max == 0) {
+    return -1;
+  }
+  (void) pthread_mutex_lock(&cache_lock);
+  if ((cache_inotify >= 0) || (fdcache_start() == 0)) {
+    fdcache_drain();
+    if (((entry = fdcache_find(path, fdcache_hash(path))) != NULL)
+        && ((fd == NULL)
+            || ((*fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0)) >= 0))) {
+      fdcache_touch(entry);
+      *st = entry->st;
+      if (content_type != NULL) {
+        (void) snprintf(content_type, content_type_len, "%s",
+            entry->content_type);
+      }
+      retval = 0;
+    }
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+
+  return retval;
+#else
+  (void) path;
+  (void) fd;
+  (void) st;
+  (void) content_type;
+  (void) content_type_len;
+  return -1;
+#endif
+}
+
+/**
+ * Adds a regular file to the cache, unless it changed since it was stat'ed.
+ * Evicts the least recently used file if the cache is full.
+ *
+ * @param path the resolved path of the file.
+ * @param fd the file, opened after st was taken. The cache keeps a
+ * duplicate, the caller still owns fd.
+ * @param st the stat result of the file.
+ * @param content_type the MIME type of the file.
+ */
+void
+fdcache_insert(const char * path, int fd, const struct stat * st,
+    const char * content_type)
+{
+#ifdef HAVE_INOTIFY
+  if ((cache_max == 0) || !S_ISREG(st->st_mode)) {
+    return;
+  }
+  (void) pthread_mutex_lock(&cache_lock);
+  if ((cache_inotify >= 0) || (fdcache_start() == 0)) {
+    fdcache_drain();
+    fdcache_add(path, fd, st, content_type);
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+#else
+  (void) path;
+  (void) fd;
+  (void) st;
+  (void) content_type;
+#endif
+}
@@ -0,0 +1,25 @@
+/*
+ * fdcache.h
+ *
+ * Cache of open files with their stat(2) result and MIME type, keyed by
+ * the resolved path.
+ */
+
+#ifndef _SWS_FDCACHE_H_
+#define _SWS_FDCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FDCACHE_DEFAULT_FILES 1024 /* default number of cached files */
+#define FDCACHE_MAX_FILES 65536 /* largest number of cached files */
+#define FDCACHE_TYPE_MAX 64 /* longest MIME type, with the null byte */
+
+void
+fdcache_init(int);
+int
+fdcache_lookup(const char *, int *, struct stat *, char *, size_t);
+void
+fdcache_insert(const char *, int, const struct stat *, const char *);
+
+#endif /* !_SWS_FDCACHE_H_ */
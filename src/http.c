@@ -1,6 +1,7 @@
 /*
  * http.c - implementation of the HTTP/1.0 server functionality
  * as specified in RFC 1945: http://www.ietf.org/rfc/rfc1945.txt
+ * and of HTTP/1.1 persistent connections (RFC 7230).
  * Copyright (c) 2013
  * Project Team Geronimo
  * Stevens Institute of Technology.
@@ -8,6 +9,10 @@
  * Implementation of a simple HTTP 1.0 web server named sws.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* pipe2 */
+#endif
+
 #include <assert.h>
 #include <err.h>
 #include <stdio.h>
@@ -20,6 +25,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <time.h>
 
 #ifndef _SVID_SOURCE
@@ -31,8 +38,15 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include "bodycache.h"
+#include "bufpool.h"
+#include "conn.h"
+#include "coro.h"
+#include "fdcache.h"
 #include "http.h"
+#include "httpdate.h"
 #include "net.h"
+#include "task.h"
 #include "util.h"
 
 #ifdef __linux__
@@ -64,28 +78,87 @@
 #define HTTP_VERSION_11 "HTTP/1.1"
 #define SERVER_ID "sws/1.0"
 
-#define IF_MODIFIED_SINCE_PREFIX "If-Modified-Since:"
-#define CONTENT_LENGTH_PREFIX    "Content-Length:"
-#define CONTENT_TYPE_PREFIX      "Content-Type:"
+#define HTTP_DATE_MAX 64 /* longest If-Modified-Since date accepted */
+#define RANGES_MAX 16 /* more ranges are ignored, the whole file is sent */
+#define RANGE_HEAD_MAX 256 /* longest head of a multipart/byteranges part */
+
+#define PW_BUF_SIZE (4 * 1024) /* buffer for getpwnam_r */
 
 #define INDEX_HTML "index.html"
 #define CGI_PREFIX "/cgi-bin/"
 
+/**
+ * A generated page that grows as text is appended.
+ */
+struct page
+{
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+/**
+ * MIME type detection handed to the task pool.
+ */
+struct mime_task
+{
+  const char *path;
+  char content_type[sizeof(((struct response *) NULL)->content_type)];
+};
+
+/**
+ * Directory listing built by the task pool.
+ */
+struct listing_task
+{
+  const char *path; /* the directory */
+  char name[NAME_MAX + 1]; /* its name for the title */
+  struct page page; /* the generated page */
+  int failed; /* 1, if the page could not be generated */
+};
+
 static void
-init_request(struct request *);
+init_request(struct request *, struct arena *);
+static char *
+path_join(struct arena *, const char *, const char *);
+static int
+set_entity_body_headers(struct connection *, struct response *,
+    const char *);
+static int
+write_entity_headers(struct response *, char *, size_t);
+static int
+coderesp_headers(struct response *, struct connection *, char *, size_t,
+    size_t);
+static int
+parse_connection(const char *, size_t);
+static int
+parse_transfer_encoding(const char *, size_t);
+static int
+parse_range_number(const char **, long long *);
+static int
+parse_range(const char *, off_t, struct conn_part *, int);
 static int
-set_entity_body_headers(struct response *, const char *);
+send_ranges(struct request *, struct response *, struct connection *,
+    const struct stat *, int, struct bodycache_entry *, struct conn_part *,
+    int);
 static int
-coderesp_headers(struct response *, int);
+page_printf(struct page *, const char *, ...);
+static int
+run_stage(struct connection *, void (*)(void *), void *, size_t,
+    const char *);
+static void
+mime_task_main(void *);
+static void
+listing_task_main(void *);
 
 static void
 init_logging(struct logging* l)
 {
-  bzero(l->remoteip, sizeof(l->remoteip));
+  l->remoteip = NULL;
   bzero(l->request_time, sizeof(l->request_time));
-  bzero(l->request_lineq, sizeof(l->request_lineq));
-  bzero(l->request_status, sizeof(l->request_status));
-  bzero(l->response_size, sizeof(l->response_size));
+  l->request_line = NULL;
+  l->request_status = 0;
+  l->response_size = -1;
 }
 
 /**
@@ -100,160 +173,237 @@ init_response(struct response * response, int code)
 {
   response->code = code;
   response->content_length = 0;
+  response->accept_ranges = 0;
   bzero(response->content_type, sizeof(response->content_type));
+  bzero(response->content_range, sizeof(response->content_range));
   response->last_modified = -1;
+  response->entity_headers = NULL;
+  response->entity_headers_len = 0;
 }
 
 /**
  * Initializes the given request.
  *
  * @param request the request to initialize
+ * @param arena the memory of the request.
  */
 static void
-init_request(struct request * request)
+init_request(struct request * request, struct arena * arena)
 {
   request->method = -1;
   request->version_major = -1;
   request->version_minor = -1;
   request->if_modified_since_date = -1;
+  request->range = NULL;
+  request->if_range = 0;
+  request->if_range_date = -1;
   request->content_length = -1;
-  bzero(request->content_type, sizeof(request->content_type));
-  bzero(request->path, sizeof(request->path));
-  bzero(request->querystring, sizeof(request->querystring));
+  request->chunked = 0;
+  request->keep_alive = -1;
+  request->content_type = NULL;
+  request->path = NULL;
+  request->querystring = NULL;
+  request->arena = arena;
 }
 
 /**
- * Function receives a socket pointer after a connection has been
- * established successfully.
+ * Reads requests from a blocking client connection and responds to them
+ * until the connection is not to be kept alive. Waits for the client with a
+ * timeout. Responses to pipelined requests are queued and sent together
+ * before waiting for more input.
+ *
+ * @param conn the client connection.
+ * @param flag user-provided flags.
+ * @return 0 on success. Otherwise, -1 is returned.
+ */
+int
+httpd(struct connection * conn, struct flags * flag)
+{
+  ssize_t bytes_read;
+  int wait_status;
+
+  conn->batching = 1;
+  for (;;) {
+    while (!conn_request_complete(conn)
+        && (conn->buf_len < bufpool_limit() - 1)) {
+      /* send the queued responses before waiting */
+      if (conn_flush(conn) < 0) {
+        return -1;
+      }
+      /* Wait for request from client with timeout. */
+      wait_status = wait_for_data(conn, ((conn->requests > 0)
+          && (conn->buf_len == 0)) ?
+          KEEPALIVE_TIMEOUT_SEC : CLIENT_TIMEOUT_SEC);
+      if (wait_status < 0) {
+        return -1;
+      } else if (wait_status > 0) {
+        if ((conn->requests == 0) || (conn->buf_len > 0)) {
+          struct response response;
+
+          init_response(&response, RESPONSE_STATUS_CONNECTION_TIMED_OUT);
+          (void) coderesp(&response, conn, 1);
+          (void) conn_flush(conn);
+          warnx("connection timed out");
+        }
+        /* idle persistent connections are closed silently */
+        return 0;
+      }
+      /* wait_for_data() found input, so the read does not wait */
+      if ((bytes_read = conn_fill(conn, -1)) < 0) {
+        perror("Reading stream message");
+        return -1;
+      } else if (bytes_read == 0) {
+        break;
+      }
+    }
+
+    if ((conn->buf_len == 0) && (conn->requests > 0)) {
+      /* client closed the persistent connection */
+      break;
+    }
+    if (httpd_respond(conn, flag) < 0) {
+      return -1;
+    }
+    if (!conn->keep_alive) {
+      break;
+    }
+    conn_next_request(conn);
+  }
+
+  return (conn_flush(conn) < 0) ? -1 : 0;
+}
+
+/**
+ * Function receives a connection whose buffer holds the request read so far.
  * Parses the input from the client for valid syntax using string tokens.
  * Calls response function with correct code.
  * Calls the file server function with pathname of file to serve.
  *
- * @param socket server socket that is connected to a client.
+ * Sets request_len of the connection to the length of the request, so that
+ * pipelined requests that follow can be answered next.
+ *
+ * @param conn the client connection holding the null-terminated request.
  * @param flag user-provided flags.
- * @param client_ip the IP of the client in IPv6 format
  * @return 0 on success. Otherwise, -1 is returned.
  */
 int
-httpd(int socket, struct flags * flag, const char * client_ip)
+httpd_respond(struct connection * conn, struct flags * flag)
 {
-  char buf[BUF_SIZE];
-  int bytes_read;
-  int remain_buf;
+  struct http_parser *parser = &conn->parser;
+  struct http_view *token = parser->tokens;
   struct request newreq;
-  char * token[BUF_SIZE];
-  int token_count = 0;
+  int token_count;
   struct response response;
   struct logging log;
   int http_status = 0;
-  char realpath_str[PATH_MAX + 1];
-  char * request_line;
-  char * header_line;
+  const char * req;
   int header_parsing_failed = 0;
   int simple_request = 0;
   int cgi_request = 0; /* to be set by checkuri call */
   int serve_file = 0;
+  int host_present = 0;
+  int i;
   /* initialize newreq */
-  init_request(&newreq);
+  init_request(&newreq, &conn->arena);
+  /* errors before the version is known close the connection */
+  conn->keep_alive = 0;
+  conn->version_minor = 0;
+  /* a request answered again after a stage was counted before */
+  if (conn->task == NULL) {
+    conn->requests++;
+  }
   /*initialize log struct*/
   init_logging(&log);
 
-  /* leave space for terminating null byte */
-  remain_buf = sizeof(buf) - 1;
-  bzero(buf, sizeof(buf));
-
-  do {
-    /* Wait for request from client with timeout. */
-    wait_for_data(socket);
-    if ((bytes_read = read(socket, buf + (sizeof(buf) - 1 - remain_buf),
-        remain_buf)) < 0) {
-      perror("Reading stream message");
-      return -1;
-    } else if (bytes_read == 0) {
-      break;
-    } else {
-      remain_buf -= bytes_read;
-    }
-  } while (strstr(buf, CRLF CRLF) == NULL);
-
-  if (strstr(buf, CRLF CRLF) == NULL) {
+  if (!conn_request_complete(conn)) {
+    conn->request_len = conn->buf_len;
     init_response(&response, RESPONSE_STATUS_BAD_REQUEST);
-    return send_generic_page(&response, 0, socket, NULL);
+    return send_generic_page(&response, 0, conn, NULL);
   } else {
-    int if_modified_since_prefix_len = strlen(IF_MODIFIED_SINCE_PREFIX);
-    int content_length_prefix_len = strlen(CONTENT_LENGTH_PREFIX);
-    int content_type_prefix_len = strlen(CONTENT_TYPE_PREFIX);
     int failure_status = 0;
     time_t current = time(NULL);
 
-    request_line = strtok(buf, CRLF);
+    /* the request ends after its empty line, pipelined requests follow */
+    req = conn->buf + parser->base;
+    conn->request_len = parser->base + parser->end;
 
     /*Save data to log to log*/
-    strncpy(log.remoteip, client_ip, sizeof(log.remoteip) - 1);
-    strncpy(log.request_lineq, request_line, sizeof(log.request_lineq) - 1);
+    log.remoteip = conn->client_ip;
+    /* buf may be compacted while a body is read, so the line is copied */
+    log.request_line = arena_strndup(newreq.arena, req + parser->line.off,
+        parser->line.len);
     time_to_http_date(&current, log.request_time, sizeof(log.request_time));
 
-    header_line = strtok(NULL, CRLF);
-
-    while (header_line != NULL) {
-      if (strlen(header_line) > if_modified_since_prefix_len) {
-        if (strncasecmp(header_line, IF_MODIFIED_SINCE_PREFIX,
-            if_modified_since_prefix_len) == 0) {
-          int time_len;
-          char *date;
-          size_t white_spaces = 0;
-          char *current_char = header_line + if_modified_since_prefix_len;
-
-          /* Skip whitespaces */
-          while (isspace((int)*current_char)) {
-            current_char++;
-            white_spaces++;
-          }
-
-          /* leave space for terminating null byte */
-          time_len = strlen(header_line) - if_modified_since_prefix_len
-              - white_spaces + 1;
-          date = (char *) alloca(time_len);
-          strncpy(date,
-              header_line + if_modified_since_prefix_len + white_spaces,
-              time_len - 1);
-          date[time_len - 1] = 0;
-
-          if (http_date_to_time(date, &newreq.if_modified_since_date) < 0) {
-            header_parsing_failed = 1;
-            break;
-          }
+    header_parsing_failed = parser->bad;
+    for (i = 0; (i < parser->header_count) && !header_parsing_failed; i++) {
+      struct http_view value = parser->headers[i].value;
+      char date[HTTP_DATE_MAX];
+
+      switch (parser->headers[i].id) {
+      case HEADER_IF_MODIFIED_SINCE:
+        if ((http_view_copy(req, value, date, sizeof(date)) >= sizeof(date))
+            || (http_date_to_time(date, &newreq.if_modified_since_date)
+                < 0)) {
+          header_parsing_failed = 1;
         }
-      }
-      if (strlen(header_line) > content_length_prefix_len + 2) {
-        if (strncasecmp(header_line, CONTENT_LENGTH_PREFIX,
-            content_length_prefix_len) == 0) {
-          newreq.content_length = atoi(
-              &(header_line[content_length_prefix_len + 1]));
+        break;
+      case HEADER_RANGE:
+        /* parsed by fileserver(), which knows the size of the file */
+        newreq.range = arena_strndup(newreq.arena, req + value.off,
+            value.len);
+        break;
+      case HEADER_IF_RANGE:
+        newreq.if_range = 1;
+        if ((http_view_copy(req, value, date, sizeof(date)) >= sizeof(date))
+            || (http_date_to_time(date, &newreq.if_range_date) < 0)) {
+          /* an entity tag, which never matches, as none are sent */
+          newreq.if_range_date = -1;
         }
-      }
-      if (strlen(header_line) > content_type_prefix_len + 2) {
-        if (strncasecmp(header_line, CONTENT_TYPE_PREFIX,
-            content_type_prefix_len) == 0) {
-          snprintf(newreq.content_type, 64, "%s",
-              &(header_line[content_type_prefix_len + 1]));
+        break;
+      case HEADER_CONTENT_LENGTH:
+        if ((newreq.content_length = http_view_number(req, value)) < 0) {
+          header_parsing_failed = 1;
         }
+        break;
+      case HEADER_CONTENT_TYPE:
+        newreq.content_type = arena_strndup(newreq.arena, req + value.off,
+            value.len);
+        break;
+      case HEADER_CONNECTION:
+        newreq.keep_alive = parse_connection(req + value.off, value.len);
+        break;
+      case HEADER_TRANSFER_ENCODING:
+        newreq.chunked = parse_transfer_encoding(req + value.off, value.len);
+        break;
+      case HEADER_HOST:
+        host_present = 1;
+        break;
+      default:
+        break;
       }
-      /*Next token*/
-      header_line = strtok(NULL, CRLF);
     }
 
-    /* tokenize token based on space */
-    token[token_count] = strtok(request_line, " ");
-    token_count++;
-    while ((token[token_count] = strtok(NULL, " ")) != NULL) {
-      token_count++;
+    /* a body framed both ways could be read differently by a proxy */
+    if (newreq.chunked && (newreq.content_length >= 0)) {
+      header_parsing_failed = 1;
+    }
+
+    token_count = parser->token_count;
+    if ((token_count >= 2)
+        && (token[1].len >= PATH_MAX)) {
+      /* the path does not fit */
+      header_parsing_failed = 1;
     }
 
     if (token_count == 2) {
       simple_request = 1;
       newreq.version_major = 0;
       newreq.version_minor = 9;
+    } else if ((token_count == 3)
+        && http_view_equals(req, token[2], HTTP_VERSION_11)) {
+      newreq.version_major = 1;
+      newreq.version_minor = 1;
+      conn->version_minor = 1;
     } else {
       newreq.version_major = 1;
       newreq.version_minor = 0;
@@ -263,91 +413,142 @@ httpd(int socket, struct flags * flag, const char * client_ip)
     if ((header_parsing_failed) || ((token_count != 3) && !simple_request)) {
       init_response(&response, RESPONSE_STATUS_BAD_REQUEST);
     }
-    /*Check HTTP 1.0 version token against supported version */
-    else if ((strncasecmp(token[token_count - 1], HTTP_VERSION_1, 8) != 0)
-        && !simple_request) {
+    /*Check HTTP version token against supported versions */
+    else if (!simple_request
+        && !http_view_equals(req, token[2], HTTP_VERSION_1)
+        && !http_view_equals(req, token[2], HTTP_VERSION_11)) {
       init_response(&response, RESPONSE_STATUS_VERSION_NOT_SUPPORTED);
     }
+    /* HTTP/1.1 requests must name the host */
+    else if ((newreq.version_minor == 1) && !host_present) {
+      init_response(&response, RESPONSE_STATUS_BAD_REQUEST);
+    }
+    /* only chunked bodies can be decoded */
+    else if (newreq.chunked < 0) {
+      init_response(&response, RESPONSE_STATUS_NOT_IMPLEMENTED);
+    }
     /*compare with supported methods on first token*/
-    else if (strcasecmp(token[0], "GET") == 0) {
+    else if (http_view_equals(req, token[0], "GET")) {
       newreq.method = REQUEST_METHOD_GET;
-      strcpy(newreq.path, token[1]);
-      checkuri(&newreq, &http_status, flag, realpath_str, &cgi_request);
+      newreq.path = arena_strndup(newreq.arena, req + token[1].off,
+          token[1].len);
+      checkuri(&newreq, &http_status, flag, &cgi_request);
       init_response(&response, http_status);
-      if (http_status == RESPONSE_STATUS_OK) {
-        strcpy(newreq.path, realpath_str);
-      }
-    } else if ((strcasecmp(token[0], "HEAD") == 0) && !simple_request) {
+    } else if (http_view_equals(req, token[0], "HEAD") && !simple_request) {
       newreq.method = REQUEST_METHOD_HEAD;
-      strcpy(newreq.path, token[1]);
-      checkuri(&newreq, &http_status, flag, realpath_str, &cgi_request);
+      newreq.path = arena_strndup(newreq.arena, req + token[1].off,
+          token[1].len);
+      checkuri(&newreq, &http_status, flag, &cgi_request);
       init_response(&response, http_status);
-      if (http_status == RESPONSE_STATUS_OK) {
-        strcpy(newreq.path, realpath_str);
-      }
-    } else if ((strcasecmp(token[0], "POST") == 0) && !simple_request) {
+    } else if (http_view_equals(req, token[0], "POST") && !simple_request) {
       newreq.method = REQUEST_METHOD_POST;
       if (flag->c_dir == NULL) { /* POST IS ONLY VALID IF CGI IS ENABLED */
         init_response(&response, RESPONSE_STATUS_BAD_REQUEST);
       } else {
-        strcpy(newreq.path, token[1]);
-        checkuri(&newreq, &http_status, flag, realpath_str, &cgi_request);
+        newreq.path = arena_strndup(newreq.arena, req + token[1].off,
+            token[1].len);
+        checkuri(&newreq, &http_status, flag, &cgi_request);
         if (!cgi_request && http_status == RESPONSE_STATUS_OK) {
           init_response(&response, RESPONSE_STATUS_BAD_REQUEST);
         } else {
           init_response(&response, http_status);
-          strcpy(newreq.path, realpath_str);
         }
       }
     } else {
       init_response(&response, RESPONSE_STATUS_NOT_IMPLEMENTED);
     }
 
-    /* send file when GET and OK*/
-    serve_file = (newreq.method == REQUEST_METHOD_GET)
+    /* the request is taken apart, a large header buffer can go */
+    conn_shrink(conn);
+
+    /* send file when GET or HEAD and OK*/
+    serve_file = ((newreq.method == REQUEST_METHOD_GET)
+        || (newreq.method == REQUEST_METHOD_HEAD))
         && (response.code == RESPONSE_STATUS_OK) && (!cgi_request);
 
+    /*
+     * HTTP/1.1 connections persist unless the client asks otherwise,
+     * HTTP/1.0 ones only on request. The next request can only be read if
+     * the response is framed by Content-Length and no request body is left
+     * on the connection, which rules out CGIs and requests with bodies.
+     */
+    if (newreq.keep_alive == -1) {
+      newreq.keep_alive = (newreq.version_minor == 1) && !simple_request;
+    }
+    conn->keep_alive = newreq.keep_alive && !cgi_request
+        && ((newreq.method == REQUEST_METHOD_GET)
+            || (newreq.method == REQUEST_METHOD_HEAD))
+        && (newreq.content_length <= 0) && !newreq.chunked
+        && (conn->requests < MAX_KEEPALIVE_REQUESTS);
+
     /* TODO check cgi_request flag and handle CGI request */
     if ((response.code == RESPONSE_STATUS_OK)
         && ((newreq.method == REQUEST_METHOD_GET)
-            || (newreq.method == REQUEST_METHOD_HEAD)) && (!cgi_request)) {
-      set_entity_body_headers(&response, realpath_str);
+            || (newreq.method == REQUEST_METHOD_HEAD)) && (!cgi_request)
+        && (set_entity_body_headers(conn, &response, newreq.path) > 0)) {
+      /* answered again once the task pool has detected the type */
+      return 0;
     }
 
     /* TODO check cgi_request flag and handle CGI request */
     if (response.code == RESPONSE_STATUS_OK) {
+      /* CGIs need blocking I/O, so non-blocking connections hand them off */
+      if (cgi_request && conn->nonblocking) {
+        switch (conn_fork(conn)) {
+        case -1:
+          init_response(&response, RESPONSE_STATUS_INTERNAL_SERVER_ERROR);
+          return send_generic_page(&response, simple_request, conn, NULL);
+          /* NOTREACHED */
+          break;
+        case 0:
+          /* child continues with blocking I/O */
+          break;
+        default:
+          /* the child responds and logs */
+          return 0;
+          /* NOTREACHED */
+          break;
+        }
+      }
+
       /* fileserver generates own header response. Otherwise, respond with
        * headers. */
       if (!serve_file) {
-        failure_status = coderesp(&response, socket, !simple_request);
+        if (cgi_request) {
+          /* CGI output ends when the connection is closed */
+          response.content_length = -1;
+        }
+        failure_status = coderesp(&response, conn, !simple_request);
       }
 
       if (cgi_request) {
-        failure_status = execute_cgi(&newreq, flag, &http_status, realpath_str,
-            socket);
+        failure_status = execute_cgi(&newreq, flag, &http_status, newreq.path,
+            conn);
       } else if (serve_file) {
-        failure_status = fileserver(&newreq, &response, simple_request, socket,
+        failure_status = fileserver(&newreq, &response, simple_request, conn,
             flag);
+        if (conn->state == CONN_STATE_TASK) {
+          /* answered again once the task pool has listed the directory */
+          return 0;
+        }
       }
     } else {
       /* POST is only valid if CGI is enabled */
       if (newreq.method == REQUEST_METHOD_POST && flag->c_dir == NULL) {
-        failure_status = send_generic_page(&response, simple_request, socket,
+        failure_status = send_generic_page(&response, simple_request, conn,
             "CGI is not enabled in the server");
       } else if (newreq.method == REQUEST_METHOD_POST && !cgi_request) {
-        failure_status = send_generic_page(&response, simple_request, socket,
+        failure_status = send_generic_page(&response, simple_request, conn,
             "The uri suplied with the POST resource must point to a CGI");
       } else {
-        failure_status = send_generic_page(&response, simple_request, socket,
+        failure_status = send_generic_page(&response, simple_request, conn,
             NULL);
       }
     }
 
     /* Save response code to log and print log*/
-    snprintf(log.request_status, sizeof(log.request_status), "%d",
-        response.code);
-    snprintf(log.response_size, sizeof(log.response_size), "%d",
-        response.content_length);
+    log.request_status = response.code;
+    log.response_size = response.content_length;
 
     if (flag->dflag) {
       (void) writelog(STDOUT_FILENO, &log);
@@ -355,6 +556,10 @@ httpd(int socket, struct flags * flag, const char * client_ip)
       (void) writelog(flag->logfd, &log);
     }
 
+    if (failure_status != 0) {
+      /* the response may be incomplete */
+      conn->keep_alive = 0;
+    }
     return failure_status;
   }
   /*TODO work through other tokens for error conditions*/
@@ -362,17 +567,188 @@ httpd(int socket, struct flags * flag, const char * client_ip)
   return 0;
 }
 
+/**
+ * Parses the value of a Connection header field.
+ *
+ * @param value the comma-separated connection options, not null-terminated.
+ * @param len the length of value.
+ * @return 1 for keep-alive, 0 for close and -1 if neither is given.
+ */
+static int
+parse_connection(const char * value, size_t len)
+{
+  struct http_view option;
+  size_t pos = 0;
+  int keep_alive = -1;
+
+  while (pos < len) {
+    /* options are separated by commas and white space */
+    while ((pos < len) && (strchr(", \t", value[pos]) != NULL)) {
+      pos++;
+    }
+    option.off = pos;
+    while ((pos < len) && (strchr(", \t", value[pos]) == NULL)) {
+      pos++;
+    }
+    option.len = pos - option.off;
+    if (http_view_equals(value, option, "close")) {
+      /* close wins over keep-alive */
+      return 0;
+    } else if (http_view_equals(value, option, "keep-alive")) {
+      keep_alive = 1;
+    }
+  }
+
+  return keep_alive;
+}
+
+/**
+ * Parses the value of a Transfer-Encoding header field. Only the chunked
+ * transfer coding on its own is supported.
+ *
+ * @param value the comma-separated transfer codings, not null-terminated.
+ * @param len the length of value.
+ * @return 1 for chunked and -1 for other or further codings.
+ */
+static int
+parse_transfer_encoding(const char * value, size_t len)
+{
+  struct http_view coding;
+
+  coding.off = 0;
+  coding.len = len;
+  /* leading and trailing white space is excluded from the value */
+  return http_view_equals(value, coding, "chunked") ? 1 : -1;
+}
+
+/**
+ * Parses the decimal digits of a byte position. Positions beyond any file
+ * are clamped to LLONG_MAX.
+ *
+ * @param pos the position in the string, advanced past the digits.
+ * @param num where to store the number.
+ * @return 0 on success. -1, if there is no digit.
+ */
+static int
+parse_range_number(const char ** pos, long long * num)
+{
+  const char *p = *pos;
+
+  *num = 0;
+  while (isdigit((unsigned char) *p)) {
+    if (*num > (LLONG_MAX - (*p - '0')) / 10) {
+      *num = LLONG_MAX;
+    } else {
+      *num = *num * 10 + (*p - '0');
+    }
+    p++;
+  }
+  if (p == *pos) {
+    return -1;
+  }
+  *pos = p;
+
+  return 0;
+}
+
+/**
+ * Parses the value of a Range header field (RFC 7233): "bytes=" and a
+ * comma-separated list of "first-last", "first-" and "-suffix" ranges.
+ * Ranges that start beyond the file are skipped, the others are cut to the
+ * file.
+ *
+ * @param value the value of the field.
+ * @param size the size of the file.
+ * @param ranges where to store the ranges, with an empty head.
+ * @param max the number of ranges that fit into ranges.
+ * @return the number of ranges. 0, if the field is to be ignored, i.e. it
+ * is malformed, names another unit or more than max ranges. -1, if no
+ * range overlaps the file.
+ */
+static int
+parse_range(const char * value, off_t size, struct conn_part * ranges,
+    int max)
+{
+  const char *pos = value;
+  long long first;
+  long long last;
+  int specs = 0;
+  int count = 0;
+
+  if (strncasecmp(pos, "bytes=", 6) != 0) {
+    return 0;
+  }
+  pos += 6;
+  for (;;) {
+    /* empty list elements are allowed */
+    while ((*pos == ' ') || (*pos == '\t') || (*pos == ',')) {
+      pos++;
+    }
+    if (*pos == '\0') {
+      break;
+    }
+    if (*pos == '-') {
+      pos++;
+      if (parse_range_number(&pos, &last) < 0) {
+        return 0;
+      }
+      /* the last bytes of the file */
+      first = (last < size) ? size - last : 0;
+      last = (last > 0) ? size - 1 : -1;
+    } else {
+      if ((parse_range_number(&pos, &first) < 0) || (*pos++ != '-')) {
+        return 0;
+      }
+      if (!isdigit((unsigned char) *pos)) {
+        last = size - 1;
+      } else if ((parse_range_number(&pos, &last) < 0) || (last < first)) {
+        return 0;
+      } else if (last >= size) {
+        last = size - 1;
+      }
+    }
+    while ((*pos == ' ') || (*pos == '\t')) {
+      pos++;
+    }
+    if ((*pos != ',') && (*pos != '\0')) {
+      return 0;
+    }
+    specs++;
+    if ((first >= size) || (last < first)) {
+      /* not satisfiable */
+      continue;
+    } else if (count == max) {
+      return 0;
+    }
+    ranges[count].head = NULL;
+    ranges[count].head_len = 0;
+    ranges[count].offset = first;
+    ranges[count].end = last + 1;
+    count++;
+  }
+
+  if (specs == 0) {
+    return 0;
+  }
+  return (count > 0) ? count : -1;
+}
+
 /**
  * Stats the file at the given path and sets the corresponding fields
  * in the given response. The fields to set are the entity body header fields
- * Content-Type, Content-Length, Last-Modified.
+ * Content-Type, Content-Length, Last-Modified. Files in the file cache need
+ * neither stat(2) nor MIME detection, directories get the type of their
+ * listing later.
  *
+ * @param conn the client connection.
  * @param response the response to augment with stat information.
  * @param path the path to the file to stat.
- * @return 0 on success. Otherwise, -1 is returned.
+ * @return 0 on success. 1, if the connection waits for the task pool to
+ * detect the type. Otherwise, -1 is returned.
  */
 static int
-set_entity_body_headers(struct response * response, const char * path)
+set_entity_body_headers(struct connection * conn, struct response * response,
+    const char * path)
 {
   struct stat sb;
 
@@ -380,11 +756,26 @@ set_entity_body_headers(struct response * response, const char * path)
     warnx("cannot set entity body headers for NULL path");
     return -1;
   }
-  if (stat(path, &sb) < 0) {
+  if (fdcache_lookup(path, NULL, &sb, response->content_type,
+      sizeof(response->content_type)) == 0) {
+    response->content_length = sb.st_size;
+    response->last_modified = sb.st_mtime;
+    return 0;
+  } else if (stat(path, &sb) < 0) {
     perror("stat");
     return -1;
   } else {
-    mime_type(path, response->content_type, sizeof(response->content_type));
+    struct mime_task task;
+
+    if (!S_ISDIR(sb.st_mode)) {
+      /* libmagic is slow, other clients are served meanwhile */
+      task.path = path;
+      if (run_stage(conn, mime_task_main, &task, sizeof(task), path) > 0) {
+        return 1;
+      }
+      (void) snprintf(response->content_type,
+          sizeof(response->content_type), "%s", task.content_type);
+    }
     response->content_length = sb.st_size;
     response->last_modified = sb.st_mtime;
 
@@ -393,56 +784,89 @@ set_entity_body_headers(struct response * response, const char * path)
 }
 
 /**
- * Sends the given response information to the client.
+ * Runs a CPU-heavy stage of the request, fn(arg), on the task pool. A
+ * coroutine yields meanwhile. The epoll and io_uring engines cannot wait
+ * within a request, so a copy of arg is submitted and the connection is
+ * parked in CONN_STATE_TASK; once the stage is done, the engine answers the
+ * request again from the start, and this time the result is copied back
+ * into arg. Blocking engines run the stage inline.
  *
- * @param response the response to send to the client.
- * @param socket the socket on the server to which the client is connected.
- * @return 0 on success. Otherwise, -1 is returned.
+ * @param conn the client connection.
+ * @param fn the stage.
+ * @param arg the argument of fn, holding its input and, on return of 0,
+ * its result. What it points to must last until the next request.
+ * @param size the size of arg.
+ * @param path what the stage works on, which a result must match.
+ * @return 0, if arg holds the result. 1, if the connection is parked.
  */
 static int
-coderesp_headers(struct response *response, int socket)
+run_stage(struct connection * conn, void (*fn)(void *), void * arg,
+    size_t size, const char * path)
 {
-  char buf[BUF_SIZE];
-  time_t t;
-  char http_date[128];
-  int retval;
-  size_t buf_size_remain;
-  int written;
-  char *buf_pos;
+  struct task *task = conn->task;
+
+  if (task != NULL) {
+    conn->task = NULL;
+    if ((task->fn == fn) && (strcmp(task->key, path) == 0)) {
+      memcpy(arg, task->arg, size);
+      task_free(task);
+      return 0;
+    }
+    /* the request went another way this time */
+    if (task->fn == listing_task_main) {
+      free(((struct listing_task *) task->arg)->page.data);
+    }
+    task_free(task);
+  }
 
-  buf_size_remain = sizeof(buf);
-  buf_pos = buf;
+  /*
+   * Answering again needs the request in buf, which conn_shrink() drops
+   * from a large buffer.
+   */
+  if (!conn->nonblocking || coro_active() || (conn->request_len == 0)
+      || ((task = task_submit(fn, arg, size, path)) == NULL)) {
+    task_run(fn, arg);
+    return 0;
+  }
+  conn->task = task;
+  conn->state = CONN_STATE_TASK;
 
-  /* get current time */
-  t = time(NULL);
-  retval = time_to_http_date(&t, http_date, sizeof(http_date));
+  return 1;
+}
 
-  /* Write Date field */
-  if (retval < 0) {
-    warnx("failed to convert time to http date");
-    return -1;
-  }
+/**
+ * Detects the MIME type of a file.
+ *
+ * @param arg the struct mime_task.
+ */
+static void
+mime_task_main(void * arg)
+{
+  struct mime_task *task = arg;
 
-  written = write_buffer(buf_pos, buf_size_remain, "Date: %s%s", http_date,
-  CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer");
-    return -1;
-  } else {
-    buf_pos += written;
-    buf_size_remain -= written;
-  }
+  mime_type(task->path, task->content_type, sizeof(task->content_type));
+}
 
-  /* Write Server field */
-  written = write_buffer(buf_pos, buf_size_remain, "Server: %s%s", SERVER_ID,
-  CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer");
-    return -1;
-  } else {
-    buf_pos += written;
-    buf_size_remain -= written;
-  }
+/**
+ * Writes the header fields that describe the entity body: Last-Modified,
+ * Accept-Ranges, Content-Type, Content-Range and Content-Length, each if it
+ * is set.
+ *
+ * @param response the response.
+ * @param buf the buffer to write to.
+ * @param buf_size the size of buf.
+ * @return the number of bytes written on success. Otherwise, -1.
+ */
+static int
+write_entity_headers(struct response * response, char * buf,
+    size_t buf_size)
+{
+  size_t buf_size_remain;
+  int written;
+  char *buf_pos;
+
+  buf_size_remain = buf_size;
+  buf_pos = buf;
 
   /* Write Last-Modified field */
   if (response->last_modified != -1) {
@@ -465,6 +889,19 @@ coderesp_headers(struct response *response, int socket)
     }
   }
 
+  /* Write Accept-Ranges field */
+  if (response->accept_ranges) {
+    written = write_buffer(buf_pos, buf_size_remain, "Accept-Ranges: bytes%s",
+        CRLF);
+    if (written < 0) {
+      warnx("failed to write to buffer");
+      return -1;
+    } else {
+      buf_pos += written;
+      buf_size_remain -= written;
+    }
+  }
+
   /* Write Content-Type field */
   if (strlen(response->content_type) > 0) {
     written = write_buffer(buf_pos, buf_size_remain, "Content-Type: %s%s",
@@ -478,10 +915,23 @@ coderesp_headers(struct response *response, int socket)
     }
   }
 
+  /* Write Content-Range field */
+  if (strlen(response->content_range) > 0) {
+    written = write_buffer(buf_pos, buf_size_remain, "Content-Range: %s%s",
+        response->content_range, CRLF);
+    if (written < 0) {
+      warnx("failed to write to buffer");
+      return -1;
+    } else {
+      buf_pos += written;
+      buf_size_remain -= written;
+    }
+  }
+
   /* Write Content-Length field */
   if (response->content_length >= 0) {
-    written = write_buffer(buf_pos, buf_size_remain, "Content-Length: %d%s",
-        response->content_length, CRLF);
+    written = write_buffer(buf_pos, buf_size_remain, "Content-Length: %lld%s",
+        (long long) response->content_length, CRLF);
     if (written < 0) {
       warnx("failed to write to buffer");
       return -1;
@@ -491,6 +941,98 @@ coderesp_headers(struct response *response, int socket)
     }
   }
 
+  return buf_pos - buf;
+}
+
+/**
+ * Sends the given response information to the client, after the status
+ * line, which is sent along.
+ *
+ * @param response the response to send to the client.
+ * @param conn the client connection.
+ * @param buf the buffer holding the status line.
+ * @param buf_size the size of buf.
+ * @param status_len the length of the status line in buf.
+ * @return 0 on success. Otherwise, -1 is returned.
+ */
+static int
+coderesp_headers(struct response *response, struct connection * conn,
+    char * buf, size_t buf_size, size_t status_len)
+{
+  time_t t;
+  char http_date[128];
+  int retval;
+  size_t buf_size_remain;
+  int written;
+  char *buf_pos;
+
+  buf_size_remain = buf_size - status_len;
+  buf_pos = buf + status_len;
+
+  /* get current time */
+  t = time(NULL);
+  retval = time_to_http_date(&t, http_date, sizeof(http_date));
+
+  /* Write Date field */
+  if (retval < 0) {
+    warnx("failed to convert time to http date");
+    return -1;
+  }
+
+  written = write_buffer(buf_pos, buf_size_remain, "Date: %s%s", http_date,
+  CRLF);
+  if (written < 0) {
+    warnx("failed to write to buffer");
+    return -1;
+  } else {
+    buf_pos += written;
+    buf_size_remain -= written;
+  }
+
+  /* Write Server field */
+  written = write_buffer(buf_pos, buf_size_remain, "Server: %s%s", SERVER_ID,
+  CRLF);
+  if (written < 0) {
+    warnx("failed to write to buffer");
+    return -1;
+  } else {
+    buf_pos += written;
+    buf_size_remain -= written;
+  }
+
+  /* Write Last-Modified, Content-Type and Content-Length fields */
+  if (response->entity_headers != NULL) {
+    if (response->entity_headers_len >= buf_size_remain) {
+      warnx("failed to write to buffer");
+      return -1;
+    }
+    memcpy(buf_pos, response->entity_headers, response->entity_headers_len);
+    written = response->entity_headers_len;
+  } else if ((written = write_entity_headers(response, buf_pos,
+      buf_size_remain)) < 0) {
+    return -1;
+  }
+  buf_pos += written;
+  buf_size_remain -= written;
+
+  /* Write Connection field where the default of the version does not apply */
+  if ((conn->version_minor == 1) && !conn->keep_alive) {
+    written = write_buffer(buf_pos, buf_size_remain, "Connection: close%s",
+        CRLF);
+  } else if ((conn->version_minor == 0) && conn->keep_alive) {
+    written = write_buffer(buf_pos, buf_size_remain,
+        "Connection: keep-alive%s", CRLF);
+  } else {
+    written = 0;
+  }
+  if (written < 0) {
+    warnx("failed to write to buffer");
+    return -1;
+  } else {
+    buf_pos += written;
+    buf_size_remain -= written;
+  }
+
   /* Write one empty line at the end of the header response */
 
   written = write_buffer(buf_pos, buf_size_remain, CRLF);
@@ -503,7 +1045,7 @@ coderesp_headers(struct response *response, int socket)
   }
 
   /* Write full header response to socket */
-  if (write(socket, buf, sizeof(buf) - buf_size_remain) < 0) {
+  if (conn_write(conn, buf, buf_size - buf_size_remain) < 0) {
     warn("write failed");
     return -1;
   } else {
@@ -513,20 +1055,21 @@ coderesp_headers(struct response *response, int socket)
 
 /**
  * Called by the httpd function with an int for the code per RFC 1945.
- * Uses the socket pointer passed to generate a response to client
+ * Uses the connection passed to generate a response to client
  * and send this to the client over the socket.
  *
  * @param response the response fields as defined in RFC 1945.
- * @param socket server socket that is connected to a client.
+ * @param conn the client connection.
  * @param full_response 1 if a full response should be returned. 0 for a simple
  *   response.
  * @return 0 on success. Otherwise, -1 is returned.
  */
 int
-coderesp(struct response * response, int socket, int full_response)
+coderesp(struct response * response, struct connection * conn, int full_response)
 {
   char buf[BUF_SIZE];
   size_t buf_size;
+  const char *version;
   int written;
   int code;
 
@@ -537,42 +1080,54 @@ coderesp(struct response * response, int socket, int full_response)
 
   buf_size = sizeof(buf);
   code = response->code;
+  /* answer HTTP/1.1 requests in kind */
+  version = (conn->version_minor == 1) ? HTTP_VERSION_11 : HTTP_VERSION;
 
   /* Send response code to client */
   switch (code) {
   case RESPONSE_STATUS_OK:
-    written = write_buffer(buf, buf_size, "%s %d OK%s", HTTP_VERSION, code,
+    written = write_buffer(buf, buf_size, "%s %d OK%s", version, code,
     CRLF);
     break;
 
+  case RESPONSE_STATUS_PARTIAL_CONTENT:
+    written = write_buffer(buf, buf_size, "%s %d Partial Content%s", version,
+        code, CRLF);
+    break;
+
   case RESPONSE_STATUS_BAD_REQUEST:
-    written = write_buffer(buf, buf_size, "%s %d Bad Request%s", HTTP_VERSION,
+    written = write_buffer(buf, buf_size, "%s %d Bad Request%s", version,
         code, CRLF);
     break;
 
   case RESPONSE_STATUS_FORBIDDEN:
     written = write_buffer(buf, buf_size, "%s %d Forbidden%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
     break;
 
   case RESPONSE_STATUS_NOT_FOUND:
     written = write_buffer(buf, buf_size, "%s %d Not Found%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
+    break;
+
+  case RESPONSE_STATUS_RANGE_NOT_SATISFIABLE:
+    written = write_buffer(buf, buf_size, "%s %d Range Not Satisfiable%s",
+    version, code, CRLF);
     break;
 
   case RESPONSE_STATUS_NOT_IMPLEMENTED:
     written = write_buffer(buf, buf_size, "%s %d Not Implemented%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
     break;
 
   case RESPONSE_STATUS_VERSION_NOT_SUPPORTED:
     written = write_buffer(buf, buf_size, "%s %d Version Not Supported%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
     break;
 
   case RESPONSE_STATUS_CONNECTION_TIMED_OUT:
     written = write_buffer(buf, buf_size, "%s %d Connection Timed Out%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
     break;
 
   default:
@@ -581,7 +1136,7 @@ coderesp(struct response * response, int socket, int full_response)
     /* FALLTHROUGH */
   case RESPONSE_STATUS_INTERNAL_SERVER_ERROR:
     written = write_buffer(buf, buf_size, "%s %d Internal Server Error%s",
-    HTTP_VERSION, code, CRLF);
+    version, code, CRLF);
     break;
   }
 
@@ -589,100 +1144,303 @@ coderesp(struct response * response, int socket, int full_response)
     warnx("failed to write to buffer");
     return -1;
   } else {
-    if (write(socket, buf, written) < 0) {
-      warn("write failed");
-      return -1;
-    } else {
-      /* Send headers to client */
-      int result;
-
-      result = coderesp_headers(response, socket);
-      /* terminate process after timeout */
-      if (code == RESPONSE_STATUS_CONNECTION_TIMED_OUT) {
-        warn("Connection Timed Out\n");
-        close(socket);
-        exit(EXIT_SUCCESS);
-      } else {
-        return result;
-      }
-    }
+    /* Send headers to client, together with the status line */
+    return coderesp_headers(response, conn, buf, buf_size, written);
   }
 }
 
 /**
- * Called by the httpd function with a pathname requested and socket.
+ * Called by the httpd function with a pathname requested and connection.
  * Checks for a valid pathname that does not break out of the web directory.
  * Stats file for properties and handles request according to this result.
- * Opens the file and sends the contents of the file to the client.
+ * Opens the file and sends the contents of the file to the client. Opened
+ * files are added to the file cache together with the Content-Type of the
+ * response, which set_entity_body_headers() detected. Small files are kept
+ * in the content cache, with their header fields rendered, and answered
+ * from memory. A GET with a Range field, whose If-Range field matches if
+ * given, is answered with the ranges by send_ranges().
  *
  * @param pathname the requested pathname as provided by the client.
- * @param socket server socket that is connected to a client.
  * @param simple_response 1 if no headers are to be sent. 0 otherwise.
+ * @param conn the client connection.
  * @param flag user-provided flags.
  * @return 0 on success. Otherwise, -1 is returned.
  */
 int
 fileserver(struct request * request, struct response * response,
-    int simple_response, int socket, struct flags * flag)
+    int simple_response, struct connection * conn, struct flags * flag)
 {
   int fd;
+  int cached;
+  int retval;
   struct stat st_stat;
-  int n_bytes;
-  char buf[BUF_SIZE];
-
-  if (stat(request->path, &st_stat) != 0) {
+  struct bodycache_entry *body;
+  struct conn_part *ranges;
+  int range_count;
+  char headers[256];
+
+  fd = -1;
+  body = NULL;
+  ranges = NULL;
+  range_count = 0;
+  cached = (fdcache_lookup(request->path, NULL, &st_stat, NULL, 0) == 0);
+  if (!cached && (stat(request->path, &st_stat) != 0)) {
     perror("stat");
     init_response(response, RESPONSE_STATUS_INTERNAL_SERVER_ERROR);
-    return send_generic_page(response, simple_response, socket, NULL);
+    return send_generic_page(response, simple_response, conn, NULL);
   }
 
   /* check if file needs to be delivered. */
   if ((request->if_modified_since_date != -1)
-      && (request->if_modified_since_date >= local_to_gmtime(&st_stat.st_mtime))) {
+      && (request->if_modified_since_date >= st_stat.st_mtime)) {
     /* file is not new enough. */
     response->content_length = 0;
     bzero(response->content_type, sizeof(response->content_type));
-    return coderesp(response, socket, !simple_response);
+    return coderesp(response, conn, !simple_response);
+  }
+
+  if (S_ISDIR(st_stat.st_mode)) {
+    /* send directory listing */
+    if (send_directory_listing(request, response, simple_response,
+        conn) < 0) {
+      warnx("error sending directory listing");
+      return -1;
+    }
+    return 0;
+  }
+
+  /* rendered into the header block of the content cache as well */
+  response->accept_ranges = 1;
+
+  /* small files come from memory, others are opened, HEAD needs neither */
+  if ((request->method != REQUEST_METHOD_HEAD)
+      && ((body = bodycache_get(request->path, &st_stat)) == NULL)) {
+    if (!cached || (fdcache_lookup(request->path, &fd, &st_stat, NULL, 0)
+        != 0)) {
+      /* open file as read only */
+      if ((fd = open(request->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("open");
+        /* headers are not sent yet */
+        init_response(response, RESPONSE_STATUS_INTERNAL_SERVER_ERROR);
+        return send_generic_page(response, simple_response, conn, NULL);
+      }
+      fdcache_insert(request->path, fd, &st_stat, response->content_type);
+    }
+    if (st_stat.st_size <= BODYCACHE_FILE_MAX) {
+      response->content_length = st_stat.st_size;
+      if (((retval = write_entity_headers(response, headers,
+          sizeof(headers))) >= 0)
+          && ((body = bodycache_insert(request->path, &st_stat, headers,
+              retval, fd)) != NULL)) {
+        (void) close(fd);
+        fd = -1;
+      }
+    }
+  }
+
+  if ((request->method == REQUEST_METHOD_GET) && !simple_response
+      && (request->range != NULL)
+      && (!request->if_range || (request->if_range_date == st_stat.st_mtime))
+      && ((ranges = arena_alloc(request->arena,
+          (RANGES_MAX + 1) * sizeof(*ranges))) != NULL)) {
+    range_count = parse_range(request->range, st_stat.st_size, ranges,
+        RANGES_MAX);
+  }
+  if (range_count != 0) {
+    /* the ranges are sent, or 416 with the size of the file */
+    return send_ranges(request, response, conn, &st_stat, fd, body, ranges,
+        range_count);
+  }
+
+  /* the length must match the data sent on persistent connections */
+  response->content_length = st_stat.st_size;
+  if (body != NULL) {
+    response->entity_headers = body->headers;
+    response->entity_headers_len = body->headers_len;
+  }
+
+  if (coderesp(response, conn, !simple_response) != 0) {
+    warnx("failed to write response headers");
+    if (fd >= 0) {
+      (void) close(fd);
+    }
+    if (body != NULL) {
+      response->entity_headers = NULL;
+      bodycache_put(body);
+    }
+    return -1;
+  }
+
+  if (body != NULL) {
+    /* header and body leave together from the output queue */
+    retval = conn_write(conn, body->body, body->size);
+    response->entity_headers = NULL;
+    bodycache_put(body);
+    return (retval < 0) ? -1 : 0;
+  }
+
+  if (fd < 0) {
+    /* HEAD request */
+    return 0;
   }
 
-  if (coderesp(response, socket, !simple_response) != 0) {
-    warnx("failed to write response headers");
+  /* the connection closes fd once the file is sent */
+  if (conn_send_file(conn, fd, 0, st_stat.st_size) < 0) {
+    /* log write error */
     return -1;
   }
 
-  if (!S_ISDIR(st_stat.st_mode)) {
-    /* open file as read only */
-    if ((fd = open(request->path, O_RDONLY)) < 0) {
-      perror("open");
-      /* log open failure */
-      return -1;
-    }
+  /* Done writing file */
+  return 0;
+}
 
-    while ((n_bytes = read(fd, buf, BUF_SIZE)) > 0) {
-      if (write(socket, buf, n_bytes) != n_bytes) {
-        perror("write");
-        /* log write error */
-        return -1;
+/**
+ * Answers a GET request for ranges of a file with 206 Partial Content. One
+ * range is sent as the body. Several are sent as a multipart/byteranges
+ * body, whose parts start with a boundary and their own Content-Type and
+ * Content-Range fields; the parts are allocated from the arena of the
+ * request, which outlives the response. If no range overlaps the file, the
+ * answer is 416 Range Not Satisfiable.
+ *
+ * @param request the request.
+ * @param response the response, with the fields of the whole file.
+ * @param conn the client connection.
+ * @param st the stat result of the file.
+ * @param fd the file, or -1 if body holds it. It is closed.
+ * @param body the file in the content cache, or NULL. It is released.
+ * @param ranges the ranges, with room for one more part.
+ * @param count the number of ranges, -1 if none overlaps the file.
+ * @return 0 on success. Otherwise, -1 is returned.
+ */
+static int
+send_ranges(struct request * request, struct response * response,
+    struct connection * conn, const struct stat * st, int fd,
+    struct bodycache_entry * body, struct conn_part * ranges, int count)
+{
+  char type[sizeof(response->content_type)];
+  char head[RANGE_HEAD_MAX];
+  char boundary[32];
+  int retval = 0;
+  int len;
+  int i;
+
+  if (count < 0) {
+    response->code = RESPONSE_STATUS_RANGE_NOT_SATISFIABLE;
+    bzero(response->content_type, sizeof(response->content_type));
+    (void) snprintf(response->content_range, sizeof(response->content_range),
+        "bytes */%lld", (long long) st->st_size);
+    response->content_length = 0;
+    count = 0;
+  } else if (count == 1) {
+    response->code = RESPONSE_STATUS_PARTIAL_CONTENT;
+    (void) snprintf(response->content_range, sizeof(response->content_range),
+        "bytes %lld-%lld/%lld", (long long) ranges[0].offset,
+        (long long) ranges[0].end - 1, (long long) st->st_size);
+    response->content_length = ranges[0].end - ranges[0].offset;
+  } else {
+    response->code = RESPONSE_STATUS_PARTIAL_CONTENT;
+    /* must not occur in the body, which is unlikely enough */
+    (void) snprintf(boundary, sizeof(boundary), "sws%08lx%08lx",
+        (unsigned long) st->st_ino, (unsigned long) (time(NULL)
+            ^ st->st_mtime));
+    (void) snprintf(type, sizeof(type), "%s", response->content_type);
+    response->content_length = 0;
+    for (i = 0; (i <= count) && (retval == 0); i++) {
+      if (i == count) {
+        /* the closing delimiter, without a range */
+        len = snprintf(head, sizeof(head), "%s--%s--%s", CRLF, boundary,
+            CRLF);
+        ranges[i].offset = ranges[i].end = 0;
+      } else {
+        len = snprintf(head, sizeof(head),
+            "%s--%s%s%s%s%sContent-Range: bytes %lld-%lld/%lld%s%s",
+            (i > 0) ? CRLF : "", boundary, CRLF,
+            (strlen(type) > 0) ? "Content-Type: " : "", type,
+            (strlen(type) > 0) ? CRLF : "", (long long) ranges[i].offset,
+            (long long) ranges[i].end - 1, (long long) st->st_size, CRLF,
+            CRLF);
+      }
+      if ((len < 0) || ((size_t) len >= sizeof(head))
+          || ((ranges[i].head = arena_strndup(request->arena, head, len))
+              == NULL)) {
+        retval = -1;
+      } else {
+        ranges[i].head_len = len;
+        response->content_length += len + (ranges[i].end - ranges[i].offset);
       }
     }
-
-    if (n_bytes < 0) {
-      perror("read");
-      /* log read error */
-      return -1;
+    if (retval < 0) {
+      /* nothing is sent yet */
+      if (fd >= 0) {
+        (void) close(fd);
+      }
+      if (body != NULL) {
+        bodycache_put(body);
+      }
+      init_response(response, RESPONSE_STATUS_INTERNAL_SERVER_ERROR);
+      return send_generic_page(response, 0, conn, NULL);
     }
+    (void) snprintf(response->content_type, sizeof(response->content_type),
+        "multipart/byteranges; boundary=%s", boundary);
+    bzero(response->content_range, sizeof(response->content_range));
+    count++;
+  }
 
-    /* Done writing file */
-    return 0;
-  } else /* uri is a directory */{
-    /* send directory listing */
-    if (send_directory_listing(request, socket) < 0) {
-      warnx("error sending directory listing");
-      return -1;
+  if (coderesp(response, conn, 1) != 0) {
+    warnx("failed to write response headers");
+    retval = -1;
+  } else if (body != NULL) {
+    /* heads and ranges leave together from the output queue */
+    for (i = 0; (i < count) && (retval == 0); i++) {
+      if (((ranges[i].head_len > 0)
+          && (conn_write(conn, ranges[i].head, ranges[i].head_len) < 0))
+          || (conn_write(conn, body->body + ranges[i].offset,
+              ranges[i].end - ranges[i].offset) < 0)) {
+        retval = -1;
+      }
     }
+  } else if (count > 0) {
+    /* the connection closes fd once the ranges are sent */
+    return conn_send_parts(conn, fd, ranges, count);
   }
 
-  return 0;
+  if (fd >= 0) {
+    (void) close(fd);
+  }
+  if (body != NULL) {
+    bodycache_put(body);
+  }
+  return retval;
+}
+
+/**
+ * Joins a directory and a path that starts with a slash, in the arena.
+ *
+ * @param arena the memory of the request.
+ * @param dir the directory.
+ * @param path the path within dir.
+ * @return the joined path. NULL, if it is longer than PATH_MAX (errno
+ * ENAMETOOLONG) or cannot be allocated (errno ENOMEM).
+ */
+static char *
+path_join(struct arena * arena, const char * dir, const char * path)
+{
+  size_t dir_len = strlen(dir);
+  size_t path_len = strlen(path);
+  char *joined;
+
+  if (dir_len + path_len > PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if ((joined = arena_alloc(arena, dir_len + path_len + 1)) == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(joined, dir, dir_len);
+  memcpy(joined + dir_len, path, path_len + 1);
+
+  return joined;
 }
 
 /**
@@ -690,31 +1448,65 @@ fileserver(struct request * request, struct response * response,
  * If the resource exist, it checks the access permission and if it is
  * within the allowed directory for serving files or CGI scripts
  *
- * @param path is the path (uri) requested by the client
+ * @param request the request, whose path is the uri requested by the
+ *  client. On success, the path is replaced by the path where the
+ *  requested file is located on the server.
  * @param uri_status, int * to be changed by the function
  *  after execution the value of uri_status will be the appropriate HTTP
  *  response to the client 200 OK, 403 Forbidden, 404 Not Found, etc.
  *  It can be set to NULL if not required
  * @param flag user-provided flags.
- * @param realpath_str path where the requested file is located on the server.
+ * @param cgi_request set to 1, if the uri names a CGI.
  * @return 0 on success (equivalent to 200 OK). Otherwise -1.
  */
 int
 checkuri(struct request * request, int * uri_status, struct flags * flag,
-    char * realpath_str, int * cgi_request)
+    int * cgi_request)
 {
   /* TODO: DELETE struct stat st_stat; */
-  char uri_path[PATH_MAX + 1];
-  char uri_real_path[PATH_MAX + 1];
-  char server_real_path[PATH_MAX + 1];
-  char query_string[PATH_MAX + 1];
+  const char *server_real_path;
+  char *uri_path;
+  char *uri_real_path;
+  char *norm_path;
+  char *query;
+  size_t len;
   char * username;
+  struct passwd pwd;
   struct passwd *pw;
+  char *pw_buf;
   int mode;
-  char *chp;
+
+  if (request->path == NULL) {
+    /* the request arena is exhausted */
+    if (uri_status != NULL) {
+      *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return -1;
+  }
   /*
-   * realpath returns the path without /./ or /../ or symlinks
+   * The path is decoded and normalized lexically first, so the joined
+   * path has no /./ or /../ and only symlinks need realpath.
    */
+  if ((query = strchr(request->path, '?')) != NULL) {
+    /* the query string is no part of the path and stays encoded */
+    *query++ = '\0';
+  }
+  /* never longer than the path, but a slash may be prepended */
+  len = strlen(request->path) + 2;
+  if ((norm_path = arena_alloc(request->arena, len)) == NULL) {
+    if (uri_status != NULL) {
+      *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return -1;
+  }
+  if (path_normalize(request->path, norm_path, len) < 0) {
+    if (uri_status != NULL) {
+      *uri_status = (errno == EACCES) ?
+          RESPONSE_STATUS_FORBIDDEN : RESPONSE_STATUS_BAD_REQUEST;
+    }
+    return -1;
+  }
+  request->path = norm_path;
 
   /* check if uri points to a user's home directory in the form /~username */
   if (request->path[0] == '/' && request->path[1] == '~') {
@@ -735,25 +1527,29 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
       return -1;
     }
 
-    username = malloc(i + 1);
-
-    (void) strncpy(username, userdir, i);
-    username[i] = '\0';
+    if (((username = arena_strndup(request->arena, userdir, i)) == NULL)
+        || ((pw_buf = arena_alloc(request->arena, PW_BUF_SIZE)) == NULL)
+        || ((uri_real_path = arena_alloc(request->arena, PATH_MAX + 1))
+            == NULL)) {
+      if (uri_status != NULL) {
+        *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
+      }
+      return -1;
+    }
 
     /* at this point we have a userid and we get their home directory */
 
-    if ((pw = getpwnam((const char *) username)) == NULL) {
-      free(username);
+    if ((getpwnam_r((const char *) username, &pwd, pw_buf, PW_BUF_SIZE,
+        &pw) != 0) || (pw == NULL)) {
       /* couldn't find username in password file, /etc/passwd */
       if (uri_status != NULL) {
         *uri_status = RESPONSE_STATUS_NOT_FOUND;
       }
       return -1;
     }
-    free(username);
 
     /* server realpath for this request will be the user's home directory */
-    if (realpath(pw->pw_dir, server_real_path) == NULL) {
+    if (realpath(pw->pw_dir, uri_real_path) == NULL) {
       /*log error*/
       if (uri_status != NULL) {
         *uri_status = RESPONSE_STATUS_NOT_FOUND;
@@ -764,127 +1560,50 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
       }
       return -1;
     }
+    server_real_path = uri_real_path;
 
     /* create realpath for requested uri */
     userdir = userdir + i; /* include '/' if present */
-
-    if ((strlen(server_real_path) + strlen(userdir)) > PATH_MAX) {
-      /*log error*/
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_BAD_REQUEST;
-        /*
-         * Bad server configuration since this should have been checked at
-         * startup
-         */
-      }
-      return -1;
-    }
-
-    if ((strcpy(uri_path, server_real_path) == NULL)
-        || (strcat(uri_path, userdir) == NULL)) {
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
-      }
-      return -1;
-      /* log error */
-    }
+    uri_path = path_join(request->arena, server_real_path, userdir);
     /* check if requested uri begins with /cgi-bin/ and c flag was specified */
   } else if (strstr(request->path, "/cgi-bin/") == request->path
       && flag->c_dir != NULL) { /* replace /cgi-bin/ with the c_dir */
-
-    if (strlen(flag->c_dir) + strlen(request->path + 8) > PATH_MAX) {
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_BAD_REQUEST;
-      }
-      return -1;
-    }
     *cgi_request = 1; /* set flag indicating cgi execution */
 
-    strcpy(uri_path, flag->c_dir);
-    strcat(uri_path, request->path + strlen(CGI_PREFIX)); /* begin at second slash */
+    /* begin at second slash, c_dir has no trailing one */
+    uri_path = path_join(request->arena, flag->c_dir,
+        request->path + strlen(CGI_PREFIX) - 1);
 
     /* server realpath for this request will be the cgi-directory */
-    if (realpath(flag->c_dir, server_real_path) == NULL) {
-      /*log error*/
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_NOT_FOUND;
-        /*
-         * Bad server configuration since this should have been checked at
-         * startup
-         */
-      }
-      return -1;
-    }
-    chp = uri_path;
-    while ((*chp != '?') && (*chp != '\0'))
-      chp++;
-    /*truncate req.path after ?*/
-    if (*chp == '?') {
-      *chp = '\0';
-      strncpy(request->querystring, ++chp,
-          sizeof(request->querystring) - strlen("QUERY_STRING="));
-    }
+    server_real_path = flag->c_dir;
+    request->querystring = query;
     /*check the uri contain ? or not*/
-  } else if (flag->c_dir != NULL && strstr(request->path, "?") != NULL) {
-    char *chp = request->path;
-    while ((*chp != '?') && (*chp != '\0'))
-      chp++;
-    /*truncate req.path after ?*/
-    if (*chp == '?') {
-      *cgi_request = 1;
-      *chp = '\0';
-      if (strlen(flag->c_dir) + strlen(request->path) > PATH_MAX
-          || strlen(chp + 1) > PATH_MAX) {
-        if (uri_status != NULL)
-          *uri_status = RESPONSE_STATUS_BAD_REQUEST;
-        return -1;
-      }
-      strncpy(query_string, ++chp, PATH_MAX);
-      strcpy(uri_path, flag->c_dir);
-      strcat(uri_path, request->path);
-      if (realpath(flag->dir, server_real_path) == NULL) {
-        /*log error*/
-        if (uri_status != NULL) {
-          *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
-          /*
-           * Bad server configuration since this should
-           * have been checked at startup
-           */
-        }
-        return -1;
-      }
+  } else if (flag->c_dir != NULL && query != NULL) {
+    *cgi_request = 1;
+    if (strlen(query) > PATH_MAX) {
+      if (uri_status != NULL)
+        *uri_status = RESPONSE_STATUS_BAD_REQUEST;
+      return -1;
     }
+    request->querystring = query;
+    uri_path = path_join(request->arena, flag->c_dir, request->path);
+    /* resolved at startup */
+    server_real_path = flag->dir;
 
   } else {
-    /* get the server "realpath" */
-    if (realpath(flag->dir, server_real_path) == NULL) {
-      /*log error*/
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
-        /*
-         * Bad server configuration since this should have been checked at
-         * startup
-         */
-      }
-      return -1;
-    }
+    /* the server "realpath", resolved at startup */
+    server_real_path = flag->dir;
 
     /* append base/server directory to requested uri */
-    if ((strlen(server_real_path) + strlen(request->path)) > PATH_MAX) {
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_BAD_REQUEST;
-      }
-      return -1;
-    }
+    uri_path = path_join(request->arena, server_real_path, request->path);
+  }
 
-    if ((strcpy(uri_path, server_real_path) == NULL)
-        || (strcat(uri_path, request->path) == NULL)) {
-      if (uri_status != NULL) {
-        *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
-      }
-      return -1;
-      /* log error */
+  if (uri_path == NULL) {
+    if (uri_status != NULL) {
+      *uri_status = (errno == ENAMETOOLONG) ?
+          RESPONSE_STATUS_BAD_REQUEST : RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
     }
+    return -1;
   }
 
   if (*cgi_request) {
@@ -904,6 +1623,8 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
       if (uri_status != NULL) {
         *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
       }
+      return -1;
+      /* NOTREACHED */
       break;
     }
   }
@@ -951,8 +1672,15 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
    * server.  Now we need to make sure that it is within the server's directory
    */
 
-  /* eliminate /./ and /../ from the path */
-  if (realpath(uri_path, uri_real_path) == NULL) {
+  /* the path is normalized, so without symlinks it is its own realpath */
+  if (path_no_symlinks(uri_path)) {
+    uri_real_path = uri_path;
+    len = strlen(uri_real_path);
+    while ((len > 1) && (uri_real_path[len - 1] == '/')) {
+      uri_real_path[--len] = '\0';
+    }
+  } else if (((uri_real_path = arena_alloc(request->arena, PATH_MAX + 1))
+      == NULL) || (realpath(uri_path, uri_real_path) == NULL)) {
     /*log error*/
     if (uri_status != NULL) {
       *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
@@ -967,12 +1695,19 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
     }
 
     if (*cgi_request) {
-      strcpy(realpath_str, (char*) uri_real_path);
+      request->path = uri_real_path;
     } else {
       /* check if uri_real_path points to a directory and if it does check for
        * index.html
        */
-      check_index_html(uri_real_path, realpath_str);
+      if ((request->path = arena_alloc(request->arena,
+          strlen(uri_real_path) + sizeof("/" INDEX_HTML))) == NULL) {
+        if (uri_status != NULL) {
+          *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        return -1;
+      }
+      check_index_html(uri_real_path, request->path);
     }
     return 0;
   } else {
@@ -990,7 +1725,8 @@ checkuri(struct request * request, int * uri_status, struct flags * flag,
  * Checks if index.html exists.
  *
  * @param path the path where an index.html file is supposed to be located.
- * @param index_html stores the path to index.html in this variable.
+ * @param index_html stores the path to index.html in this variable, which
+ *  holds at least strlen(path) + sizeof("/" INDEX_HTML) bytes.
  * @return 0, if successful and -1 otherwise.
  */
 int
@@ -1053,11 +1789,12 @@ check_index_html(const char * path, char * index_html)
  *
  * @param response the response information.
  * @param simple_response 1 if no headers are to be sent. 0 otherwise.
- * @param socket the socket to which the client is connected.
+ * @param conn the client connection.
  * @return 0 if successful. -1 otherwise.
  */
 int
-send_generic_page(struct response * response, int simple_response, int socket,
+send_generic_page(struct response * response, int simple_response,
+    struct connection * conn,
     char * custom_msg)
 {
   char buf[BUF_SIZE];
@@ -1164,12 +1901,12 @@ send_generic_page(struct response * response, int simple_response, int socket,
   strncpy(response->content_type, "text/html",
       sizeof(response->content_type) - 1);
 
-  if (coderesp(response, socket, !simple_response) != 0) {
+  if (coderesp(response, conn, !simple_response) != 0) {
     warnx("failed to send headers");
     return -1;
   }
 
-  if (write(socket, buf, sizeof(buf) - buf_size_remain) < 0) {
+  if (conn_write(conn, buf, sizeof(buf) - buf_size_remain) < 0) {
     warn("write failed");
     return -1;
   }
@@ -1192,117 +1929,145 @@ send_generic_page(struct response * response, int simple_response, int socket,
 }
 
 /**
- * Creates HTML text containing a directory listing for the given
- * request path and sends it over the given socket.
+ * Appends formatted text to the given page.
  *
- * @param request the client request.
- * @param socket the client socket.
+ * @param page the page to append to.
+ * @param format the printf(3) format string.
  * @return 0 on success and -1 otherwise.
  */
-int
-send_directory_listing(struct request * request, int socket)
+static int
+page_printf(struct page * page, const char * format, ...)
 {
-  char buf[BUF_SIZE];
-  size_t buf_size_remain;
+  va_list ap;
   int written;
-  char * buf_pos;
+
+  for (;;) {
+    va_start(ap, format);
+    written = vsnprintf(page->data + page->len, page->size - page->len,
+        format, ap);
+    va_end(ap);
+    if (written < 0) {
+      return -1;
+    } else if (page->len + written < page->size) {
+      page->len += written;
+      return 0;
+    } else {
+      /* grow and try again */
+      size_t size = (page->size == 0) ? BUF_SIZE : page->size;
+      char *data;
+
+      while (size <= page->len + written) {
+        size *= 2;
+      }
+      if ((data = realloc(page->data, size)) == NULL) {
+        warn("cannot grow page");
+        return -1;
+      }
+      page->data = data;
+      page->size = size;
+    }
+  }
+}
+
+/**
+ * Reads and sorts a directory and generates its listing page.
+ *
+ * @param arg the struct listing_task.
+ */
+static void
+listing_task_main(void * arg)
+{
+  struct listing_task *task = arg;
+  struct page *page = &task->page;
   struct dirent ** namelist;
   int entries;
   int i;
 
-  buf_size_remain = sizeof(buf);
-  buf_pos = buf;
-
-  entries = scandir(request->path, &namelist, 0, alphasort);
+  entries = scandir(task->path, &namelist, 0, alphasort);
   if (entries < 0) {
     perror("scandir");
   }
 
-  /* begin html response */
-  written = write_buffer(buf_pos, buf_size_remain, "<html>%s<head>%s", CRLF,
-  CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer\n");
-    return -1;
-  }
-  buf_pos += written;
-  buf_size_remain -= written;
-
-  /* write custom title */
-  written = write_buffer(buf_pos, buf_size_remain,
-      "<title>Team Geronimo - %s</title>%s</head>%s", basename(request->path),
-      CRLF, CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer\n");
-    return -1;
-  }
-  buf_pos += written;
-  buf_size_remain -= written;
-
-  /* begin html body */
-  written = write_buffer(buf_pos, buf_size_remain,
-      "<body>%s<h1>Directory Listing for %s</h1>%s<p>%s", CRLF,
-      basename(request->path), CRLF, CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer\n");
-    return -1;
-  }
-  buf_pos += written;
-  buf_size_remain -= written;
+  /* begin html response, write custom title and begin html body */
+  task->failed = (page_printf(page, "<html>%s<head>%s", CRLF, CRLF) < 0)
+      || (page_printf(page, "<title>Team Geronimo - %s</title>%s</head>%s",
+          task->name, CRLF, CRLF) < 0)
+      || (page_printf(page,
+          "<body>%s<h1>Directory Listing for %s</h1>%s<p>%s", CRLF,
+          task->name, CRLF, CRLF) < 0);
 
   /* write each entry */
   for (i = 0; i < entries; i++) {
-    /* if buffer almost full write it out to socket */
-    if (buf_size_remain < strlen(namelist[i]->d_name) + 2) { /* +2 for CRLF */
-      if (write(socket, buf, sizeof(buf) - buf_size_remain) < 0) {
-        perror("error writing directory listing");
-        return -1;
-      }
-      buf_pos = buf;
-      buf_size_remain = sizeof(buf);
-    }
-
     /* write each entry in the directory in a separate line */
-    if ((strlen(namelist[i]->d_name) >= 1) && (namelist[i]->d_name[0] != '.')) {
-      written = write_buffer(buf_pos, buf_size_remain, "%s%s",
-          namelist[i]->d_name, CRLF);
-      if (written < 0) {
-        warnx("failed to write to buffer\n");
-        return -1;
-      }
-      buf_pos += written;
-      buf_size_remain -= written;
+    if (!task->failed && (strlen(namelist[i]->d_name) >= 1)
+        && (namelist[i]->d_name[0] != '.')) {
+      task->failed = (page_printf(page, "%s%s", namelist[i]->d_name, CRLF)
+          < 0);
     }
     free(namelist[i]);
   }
-  free(namelist);
+  if (entries >= 0) {
+    free(namelist);
+  }
 
   /* write closing html headers */
-  /* if buffer almost full write it out to socket */
-  if (buf_size_remain < 100) {
-    if (write(socket, buf, sizeof(buf) - buf_size_remain) < 0) {
-      perror("error writing directory listing");
-      return -1;
-    }
-    buf_pos = buf;
-    buf_size_remain = sizeof(buf);
+  if (!task->failed) {
+    task->failed = (page_printf(page, "</p>%s</body>%s</html>%s", CRLF, CRLF,
+        CRLF) < 0);
   }
+}
 
-  written = write_buffer(buf_pos, buf_size_remain, "</p>%s</body>%s</html>%s",
-  CRLF, CRLF, CRLF);
-  if (written < 0) {
-    warnx("failed to write to buffer\n");
+/**
+ * Creates HTML text containing a directory listing for the given
+ * request path and sends it over the given connection with headers, if
+ * desired. The listing is generated first, so that its length can be
+ * sent in the Content-Length field.
+ *
+ * @param request the client request.
+ * @param response the response information.
+ * @param simple_response 1 if no headers are to be sent. 0 otherwise.
+ * @param conn the client connection.
+ * @return 0 on success and -1 otherwise.
+ */
+int
+send_directory_listing(struct request * request, struct response * response,
+    int simple_response, struct connection * conn)
+{
+  struct listing_task task;
+
+  bzero(&task, sizeof(task));
+  task.path = request->path;
+  path_basename(request->path, task.name, sizeof(task.name));
+  /* large directories take long to read and sort */
+  if (run_stage(conn, listing_task_main, &task, sizeof(task), request->path)
+      > 0) {
+    return 0;
+  }
+  if (task.failed) {
+    warnx("failed to write to buffer");
+    free(task.page.data);
+    return -1;
+  }
+
+  response->content_length = task.page.len;
+  bzero(response->content_type, sizeof(response->content_type));
+  strncpy(response->content_type, "text/html",
+      sizeof(response->content_type) - 1);
+
+  if (coderesp(response, conn, !simple_response) != 0) {
+    warnx("failed to send headers");
+    free(task.page.data);
     return -1;
   }
-  buf_pos += written;
-  buf_size_remain -= written;
 
-  /* write remaining contents of buf */
-  if (write(socket, buf, sizeof(buf) - buf_size_remain) < 0) {
+  if ((request->method != REQUEST_METHOD_HEAD)
+      && (conn_write(conn, task.page.data, task.page.len) < 0)) {
     perror("error writing directory listing");
+    free(task.page.data);
     return -1;
   }
 
+  free(task.page.data);
   return 0;
 }
 
@@ -1317,38 +2082,38 @@ send_directory_listing(struct request * request, int socket)
  *  It can be set to NULL if not required
  * @param flag user-provided flags.
  * @param cgi_path path where the cgi script is located.
- * @param socket server socket that is connected to a client.
+ * @param conn the client connection.
  * @return 0 on success (equivalent to 200 OK). Otherwise -1.
  */
 int
 execute_cgi(struct request * request, struct flags * flag, int * uri_status,
-    char * cgi_path, int socket)
+    char * cgi_path, struct connection * conn)
 {
   char meth_env[255];
   char query_env[255];
   char length_env[255];
-  char query_string[255];
   char type_env[255];
   int cgi_output[2];
   int cgi_input[2];
+  char buf[BUF_SIZE];
+  struct conn_chunked chunked;
+  ssize_t n_bytes;
   pid_t pid;
   int status;
   int i;
-  char c;
   int content_length = request->content_length;
 
   if (request->method == REQUEST_METHOD_GET
       || request->method == REQUEST_METHOD_HEAD) {
-    if (!request->querystring) {
-      sprintf(query_env, "QUERY_STRING =%s", query_string);
-    }
+    snprintf(query_env, sizeof(query_env), "QUERY_STRING =%s",
+        (request->querystring != NULL) ? request->querystring : "");
     if (request->method == REQUEST_METHOD_GET) {
       sprintf(meth_env, "REQUEST_METHOD =GET");
     } else {
       sprintf(meth_env, "REQUEST_METHOD =HEAD");
     }
   } else if (request->method == REQUEST_METHOD_POST) {
-    if (content_length <= 0) {
+    if ((content_length <= 0) && !request->chunked) {
       if (uri_status != NULL)
         *uri_status = RESPONSE_STATUS_BAD_REQUEST;
       return -1;
@@ -1361,57 +2126,105 @@ execute_cgi(struct request * request, struct flags * flag, int * uri_status,
     return -1;
   }
   sprintf(length_env, "CONTENT_LENGTH =%d", content_length);
-  sprintf(type_env, "CONTENT_TYPE =%s", request->content_type);
-  if (pipe(cgi_output) < 0) {
+  snprintf(type_env, sizeof(type_env), "CONTENT_TYPE =%s",
+      (request->content_type != NULL) ? request->content_type : "");
+  /* CGIs forked meanwhile by other clients must not inherit the pipes */
+  if (pipe2(cgi_output, O_CLOEXEC) < 0) {
     if (uri_status != NULL)
       *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
     return -1;
   }
-  if (pipe(cgi_input) < 0) {
+  if (pipe2(cgi_input, O_CLOEXEC) < 0) {
+    close(cgi_output[0]);
+    close(cgi_output[1]);
     if (uri_status != NULL)
       *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
     return -1;
   }
 
   if ((pid = fork()) < 0) {
+    close(cgi_output[0]);
+    close(cgi_output[1]);
+    close(cgi_input[0]);
+    close(cgi_input[1]);
     if (uri_status != NULL)
       *uri_status = RESPONSE_STATUS_INTERNAL_SERVER_ERROR;
     return -1;
   }
   if (pid == 0) {/* child excute CGI */
+    /* the copies on 0 and 1 do not have FD_CLOEXEC */
     dup2(cgi_output[1], 1);
     dup2(cgi_input[0], 0);
     close(cgi_output[0]);
+    close(cgi_output[1]);
+    close(cgi_input[0]);
     close(cgi_input[1]);
     if (request->method == REQUEST_METHOD_GET
         || request->method == REQUEST_METHOD_HEAD) {
       putenv(query_env);
     }
     putenv(meth_env);
-    putenv(length_env);
+    /* the length of a chunked body is not known in advance */
+    if (!request->chunked) {
+      putenv(length_env);
+    }
     putenv(type_env);
+    /* the server ignores SIGPIPE, CGIs get the default */
+    (void) signal(SIGPIPE, SIG_DFL);
     execl(cgi_path, cgi_path, (char *) NULL);
     exit(0);
   } else { /* parent */
     close(cgi_output[1]);
     close(cgi_input[0]);
+    /* a coroutine must not block the other clients on the pipes */
+    if (coro_active()) {
+      (void) fcntl(cgi_output[0], F_SETFL, O_NONBLOCK);
+      (void) fcntl(cgi_input[1], F_SETFL, O_NONBLOCK);
+    }
 
-    if (request->method == REQUEST_METHOD_POST)
-      for (i = 0; i < content_length; i++) {
-        recv(socket, &c, 1, 0);
-        if (write(cgi_input[1], &c, 1) < 0) {
+    /* the body starts with what was read along with the header */
+    if ((request->method == REQUEST_METHOD_POST) && request->chunked) {
+      /* decoded data goes to the CGI as it arrives */
+      conn_chunked_init(&chunked);
+      while ((n_bytes = conn_read_chunked(conn, &chunked, buf, sizeof(buf),
+          CLIENT_TIMEOUT_SEC)) > 0) {
+        if (coro_write(cgi_input[1], buf, n_bytes, -1) < 0) {
+          warn("write failed");
+          break;
+        }
+      }
+      if (n_bytes < 0) {
+        warn("cannot read chunked body");
+      }
+    } else if (request->method == REQUEST_METHOD_POST)
+      for (i = 0; i < content_length; i += n_bytes) {
+        n_bytes = ((size_t) (content_length - i) < sizeof(buf)) ?
+            content_length - i : sizeof(buf);
+        if (conn_read_exact(conn, buf, n_bytes, CLIENT_TIMEOUT_SEC) < 0) {
+          break;
+        }
+        if (coro_write(cgi_input[1], buf, n_bytes, -1) < 0) {
           warn("write failed");
+          break;
         }
       }
+    /* the CGI sees the end of its input */
+    close(cgi_input[1]);
 
-    while (read(cgi_output[0], &c, 1) > 0)
-      send(socket, &c, 1, 0);
+    while ((n_bytes = coro_read(cgi_output[0], buf, sizeof(buf), -1)) > 0) {
+      if (conn_write(conn, buf, n_bytes) < 0) {
+        break;
+      }
+    }
 
     close(cgi_output[0]);
-    close(cgi_input[1]);
 
     /*TODO: can use signal*/
-    waitpid(pid, &status, 0);
+    /*
+     * Reap only this CGI. A coroutine leaves one that is still running to
+     * SIGCHLD, which may also have reaped it already.
+     */
+    (void) waitpid(pid, &status, coro_active() ? WNOHANG : 0);
     if (uri_status != NULL) {
       *uri_status = RESPONSE_STATUS_OK;
     }
@@ -18,6 +18,8 @@
 #include <dirent.h>
 #include <sys/types.h>
 
+#include "arena.h"
+#include "conn.h"
 #include "util.h"
 
 #define BUF_SIZE (4 * 1024)
@@ -30,19 +32,26 @@
 
 /**
  * The request structure contains the relevant portions of the http request
- * received by the client
+ * received by the client. Its strings are allocated from the arena of the
+ * connection and live until the next request.
  */
 struct request
 {
-  char path[PATH_MAX + 1]; /* requested resource URI */
+  char *path; /* requested resource URI, the file once checkuri() passed */
   int method; /* REQUEST_METHOD_? where ? is GET, HEAD or POST */
   time_t if_modified_since_date; /* If-Modified-Since field */
+  char *range; /* Range field, or NULL */
+  int if_range; /* 1, if an If-Range field is given */
+  time_t if_range_date; /* If-Range field, -1 for an entity tag */
   int content_length; /*content_length field  for cgi request*/
-  char content_type[64];/*content_type field for cgi request*/
-  char querystring[255];/*for cgi GET*/
-  /* only version 0.9 and 1.0 are valid */
+  int chunked; /* Transfer-Encoding: 1 chunked, 0 absent, -1 unsupported */
+  char *content_type; /* content_type field for cgi request, or NULL */
+  char *querystring; /* for cgi GET, or NULL */
+  int keep_alive; /* Connection field: 1 keep-alive, 0 close, -1 absent */
+  /* only version 0.9, 1.0 and 1.1 are valid */
   int version_major;
   int version_minor;
+  struct arena *arena; /* memory of the request */
 };
 
 /**
@@ -51,9 +60,11 @@ struct request
 enum response_status_codes
 {
   RESPONSE_STATUS_OK = 200,
+  RESPONSE_STATUS_PARTIAL_CONTENT = 206,
   RESPONSE_STATUS_BAD_REQUEST = 400,
   RESPONSE_STATUS_FORBIDDEN = 403,
   RESPONSE_STATUS_NOT_FOUND = 404,
+  RESPONSE_STATUS_RANGE_NOT_SATISFIABLE = 416,
   RESPONSE_STATUS_NOT_IMPLEMENTED = 501,
   RESPONSE_STATUS_VERSION_NOT_SUPPORTED = 505,
   RESPONSE_STATUS_CONNECTION_TIMED_OUT = 522,
@@ -68,27 +79,36 @@ struct response
 {
   int code; /* Response code filed */
   time_t last_modified; /* Last-Modified field */
+  int accept_ranges; /* 1, if Accept-Ranges: bytes is sent */
   char content_type[64]; /* Content-Type field */
-  int content_length; /* Content-Length field */
+  char content_range[80]; /* Content-Range field, or empty */
+  off_t content_length; /* Content-Length field */
+  const char *entity_headers; /* the entity header fields, rendered, or NULL */
+  size_t entity_headers_len; /* length of entity_headers */
 };
 
 void
 init_response(struct response *, int);
 int
-httpd(int, struct flags *, const char *);
+httpd(struct connection *, struct flags *);
 int
-coderesp(struct response *, int, int);
+httpd_respond(struct connection *, struct flags *);
 int
-fileserver(struct request *, struct response *, int, int, struct flags *);
+coderesp(struct response *, struct connection *, int);
 int
-checkuri(struct request *, int *, struct flags *, char *, int *);
+fileserver(struct request *, struct response *, int, struct connection *,
+    struct flags *);
+int
+checkuri(struct request *, int *, struct flags *, int *);
 int
 check_index_html(const char * path, char * index_html);
 int
-send_generic_page(struct response *, int, int, char *);
+send_generic_page(struct response *, int, struct connection *, char *);
 int
-send_directory_listing(struct request *, int);
+send_directory_listing(struct request *, struct response *, int,
+    struct connection *);
 int
-execute_cgi(struct request * , struct flags * , int *, char * ,int);
+execute_cgi(struct request * , struct flags * , int *, char * ,
+    struct connection *);
 
 #endif /* !_SWS_HTTP_H_ */
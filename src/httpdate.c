@@ -0,0 +1,361 @@
+/*
+ * httpdate.c
+ *
+ * Parsing and formatting of HTTP-dates. The three date formats of RFC 1945
+ * have fixed field positions, so they are read directly instead of with
+ * strptime(3) and mktime(3), which consult the locale and time zone on
+ * every call. Dates are converted to and from days since the epoch with
+ * the proleptic Gregorian calendar, always in UTC.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+#include <time.h>
+
+#include "httpdate.h"
+
+#define SECS_PER_DAY (24 * 60 * 60)
+
+static const char weekdays[7][10] = {
+  "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday",
+  "Saturday"
+};
+
+static const char months[12][4] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+  "Nov", "Dec"
+};
+
+static int
+date_digits(const char *, int);
+static int
+date_weekday(const char *, size_t);
+static int
+date_month(const char *);
+static int
+date_clock(const char *, int *);
+static int
+date_days_in_month(int, int);
+static long
+days_from_civil(long, int, int);
+static void
+civil_from_days(long, long *, int *, int *);
+static void
+date_put(char *, int, int);
+
+/**
+ * Reads a number of exactly the given number of decimal digits.
+ *
+ * @param str the digits.
+ * @param count the number of digits.
+ * @return the number, or -1 if a character is no digit.
+ */
+static int
+date_digits(const char * str, int count)
+{
+  int number = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if ((str[i] < '0') || (str[i] > '9')) {
+      return -1;
+    }
+    number = number * 10 + (str[i] - '0');
+  }
+
+  return number;
+}
+
+/**
+ * Identifies a weekday name, either the full name or its first three
+ * letters.
+ *
+ * @param str the name.
+ * @param len the length of the name.
+ * @return the day of the week, 0 for Sunday, or -1 if it is no name.
+ */
+static int
+date_weekday(const char * str, size_t len)
+{
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (((len == 3) || (len == strlen(weekdays[i])))
+        && (strncmp(str, weekdays[i], len) == 0)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Identifies a three letter month name.
+ *
+ * @param str the name.
+ * @return the month, 0 for January, or -1 if it is no name.
+ */
+static int
+date_month(const char * str)
+{
+  int i;
+
+  for (i = 0; i < 12; i++) {
+    if ((str[0] == months[i][0]) && (str[1] == months[i][1])
+        && (str[2] == months[i][2])) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Reads a time of day in the form HH:MM:SS.
+ *
+ * @param str the time.
+ * @param secs set to the seconds since midnight.
+ * @return 0 on success. -1, if the time is malformed or out of range.
+ */
+static int
+date_clock(const char * str, int * secs)
+{
+  int hour = date_digits(str, 2);
+  int min = date_digits(str + 3, 2);
+  int sec = date_digits(str + 6, 2);
+
+  if ((str[2] != ':') || (str[5] != ':') || (hour < 0) || (hour > 23)
+      || (min < 0) || (min > 59) || (sec < 0) || (sec > 59)) {
+    return -1;
+  }
+  *secs = (hour * 60 + min) * 60 + sec;
+
+  return 0;
+}
+
+/**
+ * Computes the number of days of a month.
+ *
+ * @param year the year.
+ * @param month the month, 1 for January.
+ * @return the number of days.
+ */
+static int
+date_days_in_month(int year, int month)
+{
+  static const int days[12] = {
+    31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+  };
+
+  if ((month == 2) && ((year % 4) == 0)
+      && (((year % 100) != 0) || ((year % 400) == 0))) {
+    return 29;
+  }
+  return days[month - 1];
+}
+
+/**
+ * Converts a date to the number of days since 1970-01-01. Years are
+ * counted in eras of 400 years, which all have the same number of days,
+ * and years begin with March, so that leap days end the year.
+ *
+ * @param year the year.
+ * @param month the month, 1 for January.
+ * @param day the day of the month.
+ * @return the number of days, negative before 1970.
+ */
+static long
+days_from_civil(long year, int month, int day)
+{
+  long era;
+  long yoe; /* year of era */
+  long doy; /* day of year, from March 1st */
+  long doe; /* day of era */
+
+  year -= (month <= 2);
+  era = ((year >= 0) ? year : year - 399) / 400;
+  yoe = year - era * 400;
+  doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+/**
+ * Converts a number of days since 1970-01-01 to a date. The inverse of
+ * days_from_civil().
+ *
+ * @param days the number of days.
+ * @param year set to the year.
+ * @param month set to the month, 1 for January.
+ * @param day set to the day of the month.
+ */
+static void
+civil_from_days(long days, long * year, int * month, int * day)
+{
+  long era;
+  long doe;
+  long yoe;
+  long doy;
+  long mp; /* month, from March */
+
+  days += 719468;
+  era = ((days >= 0) ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *day = doy - (153 * mp + 2) / 5 + 1;
+  *month = (mp < 10) ? mp + 3 : mp - 9;
+  *year = yoe + era * 400 + (*month <= 2);
+}
+
+/**
+ * Writes a number as decimal digits, with leading zeros.
+ *
+ * @param dst the buffer.
+ * @param number the number, not negative.
+ * @param count the number of digits.
+ */
+static void
+date_put(char * dst, int number, int count)
+{
+  while (count-- > 0) {
+    dst[count] = '0' + number % 10;
+    number /= 10;
+  }
+}
+
+/**
+ * Parses the HTTP-date according to RFC 1945 and stores it as a time_t.
+ * Accepts the forms
+ *
+ *   rfc1123-date   = wkday "," SP date1 SP time SP "GMT"
+ *   rfc850-date    = weekday "," SP date2 SP time SP "GMT"
+ *   asctime-date   = wkday SP date3 SP time SP 4DIGIT
+ *
+ * exactly, with the names in their case. The weekday is not checked
+ * against the date.
+ *
+ * @param date the date to parse
+ * @param dst where to store the time_t
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+http_date_to_time(const char * date, time_t * dst)
+{
+  const char *pos;
+  size_t len;
+  int year;
+  int month;
+  int day;
+  int secs;
+
+  if (date == NULL) {
+    return -1;
+  }
+  len = strlen(date);
+
+  if ((pos = strchr(date, ',')) == NULL) {
+    /* asctime-date: "Sun Nov  6 08:49:37 1994" */
+    if ((len != 24) || (date_weekday(date, 3) < 0) || (date[3] != ' ')
+        || (date[7] != ' ') || (date[10] != ' ') || (date[19] != ' ')) {
+      return -1;
+    }
+    month = date_month(date + 4);
+    day = (date[8] == ' ') ?
+        date_digits(date + 9, 1) : date_digits(date + 8, 2);
+    year = date_digits(date + 20, 4);
+    pos = date + 11;
+  } else if (pos - date == 3) {
+    /* rfc1123-date: "Sun, 06 Nov 1994 08:49:37 GMT" */
+    if ((len != 29) || (date_weekday(date, 3) < 0)
+        || (strncmp(pos, ", ", 2) != 0) || (date[7] != ' ')
+        || (date[11] != ' ') || (date[16] != ' ')
+        || (strcmp(date + 25, " GMT") != 0)) {
+      return -1;
+    }
+    day = date_digits(date + 5, 2);
+    month = date_month(date + 8);
+    year = date_digits(date + 12, 4);
+    pos = date + 17;
+  } else {
+    /* rfc850-date: "Sunday, 06-Nov-94 08:49:37 GMT" */
+    if ((date_weekday(date, pos - date) < 0)
+        || (len != (size_t) (pos - date) + 24)
+        || (strncmp(pos, ", ", 2) != 0) || (pos[4] != '-')
+        || (pos[8] != '-') || (pos[11] != ' ')
+        || (strcmp(pos + 20, " GMT") != 0)) {
+      return -1;
+    }
+    day = date_digits(pos + 2, 2);
+    month = date_month(pos + 5);
+    /* like strptime(3): 69-99 are 1969-1999, 00-68 are 2000-2068 */
+    if ((year = date_digits(pos + 9, 2)) >= 0) {
+      year += (year < 69) ? 2000 : 1900;
+    }
+    pos += 12;
+  }
+
+  if ((year < 0) || (month < 0) || (day < 1)
+      || (day > date_days_in_month(year, month + 1))
+      || (date_clock(pos, &secs) < 0)) {
+    return -1;
+  }
+
+  *dst = (time_t) days_from_civil(year, month + 1, day) * SECS_PER_DAY + secs;
+
+  return 0;
+}
+
+/**
+ * Converts the given time to a string in RFC 1123 format.
+ *
+ * @param time the time to convert to a RFC 1123 date
+ * @param dst the buffer to fill with the HTTP date string
+ * @param dst_len the size of the buffer in bytes
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+time_to_http_date(time_t *time, char * dst, size_t dst_len)
+{
+  long days;
+  long secs;
+  long year;
+  int month;
+  int day;
+
+  if ((time == NULL) || (dst_len <= HTTP_DATE_LEN)) {
+    return -1;
+  }
+
+  days = *time / SECS_PER_DAY;
+  secs = *time % SECS_PER_DAY;
+  if (secs < 0) {
+    secs += SECS_PER_DAY;
+    days--;
+  }
+  civil_from_days(days, &year, &month, &day);
+  if ((year < 0) || (year > 9999)) {
+    return -1;
+  }
+
+  /* "Sun, 06 Nov 1994 08:49:37 GMT", 1970-01-01 was a Thursday */
+  memcpy(dst, weekdays[((days % 7) + 11) % 7], 3);
+  memcpy(dst + 3, ", ", 2);
+  date_put(dst + 5, day, 2);
+  dst[7] = ' ';
+  memcpy(dst + 8, months[month - 1], 3);
+  dst[11] = ' ';
+  date_put(dst + 12, year, 4);
+  dst[16] = ' ';
+  date_put(dst + 17, secs / 3600, 2);
+  dst[19] = ':';
+  date_put(dst + 20, secs / 60 % 60, 2);
+  dst[22] = ':';
+  date_put(dst + 23, secs % 60, 2);
+  memcpy(dst + 25, " GMT", 5);
+
+  return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * httpdate.h
+ *
+ * Conversion between HTTP-dates and time_t.
+ */
+
+#ifndef _SWS_HTTPDATE_H_
+#define _SWS_HTTPDATE_H_
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#define HTTP_DATE_LEN 29 /* length of an RFC 1123 date */
+
+int
+http_date_to_time(const char *, time_t *);
+int
+time_to_http_date(time_t *, char *, size_t);
+
+#endif /* !_SWS_HTTPDATE_H_ */
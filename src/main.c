@@ -16,7 +16,15 @@
 
 #include <arpa/inet.h>
 
+#include "affinity.h"
+#include "bodycache.h"
+#include "bufpool.h"
+#include "coro.h"
+#include "fdcache.h"
+#include "mapcache.h"
 #include "net.h"
+#include "parser.h"
+#include "uring.h"
 #include "util.h"
 
 #ifdef __linux__
@@ -46,15 +54,63 @@ main(int argc, char *argv[])
 
   while ((ch = getopt(argc, argv, FLAGS_SUPPORTED)) != -1) {
     switch (ch) {
+    case 'A':
+#ifdef HAVE_AFFINITY
+      if (affinity_parse(&flag, optarg) < 0) {
+        exit(EXIT_FAILURE);
+      }
+#else
+      errx(EXIT_FAILURE, "CPU affinity is not supported on this platform");
+#endif
+      break;
+    case 'a':
+      flag.accept_batch = atoi(optarg);
+      if ((flag.accept_batch < 1) || (flag.accept_batch > MAX_ACCEPT_BATCH)) {
+        errx(EXIT_FAILURE, "accepts per wakeup must be between 1 and %d",
+        MAX_ACCEPT_BATCH);
+      }
+      break;
+    case 'b':
+      flag.backlog = atoi(optarg);
+      if ((flag.backlog < 1) || (flag.backlog > MAX_BACKLOG)) {
+        errx(EXIT_FAILURE, "backlog must be between 1 and %d", MAX_BACKLOG);
+      }
+      break;
     case 'c':
-      flag.c_dir = optarg;
-      if (!is_dir(flag.c_dir)) {
+      /* resolved once, requests are checked against it lexically */
+      if (!is_dir(optarg)
+          || ((flag.c_dir = realpath(optarg, NULL)) == NULL)) {
         errx(EXIT_FAILURE, "invalid CGI dir");
       }
       break;
+    case 'D':
+      flag.defer_accept = atoi(optarg);
+      if ((flag.defer_accept < 1)
+          || (flag.defer_accept > MAX_DEFER_ACCEPT_SEC)) {
+        errx(EXIT_FAILURE, "deferred accept timeout must be between 1 and %d",
+        MAX_DEFER_ACCEPT_SEC);
+      }
+      break;
     case 'd':
       flag.dflag = 1;
       break;
+    case 'F':
+      flag.fastopen = atoi(optarg);
+      if ((flag.fastopen < 1) || (flag.fastopen > MAX_FASTOPEN_QUEUE)) {
+        errx(EXIT_FAILURE, "Fast Open queue length must be between 1 and %d",
+        MAX_FASTOPEN_QUEUE);
+      }
+      break;
+    case 'f':
+      flag.engine = ENGINE_FORK;
+      break;
+    case 'H':
+      flag.header_max = (size_t) atoi(optarg) * 1024;
+      if ((flag.header_max < BUFPOOL_MIN) || (flag.header_max > BUFPOOL_MAX)) {
+        errx(EXIT_FAILURE, "header size must be between %d and %d KB",
+        BUFPOOL_MIN / 1024, BUFPOOL_MAX / 1024);
+      }
+      break;
     case 'h':
       usage();
       exit(EXIT_SUCCESS);
@@ -83,6 +139,34 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
       }
       break;
+    case 'M':
+      if ((atoi(optarg) < 0) || (atoi(optarg) > BODYCACHE_MAX_BUDGET)) {
+        errx(EXIT_FAILURE, "content cache size must be between 0 and %d KB",
+        BODYCACHE_MAX_BUDGET);
+      }
+      flag.content_cache = (size_t) atoi(optarg) * 1024;
+      break;
+    case 'm':
+      if ((atoi(optarg) < 0) || (atoi(optarg) > MAPCACHE_MAX_BUDGET)) {
+        errx(EXIT_FAILURE, "mapping limit must be between 0 and %d MB",
+        MAPCACHE_MAX_BUDGET);
+      }
+      flag.mapped_files = (size_t) atoi(optarg) * 1024 * 1024;
+      break;
+    case 'O':
+      flag.open_files = atoi(optarg);
+      if ((flag.open_files < 0) || (flag.open_files > FDCACHE_MAX_FILES)) {
+        errx(EXIT_FAILURE, "number of open files must be between 0 and %d",
+        FDCACHE_MAX_FILES);
+      }
+      break;
+    case 'o':
+#ifdef HAVE_CORO
+      flag.engine = ENGINE_CORO;
+#else
+      errx(EXIT_FAILURE, "coroutines are not supported on this platform");
+#endif
+      break;
     case 'p':
       flag.p_port = atoi(optarg);
       if ((flag.p_port < MIN_PORT) || (flag.p_port > MAX_PORT)) {
@@ -90,6 +174,46 @@ main(int argc, char *argv[])
         MAX_PORT);
       }
       break;
+    case 'S':
+      if (strcmp(optarg, "cbpf") == 0) {
+        flag.steering = STEER_CBPF;
+      } else if (strcmp(optarg, "cpu") == 0) {
+        flag.steering = STEER_CPU;
+      } else if (strcmp(optarg, "none") == 0) {
+        flag.steering = STEER_NONE;
+      } else {
+        errx(EXIT_FAILURE, "steering must be cbpf, cpu or none");
+      }
+      break;
+    case 'T':
+      flag.tasks = atoi(optarg);
+      if ((flag.tasks < 0) || (flag.tasks > MAX_THREADS)) {
+        errx(EXIT_FAILURE, "number of task threads must be between 0 and %d",
+        MAX_THREADS);
+      }
+      break;
+    case 't':
+      flag.engine = ENGINE_THREADS;
+      flag.threads = atoi(optarg);
+      if ((flag.threads < 1) || (flag.threads > MAX_THREADS)) {
+        errx(EXIT_FAILURE, "number of threads must be between 1 and %d",
+        MAX_THREADS);
+      }
+      break;
+    case 'u':
+#ifdef HAVE_IO_URING
+      flag.engine = ENGINE_URING;
+#else
+      errx(EXIT_FAILURE, "io_uring is not supported on this platform");
+#endif
+      break;
+    case 'w':
+      flag.workers = atoi(optarg);
+      if ((flag.workers < 1) || (flag.workers > MAX_WORKERS)) {
+        errx(EXIT_FAILURE, "number of workers must be between 1 and %d",
+        MAX_WORKERS);
+      }
+      break;
     default:
       usage();
       exit(EXIT_FAILURE);
@@ -105,9 +229,7 @@ main(int argc, char *argv[])
     usage();
     exit(EXIT_FAILURE);
   }
-  flag.dir = argv[0];
-
-  if (!is_dir(flag.dir)) {
+  if (!is_dir(argv[0]) || ((flag.dir = realpath(argv[0], NULL)) == NULL)) {
     errx(EXIT_FAILURE, "invalid dir");
   }
 
@@ -116,6 +238,13 @@ main(int argc, char *argv[])
   flag.dflag = 1;
 #endif
 
+  if (http_header_check() < 0) {
+    errx(EXIT_FAILURE, "inconsistent header name table");
+  }
+  bufpool_init(flag.header_max);
+  fdcache_init(flag.open_files);
+  bodycache_init(flag.content_cache);
+  mapcache_init(flag.mapped_files);
   run_server(&flag);
   close(flag.logfd);
   return EXIT_SUCCESS;
@@ -128,7 +257,10 @@ static void
 usage(void)
 {
   (void) fprintf(stderr,
-      "usage: %s [-dh] [-c dir] [-i address] [-l file] [-p port] dir\n",
+      "usage: %s [-dfhou] [-A cpus] [-a accepts] [-b backlog] [-c dir] "
+      "[-D seconds] [-F qlen] [-H kbytes] [-i address] [-l file] [-M kbytes] "
+      "[-m mbytes] [-O files] [-p port] [-S steering] [-T threads] "
+      "[-t threads] [-w workers] dir\n",
       getprogname());
 }
 
@@ -0,0 +1,355 @@
+/*
+ * mapcache.c
+ *
+ * Files whose bodies are copied to the socket, rather than sent with
+ * sendfile(2), are mapped once and sent straight from the mapping, which
+ * saves reading them through a buffer for every response. A mapping is
+ * found by device and inode and used as long as size and mtime match the
+ * file. Mappings that are not in use stay mapped for the next response,
+ * until the limit on mapped bytes needs their room; the least recently
+ * used one goes first.
+ *
+ * A file truncated while mapped leaves pages without data behind. The
+ * kernel reports sends from them as EFAULT. Reading them in user space
+ * raises SIGBUS, whose handler puts a page of zeros in place of the page
+ * and marks the mapping as outdated, so that the next response maps the
+ * file again. Faults outside the mappings keep the default action.
+ *
+ * The registry is shared by the threads of a process.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mapcache.h"
+
+#define MAPCACHE_BUCKETS 256
+
+/**
+ * The address range of a mapping, as seen by the SIGBUS handler.
+ */
+struct mapcache_range
+{
+  char * volatile start;
+  volatile size_t len; /* 0 while the range is not set */
+  volatile sig_atomic_t truncated; /* 1, once a page was replaced */
+  int used; /* 1, if an entry owns the slot */
+};
+
+static unsigned int
+mapcache_bucket(dev_t, ino_t);
+static void
+mapcache_unlink(struct mapcache_entry *);
+static void
+mapcache_release(struct mapcache_entry *);
+static void
+mapcache_unregister(struct mapcache_entry *);
+static int
+mapcache_matches(const struct mapcache_entry *, const struct stat *);
+static int
+mapcache_slot(void);
+static void
+mapcache_sigbus(int, siginfo_t *, void *);
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_budget; /* bytes, 0 if mapping is disabled */
+static size_t mapped_bytes; /* bytes of all mappings, including outdated */
+static long page_size;
+static struct mapcache_entry *buckets[MAPCACHE_BUCKETS];
+static struct mapcache_entry *unused_head; /* most recently used */
+static struct mapcache_entry *unused_tail; /* least recently used */
+static struct mapcache_range ranges[MAPCACHE_MAX_MAPS];
+
+/**
+ * Finds the bucket of a file.
+ *
+ * @param dev the device of the file.
+ * @param ino the inode of the file.
+ * @return the index into buckets.
+ */
+static unsigned int
+mapcache_bucket(dev_t dev, ino_t ino)
+{
+  return ((unsigned int) ino ^ ((unsigned int) dev * 31U))
+      & (MAPCACHE_BUCKETS - 1);
+}
+
+/**
+ * Takes a registered entry out of the list of unused entries.
+ */
+static void
+mapcache_unlink(struct mapcache_entry * entry)
+{
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    unused_head = entry->older;
+  }
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    unused_tail = entry->newer;
+  }
+  entry->newer = entry->older = NULL;
+}
+
+/**
+ * Drops a reference to an entry. The last reference unmaps the file.
+ */
+static void
+mapcache_release(struct mapcache_entry * entry)
+{
+  struct mapcache_range *range = &ranges[entry->slot];
+
+  if (--entry->refs > 0) {
+    return;
+  }
+  /* the handler ignores a range of length 0 */
+  range->len = 0;
+  range->start = NULL;
+  range->used = 0;
+  if (munmap(entry->addr, entry->size) < 0) {
+    warn("munmap");
+  }
+  mapped_bytes -= entry->size;
+  free(entry);
+}
+
+/**
+ * Removes an entry from the registry. Holders may still use the mapping.
+ */
+static void
+mapcache_unregister(struct mapcache_entry * entry)
+{
+  struct mapcache_entry **link;
+
+  link = &buckets[mapcache_bucket(entry->dev, entry->ino)];
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  if (entry->refs == 1) {
+    mapcache_unlink(entry);
+  }
+  entry->registered = 0;
+  mapcache_release(entry);
+}
+
+/**
+ * Checks that a mapping is of the current version of a file.
+ *
+ * @param entry the entry.
+ * @param st the current stat result of the file.
+ * @return 1, if the file is unchanged. Otherwise, 0.
+ */
+static int
+mapcache_matches(const struct mapcache_entry * entry, const struct stat * st)
+{
+  return (entry->size == st->st_size)
+      && (entry->mtime.tv_sec == st->st_mtim.tv_sec)
+      && (entry->mtime.tv_nsec == st->st_mtim.tv_nsec)
+      && !ranges[entry->slot].truncated;
+}
+
+/**
+ * Finds a free slot in ranges.
+ *
+ * @return the index, or -1 if all slots are used.
+ */
+static int
+mapcache_slot(void)
+{
+  int i;
+
+  for (i = 0; i < MAPCACHE_MAX_MAPS; i++) {
+    if (!ranges[i].used) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Handles SIGBUS. A fault within a mapping, beyond the end of a truncated
+ * file, gets a page of zeros; others end the process as usual.
+ */
+static void
+mapcache_sigbus(int sig, siginfo_t * info, void * context)
+{
+  struct sigaction sa;
+  char *addr = info->si_addr;
+  char *start;
+  size_t len;
+  int i;
+
+  (void) context;
+  for (i = 0; i < MAPCACHE_MAX_MAPS; i++) {
+    start = ranges[i].start;
+    len = ranges[i].len;
+    if ((len == 0) || (addr < start) || ((size_t) (addr - start) >= len)) {
+      continue;
+    }
+    addr = start + ((size_t) (addr - start) & ~((size_t) page_size - 1));
+    if (mmap(addr, page_size, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      ranges[i].truncated = 1;
+      return;
+    }
+    break;
+  }
+
+  /* the access faults again, with the default action */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  (void) sigemptyset(&sa.sa_mask);
+  (void) sigaction(sig, &sa, NULL);
+}
+
+/**
+ * Sets the limit on mapped bytes and installs the SIGBUS handler.
+ *
+ * @param budget the limit in bytes, 0 to disable mapping.
+ */
+void
+mapcache_init(size_t budget)
+{
+  struct sigaction sa;
+
+  cache_budget = budget;
+  if (budget == 0) {
+    return;
+  }
+  page_size = sysconf(_SC_PAGESIZE);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = mapcache_sigbus;
+  sa.sa_flags = SA_SIGINFO;
+  (void) sigemptyset(&sa.sa_mask);
+  if ((page_size <= 0) || (sigaction(SIGBUS, &sa, NULL) < 0)) {
+    warn("cannot handle SIGBUS, files are not mapped");
+    cache_budget = 0;
+  }
+}
+
+/**
+ * Finds or creates the mapping of a file. Files larger than a quarter of
+ * the limit are not mapped. An entry of a changed file is dropped.
+ *
+ * @param fd the file.
+ * @param end the offset one past the last byte to be sent; the file must
+ * have at least as many bytes.
+ * @return the entry, to be released with mapcache_put(), or NULL if the
+ * file is to be read instead.
+ */
+struct mapcache_entry *
+mapcache_get(int fd, off_t end)
+{
+  struct mapcache_entry *entry;
+  struct stat st;
+  unsigned int bucket;
+  size_t size;
+  void *addr;
+  int slot;
+
+  if ((cache_budget == 0) || (fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)
+      || (st.st_size == 0) || (st.st_size < end)
+      || ((size_t) st.st_size > cache_budget / 4)) {
+    return NULL;
+  }
+  size = st.st_size;
+  bucket = mapcache_bucket(st.st_dev, st.st_ino);
+
+  (void) pthread_mutex_lock(&cache_lock);
+  for (entry = buckets[bucket]; entry != NULL; entry = entry->next) {
+    if ((entry->dev == st.st_dev) && (entry->ino == st.st_ino)) {
+      break;
+    }
+  }
+  if (entry != NULL) {
+    if (mapcache_matches(entry, &st)) {
+      if (entry->refs == 1) {
+        mapcache_unlink(entry);
+      }
+      entry->refs++;
+      (void) pthread_mutex_unlock(&cache_lock);
+      return entry;
+    }
+    mapcache_unregister(entry);
+  }
+
+  /* make room, unused mappings first */
+  while ((((slot = mapcache_slot()) < 0)
+      || (mapped_bytes + size > cache_budget)) && (unused_tail != NULL)) {
+    mapcache_unregister(unused_tail);
+  }
+  if ((slot < 0) || (mapped_bytes + size > cache_budget)) {
+    (void) pthread_mutex_unlock(&cache_lock);
+    return NULL;
+  }
+  if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+    (void) pthread_mutex_unlock(&cache_lock);
+    warn("cannot allocate mapping");
+    return NULL;
+  }
+  if ((addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0))
+      == MAP_FAILED) {
+    (void) pthread_mutex_unlock(&cache_lock);
+    warn("mmap");
+    free(entry);
+    return NULL;
+  }
+  /* read ahead aggressively, the file is sent from start to end */
+  (void) posix_madvise(addr, size, POSIX_MADV_SEQUENTIAL);
+
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtim;
+  entry->addr = addr;
+  entry->slot = slot;
+  ranges[slot].used = 1;
+  ranges[slot].truncated = 0;
+  ranges[slot].start = entry->addr;
+  ranges[slot].len = entry->size;
+  mapped_bytes += entry->size;
+  /* one reference for the registry, one for the caller */
+  entry->refs = 2;
+  entry->registered = 1;
+  entry->next = buckets[bucket];
+  buckets[bucket] = entry;
+  (void) pthread_mutex_unlock(&cache_lock);
+
+  return entry;
+}
+
+/**
+ * Releases an entry returned by mapcache_get(). A registered mapping that
+ * is no longer in use stays mapped for later responses.
+ */
+void
+mapcache_put(struct mapcache_entry * entry)
+{
+  (void) pthread_mutex_lock(&cache_lock);
+  if (entry->registered && (entry->refs == 2)) {
+    entry->refs--;
+    entry->newer = NULL;
+    entry->older = unused_head;
+    if (unused_head != NULL) {
+      unused_head->newer = entry;
+    } else {
+      unused_tail = entry;
+    }
+    unused_head = entry;
+  } else {
+    mapcache_release(entry);
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * mapcache.h
+ *
+ * Registry of read-only file mappings shared by the connections of a
+ * process, within a limit on the mapped bytes.
+ */
+
+#ifndef _SWS_MAPCACHE_H_
+#define _SWS_MAPCACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <time.h>
+
+#define MAPCACHE_MAX_MAPS 1024 /* most files mapped at a time */
+#define MAPCACHE_DEFAULT_BUDGET (256 * 1024 * 1024) /* default bytes */
+#define MAPCACHE_MAX_BUDGET 65536 /* largest limit in MB */
+
+/**
+ * A mapped file. Found with mapcache_get() and released with
+ * mapcache_put(); the mapping stays valid until then, even if the file
+ * changes meanwhile.
+ */
+struct mapcache_entry
+{
+  dev_t dev; /* device, inode, size and mtime of the file when mapped */
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  char *addr; /* the mapping, size bytes */
+  int slot; /* index into the ranges seen by the SIGBUS handler */
+  int refs; /* holders, plus 1 while the entry is registered */
+  int registered; /* 1, while the entry can be found */
+  struct mapcache_entry *next; /* next entry in the bucket */
+  struct mapcache_entry *newer; /* next unused entry towards the head */
+  struct mapcache_entry *older; /* next unused entry towards the tail */
+};
+
+void
+mapcache_init(size_t);
+struct mapcache_entry *
+mapcache_get(int, off_t);
+void
+mapcache_put(struct mapcache_entry *);
+
+#endif /* !_SWS_MAPCACHE_H_ */
@@ -2,120 +2,200 @@
  * Network functionality for sws.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4 */
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef sun
 #include <strings.h>
 #endif
 
+#include "affinity.h"
+#include "conn.h"
+#include "coro.h"
+#include "event.h"
 #include "http.h"
 #include "net.h"
+#include "thread.h"
+#include "uring.h"
 #include "util.h"
 
-#define BACKLOG 5
-#define CLIENT_TIMEOUT_SEC 20
+#define SOMAXCONN_PATH "/proc/sys/net/core/somaxconn"
 #define UNKNOWN_IP "X.X.X.X"
+#define RESPAWN_DELAY_SEC 1 /* minimum lifetime of a worker before respawn */
+
+/* state of the prefork supervisor for its signal handler */
+static pid_t *worker_pids; /* pids of the workers, 0 for none */
+static int worker_count;
+static volatile sig_atomic_t stop_signal; /* SIGTERM or SIGINT, once caught */
 
 static void
 accept_client(struct flags *, int);
-static void
-handle_client(int, struct sockaddr_storage *, socklen_t, struct flags *);
 static int
 setup_server_socket(struct flags *);
+static int
+max_backlog(void);
+static void
+start_listening(struct flags *, int);
+static void
+set_signal_handlers(struct flags *);
+static void
+serve_clients(struct flags *, int);
+static void
+run_worker(struct flags *, int);
+static pid_t
+spawn_worker(struct flags *, int *, int);
+static void
+prefork_sig_handler(int);
+static void
+stop_workers(void);
+static void
+run_prefork(struct flags *);
 
 /**
- * Waits for the client to send a request. Times out, if client does not
- * respond for some time.
+ * Waits for the client to send data. Times out, if client does not
+ * respond for some time. A coroutine yields to its scheduler meanwhile.
  *
- * @param client_socket the client socket
+ * @param conn the client connection
+ * @param timeout_sec the time to wait in seconds
+ * @return 0, if data is available. 1, if a timeout occurred. -1 on error.
  */
-void
-wait_for_data(int client_socket)
+int
+wait_for_data(struct connection * conn, int timeout_sec)
 {
-  fd_set rfds;
-  struct timeval tv;
-  int retval;
-
-  FD_ZERO(&rfds);
-  FD_SET(client_socket, &rfds);
-
-  /* set timeout. */
-  tv.tv_sec = CLIENT_TIMEOUT_SEC;
-  tv.tv_usec = 0;
-
-  retval = select(client_socket + 1, &rfds, NULL, NULL, &tv);
-
-  if (retval < 0) {
-    perror("select");
-  } else if (retval == 0) {
-    /* timeout occurred */
-    struct response response;
-
-    init_response(&response, RESPONSE_STATUS_CONNECTION_TIMED_OUT);
-    coderesp(&response, client_socket, 1);
-  }
+  return coro_wait(conn->socket, POLLIN, timeout_sec);
 }
 
 /**
- * Determines the client's IP address, waits for a request,
- * and handles it.
+ * Determines the IP address of a client as a string.
  *
- * @param client_sock the client socket
  * @param client client socket information
- * @param client_length length of client structure
- * @param flag user-provided flags
+ * @param client_ip the buffer to fill with the address
+ * @param client_ip_len the size of the buffer in bytes
+ * @return 1, if the address was determined. Otherwise, 0 and client_ip
+ * holds a placeholder.
  */
-static void
-handle_client(int client_sock, struct sockaddr_storage * client,
-    socklen_t client_length, struct flags * flag)
+int
+client_address(struct sockaddr_storage * client, char * client_ip,
+    size_t client_ip_len)
 {
-  char client_ip[INET6_ADDRSTRLEN];
   int determined_client_addr;
 
   /* determine client IP address */
   determined_client_addr = 0;
   /* client IP is empty by default */
-  bzero(client_ip, sizeof(client_ip));
+  bzero(client_ip, client_ip_len);
   if (client->ss_family == AF_INET6) {
     if (inet_ntop(AF_INET6, &((struct sockaddr_in6*) client)->sin6_addr,
-        client_ip, sizeof(client_ip)) == NULL) {
+        client_ip, client_ip_len) == NULL) {
       perror("inet_ntop for client address");
     } else {
       determined_client_addr = 1;
     }
   } else if (client->ss_family == AF_INET) {
     if (inet_ntop(AF_INET, &((struct sockaddr_in *) client)->sin_addr.s_addr,
-        client_ip, sizeof(client_ip)) == NULL) {
+        client_ip, client_ip_len) == NULL) {
       perror("inet_ntop for client address");
     } else {
       determined_client_addr = 1;
     }
   }
   if (!determined_client_addr) {
-    strncpy(client_ip, UNKNOWN_IP, sizeof(client_ip) - 1);
+    strncpy(client_ip, UNKNOWN_IP, client_ip_len - 1);
   }
+
+  return determined_client_addr;
+}
+
+/**
+ * Accepts a client of the server socket. The client socket is close-on-exec,
+ * so that CGIs do not inherit it, and non-blocking if requested. Uses
+ * accept4 where available to save the fcntl calls.
+ *
+ * @param server_sock the server socket
+ * @param client filled with the client address
+ * @param client_length size of client, updated to the address length
+ * @param nonblocking 1, if the client socket is to be non-blocking
+ * @return the client socket, or -1 with errno set
+ */
+int
+accept_socket(int server_sock, struct sockaddr_storage * client,
+    socklen_t * client_length, int nonblocking)
+{
+#ifdef SOCK_NONBLOCK
+  return accept4(server_sock, (struct sockaddr *) client, client_length,
+      SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+#else
+  int client_sock;
+  int sock_flags;
+
+  client_sock = accept(server_sock, (struct sockaddr *) client,
+      client_length);
+  if (client_sock < 0) {
+    return -1;
+  }
+  (void) fcntl(client_sock, F_SETFD, FD_CLOEXEC);
+  if (nonblocking && ((sock_flags = fcntl(client_sock, F_GETFL)) >= 0)) {
+    (void) fcntl(client_sock, F_SETFL, sock_flags | O_NONBLOCK);
+  }
+  return client_sock;
+#endif
+}
+
+/**
+ * Determines the client's IP address, waits for requests,
+ * and handles them until the connection is closed.
+ *
+ * @param client_sock the client socket
+ * @param client client socket information
+ * @param client_length length of client structure
+ * @param flag user-provided flags
+ */
+void
+handle_client(int client_sock, struct sockaddr_storage * client,
+    socklen_t client_length, struct flags * flag)
+{
+  char client_ip[INET6_ADDRSTRLEN];
+  int determined_client_addr;
+  struct connection conn;
+
+  determined_client_addr = client_address(client, client_ip,
+      sizeof(client_ip));
+  conn_init(&conn, client_sock, client_ip);
   /* child process handles client and exits when done */
-  if (httpd(client_sock, flag, client_ip) < 0) {
+  if (httpd(&conn, flag) < 0) {
     if (determined_client_addr) {
       warnx("httpd failed for client %s", client_ip);
     } else {
       warnx("httpd failed for client with unknown address");
     }
   }
-  (void) close(client_sock);
+  conn_close(&conn);
 }
 
 /**
@@ -133,8 +213,7 @@ accept_client(struct flags *flag, int server_sock)
   int client_sock;
 
   client_length = sizeof(client);
-  client_sock = accept(server_sock, (struct sockaddr *) &client,
-      &client_length);
+  client_sock = accept_socket(server_sock, &client, &client_length, 0);
   if (client_sock < 0) {
     perror("accept");
   } else {
@@ -186,6 +265,17 @@ setup_server_socket(struct flags * flag)
   if (server_sock < 0) {
     err(EXIT_FAILURE, "opening stream socket");
   }
+#ifdef SO_REUSEPORT
+  /* every prefork worker binds its own socket to the same port */
+  if (flag->workers > 0) {
+    int on = 1;
+
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &on,
+        sizeof(on)) < 0) {
+      err(EXIT_FAILURE, "cannot set SO_REUSEPORT");
+    }
+  }
+#endif
 
   /* server settings */
   /* set address */
@@ -225,10 +315,387 @@ setup_server_socket(struct flags * flag)
   return server_sock;
 }
 
+/**
+ * Determines the largest listen backlog the system grants.
+ *
+ * @return the backlog.
+ */
+static int
+max_backlog(void)
+{
+  int backlog = SOMAXCONN;
+#ifdef __linux__
+  FILE *fp;
+
+  /* SOMAXCONN is only the historic default of the tunable limit */
+  if ((fp = fopen(SOMAXCONN_PATH, "r")) != NULL) {
+    if ((fscanf(fp, "%d", &backlog) != 1) || (backlog <= 0)) {
+      backlog = SOMAXCONN;
+    }
+    (void) fclose(fp);
+  }
+#endif
+
+  return backlog;
+}
+
+/**
+ * Applies the user's listener options to the server socket and starts
+ * listening.
+ *
+ * @param flag user-provided flags
+ * @param server_sock the bound server socket
+ */
+static void
+start_listening(struct flags * flag, int server_sock)
+{
+  int backlog;
+
+  backlog = (flag->backlog > 0) ? flag->backlog : max_backlog();
+
+  /* TCP Fast Open lets clients send the request with the SYN */
+  if (flag->fastopen > 0) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(server_sock, IPPROTO_TCP, TCP_FASTOPEN, &flag->fastopen,
+        sizeof(flag->fastopen)) < 0) {
+      warn("cannot enable TCP_FASTOPEN");
+    }
+#else
+    warnx("TCP Fast Open is not supported on this platform");
+#endif
+  }
+
+  if (listen(server_sock, backlog) < 0) {
+    err(EXIT_FAILURE, "listen");
+  }
+
+  /* only wake up for connections that have sent data */
+  if (flag->defer_accept > 0) {
+#if defined(TCP_DEFER_ACCEPT)
+    if (setsockopt(server_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+        &flag->defer_accept, sizeof(flag->defer_accept)) < 0) {
+      warn("cannot enable TCP_DEFER_ACCEPT");
+    }
+#elif defined(SO_ACCEPTFILTER)
+    struct accept_filter_arg afa;
+
+    bzero(&afa, sizeof(afa));
+    (void) strlcpy(afa.af_name, "dataready", sizeof(afa.af_name));
+    if (setsockopt(server_sock, SOL_SOCKET, SO_ACCEPTFILTER, &afa,
+        sizeof(afa)) < 0) {
+      warn("cannot enable the dataready accept filter");
+    }
+#else
+    warnx("deferred accept is not supported on this platform");
+#endif
+  }
+
+  if (flag->dflag) {
+    (void) printf("listening with backlog %d\n", backlog);
+    /* children must not inherit buffered output */
+    (void) fflush(stdout);
+  }
+}
+
+/**
+ * Attaches the signal handlers of processes that serve clients.
+ *
+ * @param flag user-provided flags
+ */
+static void
+set_signal_handlers(struct flags * flag)
+{
+  /*
+   * Each thread of the pool waits for its own CGI. A handler reaping any
+   * child could take it first, so SIGCHLD keeps its default there.
+   */
+  if (flag->engine != ENGINE_THREADS) {
+    if (signal(SIGCHLD, server_sig_handler) == SIG_ERR) {
+      err(EXIT_FAILURE, "cannot catch SIGCHLD");
+    }
+  }
+  if (signal(SIGHUP, server_sig_handler) == SIG_ERR) {
+    err(EXIT_FAILURE, "cannot catch SIGCHUP");
+  }
+  /* sendfile(2) has no MSG_NOSIGNAL, a closed client must not kill us */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    err(EXIT_FAILURE, "cannot ignore SIGPIPE");
+  }
+}
+
+/**
+ * Accepts clients and serves one at a time in this process.
+ *
+ * @param flag user-provided flags
+ * @param server_sock the server socket file descriptor
+ */
+static void
+serve_clients(struct flags *flag, int server_sock)
+{
+  struct sockaddr_storage client;
+  socklen_t client_length;
+  int client_sock;
+
+  for (;;) {
+    client_length = sizeof(client);
+    client_sock = accept_socket(server_sock, &client, &client_length, 0);
+    if (client_sock < 0) {
+      if (errno != EINTR) {
+        perror("accept");
+      }
+    } else {
+      handle_client(client_sock, &client, client_length, flag);
+    }
+  }
+}
+
+/**
+ * Serves clients in a prefork worker: with the event loop, io_uring,
+ * coroutines, the thread pool or, for the fork engine, one client after
+ * another. Does not
+ * return.
+ *
+ * @param flag user-provided flags
+ * @param server_sock the worker's server socket
+ */
+static void
+run_worker(struct flags *flag, int server_sock)
+{
+#ifdef HAVE_EPOLL
+  if (flag->engine == ENGINE_EVENT) {
+    run_event_loop(flag, server_sock);
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if (flag->engine == ENGINE_URING) {
+    run_uring_loop(flag, server_sock);
+  }
+#endif
+#ifdef HAVE_CORO
+  if (flag->engine == ENGINE_CORO) {
+    run_coro_loop(flag, server_sock);
+  }
+#endif
+  if (flag->engine == ENGINE_THREADS) {
+    run_thread_pool(flag, server_sock);
+  }
+  serve_clients(flag, server_sock);
+}
+
+/**
+ * Forks worker number i.
+ *
+ * @param flag user-provided flags
+ * @param socks the server sockets of all workers
+ * @param i the number of the worker to start
+ * @return the pid of the worker or -1, if it could not be forked.
+ */
+static pid_t
+spawn_worker(struct flags *flag, int *socks, int i)
+{
+  pid_t supervisor = getpid();
+  pid_t pid;
+  int j;
+
+  switch (pid = fork()) {
+  case -1:
+    warn("cannot fork worker %d", i);
+    break;
+  case 0:
+    /* the handlers of the supervisor would signal the other workers */
+    (void) signal(SIGTERM, SIG_DFL);
+    (void) signal(SIGINT, SIG_DFL);
+#ifdef __linux__
+    /* a supervisor that is killed outright takes its workers along */
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0) {
+      warn("prctl");
+    }
+#endif
+    if (getppid() != supervisor) {
+      /* the supervisor died before it could be watched */
+      exit(EXIT_SUCCESS);
+    }
+    /* keep only the own socket */
+    for (j = 0; j < flag->workers; j++) {
+      if (socks[j] != socks[i]) {
+        (void) close(socks[j]);
+      }
+    }
+    set_signal_handlers(flag);
+#ifdef HAVE_AFFINITY
+    /* pin before the worker allocates its buffers */
+    affinity_pin(flag, i, "worker");
+#endif
+    run_worker(flag, socks[i]);
+    exit(EXIT_SUCCESS);
+    /* NOTREACHED */
+    break;
+  default:
+    break;
+  }
+
+  return pid;
+}
+
+/**
+ * Signal handler of the prefork supervisor: passes SIGTERM and SIGINT on
+ * to the workers, which are then reaped by run_prefork().
+ *
+ * @param signo the signal number of the signal to handle.
+ */
+static void
+prefork_sig_handler(int signo)
+{
+  int saved_errno = errno;
+  int i;
+
+  stop_signal = signo;
+  for (i = 0; i < worker_count; i++) {
+    if (worker_pids[i] > 0) {
+      (void) kill(worker_pids[i], signo);
+    }
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Waits for all workers after a stop signal was passed on to them, then
+ * exits. Workers that were forked while the signal arrived are signalled
+ * again.
+ */
+static void
+stop_workers(void)
+{
+  int status;
+  int i;
+
+  for (i = 0; i < worker_count; i++) {
+    if (worker_pids[i] <= 0) {
+      continue;
+    }
+    (void) kill(worker_pids[i], stop_signal);
+    while ((waitpid(worker_pids[i], &status, 0) < 0) && (errno == EINTR)) {
+      continue;
+    }
+    worker_pids[i] = 0;
+  }
+  exit(EXIT_SUCCESS);
+}
+
+/**
+ * Starts flag->workers long-lived worker processes and restarts workers
+ * that die. SIGTERM and SIGINT are passed on to the workers, and the
+ * supervisor exits once they are gone. Each worker gets its own SO_REUSEPORT server socket, so the
+ * kernel spreads connections over the workers. The sockets stay open in the
+ * supervisor, so connections queued for a dying worker go to its successor.
+ * Does not return.
+ *
+ * @param flag user-provided flags.
+ */
+static void
+run_prefork(struct flags* flag)
+{
+  int *socks;
+  pid_t *pids;
+  time_t *started;
+  pid_t pid;
+  int status;
+  int i;
+
+  if (((socks = calloc(flag->workers, sizeof(*socks))) == NULL)
+      || ((pids = calloc(flag->workers, sizeof(*pids))) == NULL)
+      || ((started = calloc(flag->workers, sizeof(*started))) == NULL)) {
+    err(EXIT_FAILURE, "cannot allocate worker table");
+  }
+
+  /* bind all sockets before daemonizing, so that errors are reported */
+  for (i = 0; i < flag->workers; i++) {
+#ifdef SO_REUSEPORT
+    socks[i] = setup_server_socket(flag);
+    start_listening(flag, socks[i]);
+#else
+    /* workers share one socket */
+    if (i == 0) {
+      socks[i] = setup_server_socket(flag);
+      start_listening(flag, socks[i]);
+    } else {
+      socks[i] = socks[0];
+    }
+#endif
+  }
+#if defined(HAVE_AFFINITY) && defined(SO_REUSEPORT)
+  affinity_steer(flag, socks, flag->workers);
+#endif
+
+  /* the supervisor reaps workers itself */
+  if (signal(SIGCHLD, SIG_DFL) == SIG_ERR) {
+    err(EXIT_FAILURE, "cannot reset SIGCHLD");
+  }
+  worker_pids = pids;
+  worker_count = flag->workers;
+  if ((signal(SIGTERM, prefork_sig_handler) == SIG_ERR)
+      || (signal(SIGINT, prefork_sig_handler) == SIG_ERR)) {
+    err(EXIT_FAILURE, "cannot catch SIGTERM");
+  }
+
+  /* daemonize if not in debug mode */
+  if (!flag->dflag) {
+    if (daemon(1, 1) < 0) {
+      errx(EXIT_FAILURE, "cannot transit into daemon mode");
+    }
+  }
+
+  for (i = 0; i < flag->workers; i++) {
+    started[i] = time(NULL);
+    if ((pids[i] = spawn_worker(flag, socks, i)) < 0) {
+      errx(EXIT_FAILURE, "cannot start workers");
+    }
+  }
+
+  for (;;) {
+    if (stop_signal) {
+      stop_workers();
+    }
+    if ((pid = waitpid(-1, &status, 0)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err(EXIT_FAILURE, "waitpid");
+    }
+    for (i = 0; i < flag->workers; i++) {
+      if (pids[i] != pid) {
+        continue;
+      } else if (stop_signal) {
+        /* the worker went down with the supervisor */
+        pids[i] = 0;
+        break;
+      }
+      if (WIFSIGNALED(status)) {
+        warnx("worker %d (pid %ld) killed by signal %d, restarting", i,
+            (long) pid, WTERMSIG(status));
+      } else {
+        warnx("worker %d (pid %ld) exited with status %d, restarting", i,
+            (long) pid, WEXITSTATUS(status));
+      }
+      /* do not spin if workers die right after start */
+      if (time(NULL) - started[i] < RESPAWN_DELAY_SEC) {
+        (void) sleep(RESPAWN_DELAY_SEC);
+      }
+      started[i] = time(NULL);
+      while ((pids[i] = spawn_worker(flag, socks, i)) < 0) {
+        (void) sleep(RESPAWN_DELAY_SEC);
+      }
+      break;
+    }
+  }
+}
+
 /**
  * Starts the server and transits into daemon mode, if not in debug mode.
  * Loops forever, accepting stream (TCP)  connections.
- * Child is forked when a client connects.
+ * Connections are served by the event loop or, with the fork engine,
+ * a child is forked when a client connects. With prefork workers, the
+ * workers serve the connections.
  *
  * @param flag user-provided flags.
  */
@@ -237,19 +704,18 @@ run_server(struct flags* flag)
 {
   int server_sock;
 
+  if (flag->workers > 0) {
+    run_prefork(flag);
+  }
+
   /* start listening for clients */
   server_sock = setup_server_socket(flag);
 
   /* attach signal handlers */
-  if (signal(SIGCHLD, server_sig_handler) == SIG_ERR) {
-    err(EXIT_FAILURE, "cannot catch SIGCHLD");
-  }
-  if (signal(SIGHUP, server_sig_handler) == SIG_ERR) {
-    err(EXIT_FAILURE, "cannot catch SIGCHUP");
-  }
+  set_signal_handlers(flag);
 
   /* Start accepting connections */
-  listen(server_sock, BACKLOG);
+  start_listening(flag, server_sock);
 
   /* daemonize if not in debug mode */
   if (!flag->dflag) {
@@ -259,6 +725,30 @@ run_server(struct flags* flag)
   }
 
   /* Handle clients */
+#ifdef HAVE_AFFINITY
+  /* thread pool workers are pinned one by one */
+  if (flag->engine != ENGINE_THREADS) {
+    affinity_pin(flag, 0, "server");
+  }
+#endif
+#ifdef HAVE_EPOLL
+  if (flag->engine == ENGINE_EVENT) {
+    run_event_loop(flag, server_sock);
+  }
+#endif
+#ifdef HAVE_IO_URING
+  if (flag->engine == ENGINE_URING) {
+    run_uring_loop(flag, server_sock);
+  }
+#endif
+#ifdef HAVE_CORO
+  if (flag->engine == ENGINE_CORO) {
+    run_coro_loop(flag, server_sock);
+  }
+#endif
+  if (flag->engine == ENGINE_THREADS) {
+    run_thread_pool(flag, server_sock);
+  }
   do {
     accept_client(flag, server_sock);
   } while (1);
@@ -7,13 +7,32 @@
 #ifndef _SWS_NET_H_
 #define _SWS_NET_H_
 
+#include <sys/socket.h>
+
+#include "conn.h"
 #include "util.h"
 
 #define DEFAULT_PORT 8080
+#define CLIENT_TIMEOUT_SEC 20
+#define KEEPALIVE_TIMEOUT_SEC 5 /* idle time allowed between requests */
+#define MAX_KEEPALIVE_REQUESTS 100 /* requests per connection */
+#define MAX_WORKERS 1024
+#define MAX_THREADS 1024
+#define DEFAULT_ACCEPT_BATCH 64 /* connections accepted per wakeup */
+#define MAX_ACCEPT_BATCH 1024
+#define MAX_BACKLOG 65535
+#define MAX_DEFER_ACCEPT_SEC 3600
+#define MAX_FASTOPEN_QUEUE 65535
 
 void
 run_server(struct flags*);
+int
+wait_for_data(struct connection *, int);
+int
+client_address(struct sockaddr_storage *, char *, size_t);
+int
+accept_socket(int, struct sockaddr_storage *, socklen_t *, int);
 void
-wait_for_data(int);
+handle_client(int, struct sockaddr_storage *, socklen_t, struct flags *);
 
 #endif /* !_SWS_NET_H_ */
@@ -0,0 +1,409 @@
+/*
+ * parser.c
+ *
+ * Incremental HTTP request parser. A state machine walks the request once,
+ * as its bytes arrive, and records the request line tokens and the header
+ * fields as views into the connection buffer. A request may be split across
+ * reads at any byte. Leading empty lines are skipped, lines may end with
+ * CRLF or a bare LF, and header lines without a colon are ignored.
+ * Within tokens, names and values, the next delimiter is found with
+ * scan_find(), which looks at 16 or 32 bytes per step. Header names are
+ * looked up in a perfect hash table when they end.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <limits.h>
+#include <string.h>
+
+#ifdef sun
+#include <strings.h>
+#endif
+
+#include "parser.h"
+#include "scan.h"
+
+#define PARSE_SKIP       0 /* empty lines before the request line */
+#define PARSE_SPACE      1 /* spaces between request line tokens */
+#define PARSE_TOKEN      2 /* a request line token */
+#define PARSE_LINE_LF    3 /* after the CR ending a line */
+#define PARSE_LINE_START 4 /* start of a header line or the empty line */
+#define PARSE_NAME       5 /* header field name */
+#define PARSE_VALUE_WS   6 /* white space before a header field value */
+#define PARSE_VALUE      7 /* header field value */
+#define PARSE_END_LF     8 /* after the CR of the empty line */
+#define PARSE_DONE       9 /* request complete */
+
+/*
+ * Slot of a header name in header_names: its length plus its first and last
+ * character in lower case. The names below hash to distinct slots, so a
+ * lookup is one hash and one comparison. A new name must take a free slot
+ * (the Makefiles turn overridden initializers into errors); otherwise the
+ * hash needs other weights or more slots. http_header_check() verifies the
+ * characters given with each name at startup.
+ */
+#define HEADER_SLOTS 32
+#define HEADER_HASH(first, last, len) \
+  (((len) + (first) + (last)) & (HEADER_SLOTS - 1))
+#define HEADER_NAME(name, first, last, id) \
+  [HEADER_HASH(first, last, sizeof(name) - 1)] = \
+  { name, sizeof(name) - 1, id }
+
+/**
+ * A header name the server acts on.
+ */
+struct header_name
+{
+  const char *name; /* NULL for an empty slot */
+  size_t len;
+  int id; /* HEADER_? */
+};
+
+static const struct header_name header_names[HEADER_SLOTS] = {
+  HEADER_NAME("Host", 'h', 't', HEADER_HOST),
+  HEADER_NAME("Connection", 'c', 'n', HEADER_CONNECTION),
+  HEADER_NAME("Content-Length", 'c', 'h', HEADER_CONTENT_LENGTH),
+  HEADER_NAME("Content-Type", 'c', 'e', HEADER_CONTENT_TYPE),
+  HEADER_NAME("If-Modified-Since", 'i', 'e', HEADER_IF_MODIFIED_SINCE),
+  HEADER_NAME("If-None-Match", 'i', 'h', HEADER_IF_NONE_MATCH),
+  HEADER_NAME("Range", 'r', 'e', HEADER_RANGE),
+  HEADER_NAME("Accept-Encoding", 'a', 'g', HEADER_ACCEPT_ENCODING),
+  HEADER_NAME("Transfer-Encoding", 't', 'g', HEADER_TRANSFER_ENCODING),
+  HEADER_NAME("If-Range", 'i', 'e', HEADER_IF_RANGE)
+};
+
+static void
+parse_end_line(struct http_parser *, size_t, char);
+static void
+parse_add_header(struct http_parser *, const char *, size_t);
+
+/**
+ * Prepares parsing a request that starts at offset base of the buffer.
+ *
+ * @param parser the parser.
+ * @param base the offset of the request in the buffer.
+ */
+void
+http_parser_init(struct http_parser * parser, size_t base)
+{
+  bzero(parser, sizeof(*parser));
+  parser->state = PARSE_SKIP;
+  parser->base = base;
+}
+
+/**
+ * Tells the parser that its request moved to another offset of the buffer,
+ * e.g. because the requests before it were dropped. Parsed views stay valid.
+ *
+ * @param parser the parser.
+ * @param base the new offset of the request in the buffer.
+ */
+void
+http_parser_rebase(struct http_parser * parser, size_t base)
+{
+  parser->base = base;
+}
+
+/**
+ * Ends the current line of the request.
+ *
+ * @param parser the parser.
+ * @param i the offset of the line end character.
+ * @param c the line end character, CR or LF.
+ */
+static void
+parse_end_line(struct http_parser * parser, size_t i, char c)
+{
+  if (parser->state < PARSE_LINE_LF) {
+    /* the request line */
+    parser->line.len = i - parser->line.off;
+  }
+  parser->state = (c == '\r') ? PARSE_LINE_LF : PARSE_LINE_START;
+}
+
+/**
+ * Records the header field whose value starts at mark, without trailing
+ * white space.
+ *
+ * @param parser the parser, whose headers[header_count].name is set.
+ * @param req the start of the request.
+ * @param i the offset of the line end.
+ */
+static void
+parse_add_header(struct http_parser * parser, const char * req, size_t i)
+{
+  struct http_header *header;
+
+  if (parser->header_count == PARSE_MAX_HEADERS) {
+    parser->bad = 1;
+    return;
+  }
+  header = &parser->headers[parser->header_count++];
+  while ((i > parser->mark) && ((req[i - 1] == ' ') || (req[i - 1] == '\t'))) {
+    i--;
+  }
+  header->value.off = parser->mark;
+  header->value.len = i - parser->mark;
+}
+
+/**
+ * Parses the bytes of the request received since the last call.
+ *
+ * @param parser the parser.
+ * @param buf the connection buffer.
+ * @param len the number of bytes in buf.
+ * @return 1, if the request is complete. 0, if more bytes are needed.
+ */
+int
+http_parse(struct http_parser * parser, const char * buf, size_t len)
+{
+  const char *req = buf + parser->base;
+  size_t n;
+  size_t i;
+  char c;
+
+  if (parser->state == PARSE_DONE) {
+    return 1;
+  } else if (len <= parser->base) {
+    return 0;
+  }
+
+  n = len - parser->base;
+  for (i = parser->pos; i < n; i++) {
+    c = req[i];
+    switch (parser->state) {
+    case PARSE_SKIP:
+      if ((c == '\r') || (c == '\n')) {
+        break;
+      }
+      parser->line.off = i;
+      parser->state = PARSE_SPACE;
+      /* FALLTHROUGH */
+    case PARSE_SPACE:
+      if (c == ' ') {
+        break;
+      } else if ((c == '\r') || (c == '\n')) {
+        parse_end_line(parser, i, c);
+        break;
+      }
+      parser->mark = i;
+      parser->state = PARSE_TOKEN;
+      break;
+    case PARSE_TOKEN:
+      if ((i += scan_find(req + i, n - i, ' ', '\r', '\n')) == n) {
+        break;
+      }
+      c = req[i];
+      if (parser->token_count == PARSE_MAX_TOKENS) {
+        parser->bad = 1;
+      } else {
+        parser->tokens[parser->token_count].off = parser->mark;
+        parser->tokens[parser->token_count].len = i - parser->mark;
+        parser->token_count++;
+      }
+      if (c == ' ') {
+        parser->state = PARSE_SPACE;
+      } else {
+        parse_end_line(parser, i, c);
+      }
+      break;
+    case PARSE_LINE_LF:
+      parser->state = PARSE_LINE_START;
+      if (c == '\n') {
+        break;
+      }
+      /* a CR without LF */
+      parser->bad = 1;
+      /* FALLTHROUGH */
+    case PARSE_LINE_START:
+      if (c == '\r') {
+        parser->state = PARSE_END_LF;
+        break;
+      } else if (c == '\n') {
+        parser->end = i + 1;
+        parser->pos = parser->end;
+        parser->state = PARSE_DONE;
+        return 1;
+      }
+      parser->mark = i;
+      parser->state = PARSE_NAME;
+      /* FALLTHROUGH */
+    case PARSE_NAME:
+      if ((i += scan_find(req + i, n - i, ':', '\r', '\n')) == n) {
+        break;
+      }
+      c = req[i];
+      if (c == ':') {
+        if (parser->header_count < PARSE_MAX_HEADERS) {
+          struct http_header *header = &parser->headers[parser->header_count];
+
+          header->name.off = parser->mark;
+          header->name.len = i - parser->mark;
+          header->id = http_header_id(req, header->name);
+        }
+        parser->state = PARSE_VALUE_WS;
+      } else if ((c == '\r') || (c == '\n')) {
+        /* not a header field */
+        parse_end_line(parser, i, c);
+      }
+      break;
+    case PARSE_VALUE_WS:
+      if ((c == ' ') || (c == '\t')) {
+        break;
+      }
+      parser->mark = i;
+      parser->state = PARSE_VALUE;
+      /* FALLTHROUGH */
+    case PARSE_VALUE:
+      if ((i += scan_find(req + i, n - i, '\r', '\n', '\n')) == n) {
+        break;
+      }
+      c = req[i];
+      parse_add_header(parser, req, i);
+      parse_end_line(parser, i, c);
+      break;
+    case PARSE_END_LF:
+      if (c == '\n') {
+        parser->end = i + 1;
+        parser->pos = parser->end;
+        parser->state = PARSE_DONE;
+        return 1;
+      }
+      /* a CR without LF, the byte starts a line */
+      parser->bad = 1;
+      parser->state = PARSE_LINE_START;
+      i--;
+      break;
+    default:
+      break;
+    }
+  }
+  parser->pos = n;
+
+  return 0;
+}
+
+/**
+ * Identifies a header field name, ignoring case.
+ *
+ * @param req the start of the request.
+ * @param name the view of the name.
+ * @return HEADER_? of the name, HEADER_OTHER if the server ignores it.
+ */
+int
+http_header_id(const char * req, struct http_view name)
+{
+  const struct header_name *entry;
+  const char *str = req + name.off;
+
+  if (name.len == 0) {
+    return HEADER_OTHER;
+  }
+  /* setting bit 5 lowers letters and keeps '-' and digits */
+  entry = &header_names[HEADER_HASH(str[0] | 0x20, str[name.len - 1] | 0x20,
+      name.len)];
+  if ((entry->name == NULL) || (entry->len != name.len)
+      || (strncasecmp(str, entry->name, name.len) != 0)) {
+    return HEADER_OTHER;
+  }
+
+  return entry->id;
+}
+
+/**
+ * Checks that every name of the header table is found by http_header_id()
+ * and identified as itself.
+ *
+ * @return 0, if the table is consistent. Otherwise, -1.
+ */
+int
+http_header_check(void)
+{
+  struct http_view name;
+  int retval = 0;
+  int i;
+
+  for (i = 0; i < HEADER_SLOTS; i++) {
+    if (header_names[i].name == NULL) {
+      continue;
+    }
+    name.off = 0;
+    name.len = header_names[i].len;
+    if (http_header_id(header_names[i].name, name) != header_names[i].id) {
+      warnx("header %s is not in its hash slot", header_names[i].name);
+      retval = -1;
+    }
+  }
+
+  return retval;
+}
+
+/**
+ * Compares a view with a string, ignoring case.
+ *
+ * @param req the start of the request.
+ * @param view the view to compare.
+ * @param str the string.
+ * @return 1, if they are equal. Otherwise, 0.
+ */
+int
+http_view_equals(const char * req, struct http_view view, const char * str)
+{
+  return (strlen(str) == view.len)
+      && (strncasecmp(req + view.off, str, view.len) == 0);
+}
+
+/**
+ * Copies a view into a null-terminated string, truncated to fit.
+ *
+ * @param req the start of the request.
+ * @param view the view to copy.
+ * @param dst the destination.
+ * @param dst_size the size of dst.
+ * @return the length of the view. If it is dst_size or more, dst holds a
+ * truncated copy.
+ */
+size_t
+http_view_copy(const char * req, struct http_view view, char * dst,
+    size_t dst_size)
+{
+  size_t len = (view.len < dst_size) ? view.len : dst_size - 1;
+
+  memcpy(dst, req + view.off, len);
+  dst[len] = '\0';
+
+  return view.len;
+}
+
+/**
+ * Converts a view of decimal digits into a number.
+ *
+ * @param req the start of the request.
+ * @param view the view to convert.
+ * @return the number, or -1 if the view is empty, holds other characters
+ * than digits or exceeds INT_MAX.
+ */
+long
+http_view_number(const char * req, struct http_view view)
+{
+  long number = 0;
+  unsigned int i;
+
+  if (view.len == 0) {
+    return -1;
+  }
+  for (i = 0; i < view.len; i++) {
+    char c = req[view.off + i];
+
+    if ((c < '0') || (c > '9')) {
+      return -1;
+    }
+    number = number * 10 + (c - '0');
+    if (number > INT_MAX) {
+      return -1;
+    }
+  }
+
+  return number;
+}
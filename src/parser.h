@@ -0,0 +1,84 @@
+/*
+ * parser.h
+ *
+ * Incremental HTTP request parser.
+ */
+
+#ifndef _SWS_PARSER_H_
+#define _SWS_PARSER_H_
+
+#include <sys/types.h>
+
+#define PARSE_MAX_TOKENS 3 /* method, target and version */
+#define PARSE_MAX_HEADERS 48 /* more headers make the request bad */
+
+/* header fields the server acts on, see http_header_id() */
+#define HEADER_OTHER             0
+#define HEADER_HOST              1
+#define HEADER_CONNECTION        2
+#define HEADER_CONTENT_LENGTH    3
+#define HEADER_CONTENT_TYPE      4
+#define HEADER_IF_MODIFIED_SINCE 5
+#define HEADER_IF_NONE_MATCH     6
+#define HEADER_RANGE             7
+#define HEADER_ACCEPT_ENCODING   8
+#define HEADER_TRANSFER_ENCODING 9
+#define HEADER_IF_RANGE          10
+
+/**
+ * A part of the request: offset and length relative to the start of the
+ * request in the connection buffer. Nothing is copied.
+ */
+struct http_view
+{
+  unsigned int off;
+  unsigned int len;
+};
+
+/**
+ * A header field. Leading and trailing white space of the value is excluded.
+ */
+struct http_header
+{
+  int id; /* HEADER_? of the name */
+  struct http_view name;
+  struct http_view value;
+};
+
+/**
+ * State of parsing one request. http_parse() consumes bytes as they arrive
+ * and resumes where it stopped, so every byte is looked at once.
+ */
+struct http_parser
+{
+  int state; /* PARSE_? in parser.c */
+  int bad; /* 1, if the request is malformed */
+  size_t base; /* offset of the request in the buffer */
+  size_t pos; /* offset of the next byte to parse, relative to base */
+  size_t mark; /* start of the field being parsed, relative to base */
+  size_t end; /* length of the complete request, or 0 */
+  struct http_view line; /* request line */
+  struct http_view tokens[PARSE_MAX_TOKENS]; /* request line tokens */
+  int token_count;
+  struct http_header headers[PARSE_MAX_HEADERS];
+  int header_count;
+};
+
+void
+http_parser_init(struct http_parser *, size_t);
+void
+http_parser_rebase(struct http_parser *, size_t);
+int
+http_parse(struct http_parser *, const char *, size_t);
+int
+http_header_id(const char *, struct http_view);
+int
+http_header_check(void);
+int
+http_view_equals(const char *, struct http_view, const char *);
+size_t
+http_view_copy(const char *, struct http_view, char *, size_t);
+long
+http_view_number(const char *, struct http_view);
+
+#endif /* !_SWS_PARSER_H_ */
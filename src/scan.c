@@ -0,0 +1,220 @@
+/*
+ * scan.c
+ *
+ * Search for the first of up to three delimiter bytes, e.g. SP, CR and LF
+ * of a request line token. On x86, the search compares 32 bytes per step
+ * with AVX2 or 16 bytes with the SSE4.2 string instructions, whichever the
+ * CPU supports; the choice is made at the first call. Other CPUs and the
+ * tail of a buffer are scanned byte by byte. Loads never go past the end of
+ * the buffer.
+ */
+
+#include <sys/types.h>
+
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*scan_func)(const char *, size_t, char, char, char);
+
+static size_t
+scan_scalar(const char *, size_t, char, char, char);
+static size_t
+scan_resolve(const char *, size_t, char, char, char);
+#ifdef HAVE_SCAN_X86
+static size_t
+scan_sse42(const char *, size_t, char, char, char);
+static size_t
+scan_avx2(const char *, size_t, char, char, char);
+#endif
+
+/* replaced by the best implementation at the first call */
+static scan_func scan_impl = scan_resolve;
+static int scan_kind = SCAN_SCALAR;
+
+/**
+ * Searches byte by byte.
+ */
+static size_t
+scan_scalar(const char * buf, size_t len, char a, char b, char c)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if ((buf[i] == a) || (buf[i] == b) || (buf[i] == c)) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+#ifdef HAVE_SCAN_X86
+
+/**
+ * Searches 16 bytes at a time for any byte of the set {a, b, c}.
+ */
+__attribute__((target("sse4.2")))
+static size_t
+scan_sse42(const char * buf, size_t len, char a, char b, char c)
+{
+  __m128i set = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0);
+  size_t i;
+  int index;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i data = _mm_loadu_si128((const __m128i *) (buf + i));
+
+    index = _mm_cmpestri(set, 3, data, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+    if (index < 16) {
+      return i + index;
+    }
+  }
+
+  return i + scan_scalar(buf + i, len - i, a, b, c);
+}
+
+/**
+ * Searches 32 bytes at a time, comparing with each delimiter, then 16.
+ */
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const char * buf, size_t len, char a, char b, char c)
+{
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i vc = _mm256_set1_epi8(c);
+  unsigned int mask;
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i data = _mm256_loadu_si256((const __m256i *) (buf + i));
+    __m256i match = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(data, va),
+            _mm256_cmpeq_epi8(data, vb)), _mm256_cmpeq_epi8(data, vc));
+
+    if ((mask = _mm256_movemask_epi8(match)) != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  if (i + 16 <= len) {
+    __m128i data = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i match = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(data, _mm256_castsi256_si128(va)),
+            _mm_cmpeq_epi8(data, _mm256_castsi256_si128(vb))),
+        _mm_cmpeq_epi8(data, _mm256_castsi256_si128(vc)));
+
+    if ((mask = _mm_movemask_epi8(match)) != 0) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+
+  return i + scan_scalar(buf + i, len - i, a, b, c);
+}
+
+#endif /* HAVE_SCAN_X86 */
+
+/**
+ * Picks the fastest implementation the CPU supports, then searches with it.
+ */
+static size_t
+scan_resolve(const char * buf, size_t len, char a, char b, char c)
+{
+#ifdef HAVE_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    (void) scan_select(SCAN_AVX2);
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    (void) scan_select(SCAN_SSE42);
+  } else {
+    (void) scan_select(SCAN_SCALAR);
+  }
+#else
+  (void) scan_select(SCAN_SCALAR);
+#endif
+
+  return scan_impl(buf, len, a, b, c);
+}
+
+/**
+ * Finds the first byte of buf that equals a, b or c.
+ *
+ * @param buf the bytes to search.
+ * @param len the number of bytes in buf.
+ * @param a a delimiter.
+ * @param b another delimiter, may equal a.
+ * @param c another delimiter, may equal a or b.
+ * @return the offset of the first delimiter, or len if there is none.
+ */
+size_t
+scan_find(const char * buf, size_t len, char a, char b, char c)
+{
+  return scan_impl(buf, len, a, b, c);
+}
+
+/**
+ * Selects the implementation to use, e.g. for benchmarks.
+ *
+ * @param kind SCAN_SCALAR, SCAN_SSE42 or SCAN_AVX2.
+ * @return 0 on success. -1, if the CPU or compiler does not support it.
+ */
+int
+scan_select(int kind)
+{
+  switch (kind) {
+  case SCAN_SCALAR:
+    scan_impl = scan_scalar;
+    break;
+#ifdef HAVE_SCAN_X86
+  case SCAN_SSE42:
+    if (!__builtin_cpu_supports("sse4.2")) {
+      return -1;
+    }
+    scan_impl = scan_sse42;
+    break;
+  case SCAN_AVX2:
+    if (!__builtin_cpu_supports("avx2")) {
+      return -1;
+    }
+    scan_impl = scan_avx2;
+    break;
+#endif
+  default:
+    return -1;
+    /* NOTREACHED */
+    break;
+  }
+  scan_kind = kind;
+
+  return 0;
+}
+
+/**
+ * Names the implementation in use.
+ *
+ * @return "scalar", "sse4.2" or "avx2".
+ */
+const char *
+scan_name(void)
+{
+  switch (scan_kind) {
+  case SCAN_SSE42:
+    return "sse4.2";
+    /* NOTREACHED */
+    break;
+  case SCAN_AVX2:
+    return "avx2";
+    /* NOTREACHED */
+    break;
+  default:
+    return "scalar";
+    /* NOTREACHED */
+    break;
+  }
+}
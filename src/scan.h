@@ -0,0 +1,23 @@
+/*
+ * scan.h
+ *
+ * Vectorized search for delimiter bytes, used by the request parser.
+ */
+
+#ifndef _SWS_SCAN_H_
+#define _SWS_SCAN_H_
+
+#include <sys/types.h>
+
+#define SCAN_SCALAR 0 /* one byte at a time */
+#define SCAN_SSE42  1 /* 16 bytes per step with PCMPESTRI */
+#define SCAN_AVX2   2 /* 32 bytes per step with VPCMPEQB */
+
+size_t
+scan_find(const char *, size_t, char, char, char);
+int
+scan_select(int);
+const char *
+scan_name(void);
+
+#endif /* !_SWS_SCAN_H_ */
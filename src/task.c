@@ -0,0 +1,435 @@
+/*
+ * task.c
+ *
+ * Work-stealing pool for CPU-heavy request stages. A coroutine that runs
+ * such a stage submits it as a task and yields until a pool thread has run
+ * it, so that the other connections of the process keep being served. The
+ * epoll and io_uring loops submit a copy of the stage with task_submit()
+ * and park the connection; the pool tells them through the notifier
+ * eventfd of the process once a task is done.
+ *
+ * Every pool thread owns a deque. Tasks are submitted round-robin to the
+ * back of the deques. All tasks come from outside the pool, so a thread
+ * takes them in order from the front of its own deque, and steals from the
+ * front of the others once it runs out, so that a thread stuck on a long
+ * task does not hold up the tasks queued behind it.
+ *
+ * Without a pool, tasks run inline.
+ */
+
+#include "coro.h"
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CORO
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+#endif
+
+#include "task.h"
+#include "util.h"
+
+#ifdef HAVE_CORO
+
+#define DEQUE_INITIAL_SIZE 16 /* tasks a deque holds before growing */
+
+/**
+ * Deque of tasks, a ring buffer that grows when full.
+ */
+struct task_deque
+{
+  pthread_mutex_t lock;
+  struct task **tasks;
+  int size; /* capacity */
+  int head; /* index of the front task */
+  int count; /* number of queued tasks */
+};
+
+/**
+ * The pool threads and their deques.
+ */
+struct task_pool
+{
+  int threads; /* number of pool threads, 0 if not started */
+  struct task_deque *deques; /* one per thread */
+  unsigned int next; /* deque of the next submission */
+  pthread_mutex_t lock; /* protects pending and the done flags of tasks */
+  pthread_cond_t work; /* signalled when tasks are submitted */
+  int pending; /* tasks queued in all deques */
+  int notifier; /* eventfd of the submitters of task_submit(), or -1 */
+};
+
+static struct task_pool pool = { .notifier = -1 };
+
+static int
+deque_push(struct task_deque *, struct task *);
+static struct task *
+deque_pop(struct task_deque *);
+static int
+task_push(struct task *);
+static struct task *
+task_take(int);
+static void *
+task_thread_main(void *);
+
+/**
+ * Appends a task to the back of the deque.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+deque_push(struct task_deque * deque, struct task * task)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->size) {
+    int size = (deque->size == 0) ? DEQUE_INITIAL_SIZE : deque->size * 2;
+    struct task **tasks;
+    int i;
+
+    if ((tasks = malloc(size * sizeof(*tasks))) == NULL) {
+      pthread_mutex_unlock(&deque->lock);
+      warn("cannot grow task deque");
+      return -1;
+    }
+    for (i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->size = size;
+    deque->head = 0;
+  }
+  deque->tasks[(deque->head + deque->count) % deque->size] = task;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+
+  return 0;
+}
+
+/**
+ * Removes the oldest task from the front of the deque, for its owner and
+ * thieves alike.
+ *
+ * @param deque the deque.
+ * @return the task, or NULL if the deque is empty.
+ */
+static struct task *
+deque_pop(struct task_deque * deque)
+{
+  struct task *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->size;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return task;
+}
+
+/**
+ * Queues a task for the pool threads.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+task_push(struct task * task)
+{
+  if (deque_push(&pool.deques[pool.next++ % pool.threads], task) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.pending++;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  return 0;
+}
+
+/**
+ * Takes the next task for pool thread i: from its own deque or, if that is
+ * empty, stolen from another one. Sleeps while there are no tasks at all.
+ *
+ * @return the task.
+ */
+static struct task *
+task_take(int i)
+{
+  struct task *task;
+  int j;
+
+  for (;;) {
+    task = deque_pop(&pool.deques[i]);
+    for (j = 1; (task == NULL) && (j < pool.threads); j++) {
+      task = deque_pop(&pool.deques[(i + j) % pool.threads]);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (task != NULL) {
+      pool.pending--;
+      pthread_mutex_unlock(&pool.lock);
+      return task;
+    }
+    /* a task taken before its submitter counted it makes pending < 0 */
+    while (pool.pending <= 0) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+/**
+ * Pool thread: runs tasks and signals their completion.
+ *
+ * @param arg the number of the thread.
+ * @return never returns.
+ */
+static void *
+task_thread_main(void * arg)
+{
+  int i = (int) (intptr_t) arg;
+  struct task *task;
+  uint64_t one = 1;
+  int done_fd;
+  int orphan;
+
+  for (;;) {
+    task = task_take(i);
+    task->fn(task->arg);
+    /* the task may be gone once its submitter sees either */
+    done_fd = task->done_fd;
+    pthread_mutex_lock(&pool.lock);
+    orphan = (task->done < 0);
+    task->done = 1;
+    pthread_mutex_unlock(&pool.lock);
+    if (orphan) {
+      /* its submitter has gone meanwhile */
+      free(task);
+    } else if (write(done_fd, &one, sizeof(one)) < 0) {
+      warn("cannot signal task completion");
+    }
+  }
+
+  /* NOTREACHED */
+  return NULL;
+}
+
+#endif /* HAVE_CORO */
+
+/**
+ * Starts the task pool of this process.
+ *
+ * @param threads the number of pool threads.
+ * @return 0 on success. Otherwise, -1.
+ */
+int
+task_pool_start(int threads)
+{
+#ifdef HAVE_CORO
+  pthread_attr_t attr;
+  pthread_t thread;
+  int error;
+  int i;
+
+  bzero(&pool, sizeof(pool));
+  pool.notifier = -1;
+  if ((pool.deques = calloc(threads, sizeof(*pool.deques))) == NULL) {
+    warn("cannot allocate task deques");
+    return -1;
+  }
+  if ((pthread_mutex_init(&pool.lock, NULL) != 0)
+      || (pthread_cond_init(&pool.work, NULL) != 0)) {
+    warnx("cannot initialize task pool");
+    return -1;
+  }
+  for (i = 0; i < threads; i++) {
+    if (pthread_mutex_init(&pool.deques[i].lock, NULL) != 0) {
+      warnx("cannot initialize task deque");
+      return -1;
+    }
+  }
+
+  if ((error = pthread_attr_init(&attr)) != 0) {
+    warnx("pthread_attr_init: %s", strerror(error));
+    return -1;
+  }
+  (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  /* set before the threads look at it */
+  pool.threads = threads;
+  for (i = 0; i < threads; i++) {
+    if ((error = pthread_create(&thread, &attr, task_thread_main,
+        (void *) (intptr_t) i)) != 0) {
+      warnx("cannot create task thread: %s", strerror(error));
+      break;
+    }
+  }
+  (void) pthread_attr_destroy(&attr);
+  if (i == 0) {
+    pool.threads = 0;
+    return -1;
+  }
+  /* the deques of threads that failed to start are emptied by stealing */
+  if ((pool.notifier = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    warn("cannot create task notifier");
+  }
+
+  return 0;
+#else
+  warnx("the task pool needs coroutines");
+  return -1;
+#endif
+}
+
+/**
+ * Runs fn(arg). A coroutine hands it to the task pool and yields until it
+ * is done. Otherwise, it runs inline.
+ *
+ * @param fn the function to run.
+ * @param arg the argument of fn.
+ */
+void
+task_run(void (*fn)(void *), void * arg)
+{
+#ifdef HAVE_CORO
+  struct task task;
+  uint64_t count;
+
+  if ((pool.threads > 0) && coro_active()
+      && ((task.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0)) {
+    task.fn = fn;
+    task.arg = arg;
+    if (task_push(&task) == 0) {
+      /* the task must not outlive this frame, so wait without timeout */
+      if (coro_read(task.done_fd, &count, sizeof(count), -1) < 0) {
+        warn("cannot wait for task");
+        (void) coro_wait(task.done_fd, POLLIN, -1);
+      }
+      (void) close(task.done_fd);
+      return;
+    }
+    (void) close(task.done_fd);
+  }
+#endif
+
+  fn(arg);
+}
+
+/**
+ * Returns the notifier of the task pool, an eventfd that is written
+ * whenever a task of task_submit() is done.
+ *
+ * @return the eventfd, or -1 if there is no pool or no notifier.
+ */
+int
+task_notifier(void)
+{
+#ifdef HAVE_CORO
+  return (pool.threads > 0) ? pool.notifier : -1;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * Hands a copy of arg to the pool, which runs fn on it. The submitter goes
+ * on and later finds the task done with task_done(), after the notifier
+ * was written.
+ *
+ * @param fn the function to run.
+ * @param arg the argument of fn, copied.
+ * @param size the size of arg.
+ * @param key what the task works on, for the submitter; not copied.
+ * @return the task, whose copy of arg is task->arg, or NULL if it cannot be
+ * submitted, e.g. without a pool.
+ */
+struct task *
+task_submit(void (*fn)(void *), const void * arg, size_t size,
+    const char * key)
+{
+#ifdef HAVE_CORO
+  struct task *task;
+
+  if (task_notifier() < 0) {
+    return NULL;
+  }
+  if ((task = malloc(sizeof(*task) + size)) == NULL) {
+    warn("cannot allocate task");
+    return NULL;
+  }
+  task->fn = fn;
+  task->arg = task + 1;
+  memcpy(task->arg, arg, size);
+  task->done_fd = pool.notifier;
+  task->done = 0;
+  task->key = key;
+  if (task_push(task) < 0) {
+    free(task);
+    return NULL;
+  }
+
+  return task;
+#else
+  (void) fn;
+  (void) arg;
+  (void) size;
+  (void) key;
+  return NULL;
+#endif
+}
+
+/**
+ * Checks whether the pool has run a task of task_submit().
+ *
+ * @return 1, if it is done. Otherwise, 0.
+ */
+int
+task_done(struct task * task)
+{
+#ifdef HAVE_CORO
+  int done;
+
+  pthread_mutex_lock(&pool.lock);
+  done = task->done;
+  pthread_mutex_unlock(&pool.lock);
+
+  return done;
+#else
+  (void) task;
+  return 1;
+#endif
+}
+
+/**
+ * Releases a task of task_submit(). A task that is still running is
+ * released by its pool thread once it is done.
+ */
+void
+task_free(struct task * task)
+{
+#ifdef HAVE_CORO
+  int done;
+
+  pthread_mutex_lock(&pool.lock);
+  if (!(done = task->done)) {
+    task->done = -1;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  if (done) {
+    free(task);
+  }
+#else
+  free(task);
+#endif
+}
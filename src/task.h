@@ -0,0 +1,41 @@
+/*
+ * task.h
+ *
+ * Work-stealing pool for CPU-heavy request stages, such as MIME type
+ * detection and directory listings.
+ */
+
+#ifndef _SWS_TASK_H_
+#define _SWS_TASK_H_
+
+#include <sys/types.h>
+
+#include "util.h"
+
+/**
+ * A task for the pool. One of task_run() lives on the stack of the waiting
+ * coroutine, one of task_submit() is allocated together with its argument.
+ */
+struct task
+{
+  void (*fn)(void *);
+  void *arg;
+  int done_fd; /* eventfd written once fn returned */
+  int done; /* 1, once fn returned; -1, if released before */
+  const char *key; /* what the task works on, for the submitter */
+};
+
+int
+task_pool_start(int);
+void
+task_run(void (*)(void *), void *);
+int
+task_notifier(void);
+struct task *
+task_submit(void (*)(void *), const void *, size_t, const char *);
+int
+task_done(struct task *);
+void
+task_free(struct task *);
+
+#endif /* !_SWS_TASK_H_ */
@@ -0,0 +1,278 @@
+/*
+ * test_httpdate.c
+ *
+ * Checks http_date_to_time() and time_to_http_date() against the C library
+ * and compares their speed. Random times are formatted in all three
+ * HTTP-date forms with strftime(3) and must parse to the same time as with
+ * strptime(3) and timegm(3). Randomly damaged dates must either be rejected
+ * or parse like they do with the C library. Build with
+ * "make test_httpdate", which optimizes like a release build; exits with 1
+ * on the first mismatch.
+ *
+ * usage: test_httpdate [iterations]
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* strptime, timegm */
+#endif
+
+#include <sys/types.h>
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "httpdate.h"
+
+#define DATE_MAX 64
+
+#define MIN_TIME (-2208988800L) /* 1900-01-01 */
+#define MAX_TIME 253402300799L /* 9999-12-31 23:59:59 */
+#define MIN_TIME_850 (-31536000L) /* 1969-01-01, two digit years */
+#define MAX_TIME_850 3124137599L /* 2068-12-31 23:59:59 */
+
+static const char *formats[3] = {
+  "%a, %d %b %Y %H:%M:%S GMT", /* rfc1123-date */
+  "%A, %d-%b-%y %H:%M:%S GMT", /* rfc850-date */
+  "%a %b %e %H:%M:%S %Y" /* asctime-date */
+};
+
+static time_t
+random_time(long, long);
+static int
+libc_parse(const char *, time_t *);
+static int
+check_format(time_t);
+static int
+check_parse(time_t, int);
+static double
+elapsed_ns(const struct timespec *, const struct timespec *);
+static void
+bench(long);
+
+/**
+ * Picks a random time.
+ *
+ * @param min the earliest time.
+ * @param max the latest time.
+ * @return the time.
+ */
+static time_t
+random_time(long min, long max)
+{
+  unsigned long r = ((unsigned long) random() << 31) ^ random();
+
+  return min + (long) (r % (unsigned long) (max - min + 1));
+}
+
+/**
+ * Parses a date the way sws did before, with the C library, but in UTC.
+ *
+ * @param date the date.
+ * @param dst where to store the time.
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+libc_parse(const char * date, time_t * dst)
+{
+  const char *pos;
+  const char *end;
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if ((pos = strchr(date, ',')) == NULL) {
+    end = strptime(date, formats[2], &tm);
+  } else if (pos - date == 3) {
+    end = strptime(date, formats[0], &tm);
+  } else {
+    end = strptime(date, formats[1], &tm);
+  }
+  if ((end == NULL) || (*end != '\0')) {
+    return -1;
+  }
+  *dst = timegm(&tm);
+
+  return 0;
+}
+
+/**
+ * Compares the formatting of a time with strftime(3).
+ *
+ * @param t the time.
+ * @return 0, if both agree. Otherwise, -1.
+ */
+static int
+check_format(time_t t)
+{
+  char expected[DATE_MAX];
+  char actual[DATE_MAX];
+  struct tm tm;
+
+  if ((gmtime_r(&t, &tm) == NULL)
+      || (strftime(expected, sizeof(expected), formats[0], &tm) == 0)) {
+    return 0;
+  }
+  if ((time_to_http_date(&t, actual, sizeof(actual)) != 0)
+      || (strcmp(expected, actual) != 0)) {
+    (void) fprintf(stderr, "format %ld: expected \"%s\", got \"%s\"\n",
+        (long) t, expected, actual);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Formats a time in one form, then parses the date and damaged copies of
+ * it both ways.
+ *
+ * @param t the time.
+ * @param form the index into formats.
+ * @return 0, if both agree. Otherwise, -1.
+ */
+static int
+check_parse(time_t t, int form)
+{
+  static const char noise[] = "0123456789 ,:-GMTJanFebSunday\t";
+  char date[DATE_MAX];
+  time_t expected;
+  time_t actual;
+  struct tm tm;
+  size_t len;
+  int i;
+
+  (void) gmtime_r(&t, &tm);
+  len = strftime(date, sizeof(date), formats[form], &tm);
+
+  if ((http_date_to_time(date, &actual) != 0) || (actual != t)) {
+    (void) fprintf(stderr, "parse \"%s\": expected %ld, got %ld\n", date,
+        (long) t, (long) actual);
+    return -1;
+  }
+
+  for (i = 0; i < 4; i++) {
+    date[random() % len] = noise[random() % (sizeof(noise) - 1)];
+    /* a stricter parser may reject what the C library accepts */
+    if (http_date_to_time(date, &actual) != 0) {
+      continue;
+    }
+    if ((libc_parse(date, &expected) != 0) || (actual != expected)) {
+      (void) fprintf(stderr, "parse \"%s\": C library disagrees\n", date);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Computes the time between two clock readings.
+ *
+ * @param start the first reading.
+ * @param end the second reading.
+ * @return the elapsed nanoseconds.
+ */
+static double
+elapsed_ns(const struct timespec * start, const struct timespec * end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9
+      + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Times parsing and formatting against the code sws used before:
+ * strptime(3) and mktime(3), and gmtime_r(3) and strftime(3). A
+ * conditional GET parses one date and formats another, so the combined
+ * figure is what counts.
+ *
+ * @param iterations the number of repetitions.
+ */
+static void
+bench(long iterations)
+{
+  const char *date = "Sun, 06 Nov 1994 08:49:37 GMT";
+  char buf[DATE_MAX];
+  struct timespec start;
+  struct timespec end;
+  struct tm tm;
+  time_t t = 784111777;
+  double libc_ns;
+  double ns;
+  double total_libc_ns;
+  double total_ns;
+  long i;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    memset(&tm, 0, sizeof(tm));
+    (void) strptime(date, formats[0], &tm);
+    t = mktime(&tm);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  libc_ns = elapsed_ns(&start, &end) / iterations;
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    (void) http_date_to_time(date, &t);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = elapsed_ns(&start, &end) / iterations;
+  (void) printf("parse:  %7.1f ns, C library %7.1f ns, %5.1fx\n", ns, libc_ns,
+      libc_ns / ns);
+  total_libc_ns = libc_ns;
+  total_ns = ns;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    (void) gmtime_r(&t, &tm);
+    (void) strftime(buf, sizeof(buf), formats[0], &tm);
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  libc_ns = elapsed_ns(&start, &end) / iterations;
+  (void) clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations; i++) {
+    (void) time_to_http_date(&t, buf, sizeof(buf));
+  }
+  (void) clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = elapsed_ns(&start, &end) / iterations;
+  (void) printf("format: %7.1f ns, C library %7.1f ns, %5.1fx\n", ns, libc_ns,
+      libc_ns / ns);
+  total_libc_ns += libc_ns;
+  total_ns += ns;
+  (void) printf("both:   %7.1f ns, C library %7.1f ns, %5.1fx\n", total_ns,
+      total_libc_ns, total_libc_ns / total_ns);
+}
+
+int
+main(int argc, char ** argv)
+{
+  long iterations = 1000000;
+  long i;
+
+  if (argc > 1) {
+    iterations = strtol(argv[1], NULL, 10);
+    if (iterations <= 0) {
+      (void) fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* names as in HTTP */
+  (void) setlocale(LC_TIME, "C");
+  srandom(time(NULL));
+
+  for (i = 0; i < iterations; i++) {
+    if ((check_format(random_time(MIN_TIME, MAX_TIME)) != 0)
+        || (check_parse(random_time(MIN_TIME, MAX_TIME), 0) != 0)
+        || (check_parse(random_time(MIN_TIME_850, MAX_TIME_850), 1) != 0)
+        || (check_parse(random_time(MIN_TIME, MAX_TIME), 2) != 0)) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  (void) printf("%ld random dates of each form agree with the C library\n",
+      iterations);
+
+  bench(iterations);
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,184 @@
+/*
+ * thread.c
+ *
+ * Thread pool server engine. The calling thread accepts clients and puts
+ * them into a bounded queue, from which flag->threads worker threads take
+ * them and run handle_client(). When all workers are busy and the queue is
+ * full, the acceptor stops accepting and clients wait in the listen backlog.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "net.h"
+#include "thread.h"
+#include "util.h"
+
+#define QUEUE_PER_THREAD 4 /* queued clients per worker thread */
+
+/**
+ * An accepted client waiting for a worker thread.
+ */
+struct queued_client
+{
+  int sock;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+};
+
+/**
+ * Bounded FIFO of accepted clients shared by the acceptor and the workers.
+ */
+struct client_queue
+{
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct queued_client *clients;
+  int size; /* capacity */
+  int head; /* index of the oldest client */
+  int count; /* number of queued clients */
+  int started; /* number of worker threads started, numbers the threads */
+  struct flags *flag;
+};
+
+static void
+queue_put(struct client_queue *, struct queued_client *);
+static void
+queue_take(struct client_queue *, struct queued_client *);
+static void *
+worker_main(void *);
+
+/**
+ * Appends a client to the queue. Blocks while the queue is full.
+ */
+static void
+queue_put(struct client_queue * queue, struct queued_client * client)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->size) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  queue->clients[(queue->head + queue->count) % queue->size] = *client;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Removes the oldest client from the queue. Blocks while the queue is empty.
+ */
+static void
+queue_take(struct client_queue * queue, struct queued_client * client)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  *client = queue->clients[queue->head];
+  queue->head = (queue->head + 1) % queue->size;
+  queue->count--;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Worker thread: serves queued clients one after another.
+ *
+ * @param arg the client queue.
+ * @return never returns.
+ */
+static void *
+worker_main(void * arg)
+{
+  struct client_queue *queue = arg;
+  struct queued_client client;
+  int i;
+
+  pthread_mutex_lock(&queue->lock);
+  i = queue->started++;
+  pthread_mutex_unlock(&queue->lock);
+#ifdef HAVE_AFFINITY
+  /* threads of a prefork worker stay on the CPU of the worker */
+  if (queue->flag->workers == 0) {
+    affinity_pin(queue->flag, i, "thread");
+  }
+#endif
+
+  for (;;) {
+    queue_take(queue, &client);
+    handle_client(client.sock, &client.addr, client.addr_len, queue->flag);
+  }
+
+  /* NOTREACHED */
+  return NULL;
+}
+
+/**
+ * Starts flag->threads worker threads and accepts clients for them.
+ * Does not return.
+ *
+ * @param flag user-provided flags.
+ * @param server_sock the listening server socket.
+ */
+void
+run_thread_pool(struct flags * flag, int server_sock)
+{
+  struct client_queue queue;
+  struct queued_client client;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+  int error;
+
+  /* a write to a closed connection must not kill all threads */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    err(EXIT_FAILURE, "cannot ignore SIGPIPE");
+  }
+
+  bzero(&queue, sizeof(queue));
+  queue.size = flag->threads * QUEUE_PER_THREAD;
+  queue.flag = flag;
+  if ((queue.clients = calloc(queue.size, sizeof(*queue.clients))) == NULL) {
+    err(EXIT_FAILURE, "cannot allocate client queue");
+  }
+  if ((pthread_mutex_init(&queue.lock, NULL) != 0)
+      || (pthread_cond_init(&queue.not_empty, NULL) != 0)
+      || (pthread_cond_init(&queue.not_full, NULL) != 0)) {
+    errx(EXIT_FAILURE, "cannot initialize client queue");
+  }
+
+  if ((error = pthread_attr_init(&attr)) != 0) {
+    errx(EXIT_FAILURE, "pthread_attr_init: %s", strerror(error));
+  }
+  (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < flag->threads; i++) {
+    if ((error = pthread_create(&thread, &attr, worker_main, &queue)) != 0) {
+      errx(EXIT_FAILURE, "cannot create worker thread: %s", strerror(error));
+    }
+  }
+  (void) pthread_attr_destroy(&attr);
+
+  for (;;) {
+    client.addr_len = sizeof(client.addr);
+    client.sock = accept_socket(server_sock, &client.addr, &client.addr_len,
+        0);
+    if (client.sock < 0) {
+      if (errno != EINTR) {
+        perror("accept");
+      }
+      continue;
+    }
+    queue_put(&queue, &client);
+  }
+}
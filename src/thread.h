@@ -0,0 +1,16 @@
+/*
+ * thread.h
+ *
+ * Thread pool server engine: an acceptor thread hands client sockets to a
+ * fixed number of worker threads.
+ */
+
+#ifndef _SWS_THREAD_H_
+#define _SWS_THREAD_H_
+
+#include "util.h"
+
+void
+run_thread_pool(struct flags *, int);
+
+#endif /* !_SWS_THREAD_H_ */
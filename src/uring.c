@@ -0,0 +1,899 @@
+/*
+ * uring.c
+ *
+ * io_uring server engine. Like the epoll engine, one process serves all
+ * clients, but socket I/O is submitted to the kernel through an io_uring
+ * submission queue instead of being done with one syscall per operation:
+ *
+ * - a single multishot accept delivers all new clients,
+ * - receives pick a buffer from a ring of provided buffers, so no memory
+ *   is tied to connections that wait for data,
+ * - the queued response header and the first chunk of the file body go out
+ *   as two linked sends; the chunks of a mapped file are sent straight from
+ *   the mapping.
+ *
+ * Many operations are submitted and reaped per io_uring_enter() call. The
+ * ring is driven with raw syscalls, so liburing is not needed.
+ *
+ * A request with a CPU-heavy stage is parked without operations in flight
+ * while the task pool runs the stage. A read of the notifier of the pool
+ * completes once a task is done, and the request is answered again.
+ */
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "conn.h"
+#include "http.h"
+#include "net.h"
+#include "task.h"
+#include "util.h"
+
+#define URING_ENTRIES 256 /* submission queue size */
+#define URING_BUFFERS 256 /* provided receive buffers, a power of two */
+#define URING_BUFFER_GROUP 0
+#define URING_CHUNK_SIZE (64 * 1024) /* file data per body send */
+#define URING_MAP_CHUNK_SIZE (1024 * 1024) /* mapped file data per send */
+
+/* operation tags in the low bits of user_data */
+#define TAG_ACCEPT    1
+#define TAG_RECV      2
+#define TAG_SEND_OUT  3
+#define TAG_SEND_BODY 4
+#define TAG_TIMER     5
+#define TAG_IGNORE    6
+#define TAG_TASK      7
+#define TAG_MASK      7
+
+/**
+ * Submission and completion queues shared with the kernel, plus the ring
+ * of provided receive buffers.
+ */
+struct uring
+{
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sqe_tail; /* one past the last SQE handed out */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *buf_ring;
+  unsigned short buf_tail;
+  char *bufs; /* URING_BUFFERS buffers of BUF_SIZE bytes */
+};
+
+/**
+ * A connection served by the io_uring engine.
+ */
+struct uring_conn
+{
+  struct connection conn; /* first, so list entries convert back */
+  int recv_armed; /* 1, if a receive is in flight */
+  int pending; /* number of sends in flight */
+  int failed; /* 1, if a send failed */
+  int closing; /* 1, once the connection is to be released */
+  char *chunk; /* buffer for file data, if the file is not mapped */
+  const char *chunk_data; /* file data being sent, in chunk or the mapping */
+  size_t chunk_len;
+  size_t chunk_sent;
+};
+
+struct uring_server
+{
+  struct uring ring;
+  struct conn_list active; /* connections within a request, by deadline */
+  struct conn_list idle; /* persistent connections between requests */
+  struct conn_list parked; /* connections waiting for the task pool */
+  struct flags *flag;
+  int server_sock;
+  int task_fd; /* notifier of the task pool, or -1 */
+  uint64_t task_count; /* buffer of the read of task_fd */
+  struct __kernel_timespec tick; /* period of the timeout check */
+};
+
+static void
+uring_setup(struct uring *);
+static void
+uring_setup_buffers(struct uring *);
+static void
+uring_recycle(struct uring *, unsigned short);
+static int
+uring_enter(struct uring *, unsigned);
+static struct io_uring_sqe *
+uring_sqe(struct uring *);
+static void
+uring_reserve(struct uring *, unsigned);
+static void
+uring_arm_accept(struct uring_server *);
+static void
+uring_arm_recv(struct uring_server *, struct uring_conn *);
+static void
+uring_arm_timer(struct uring_server *);
+static void
+uring_arm_task(struct uring_server *);
+static void
+uring_prep_send(struct io_uring_sqe *, struct uring_conn *, const void *,
+    size_t, int);
+static void
+uring_touch(struct uring_server *, struct uring_conn *);
+static void
+uring_close(struct uring_server *, struct uring_conn *);
+static void
+uring_release(struct uring_conn *);
+static void
+uring_accepted(struct uring_server *, int);
+static void
+uring_received(struct uring_server *, struct uring_conn *,
+    struct io_uring_cqe *);
+static void
+uring_respond(struct uring_server *, struct uring_conn *);
+static void
+uring_resume(struct uring_server *);
+static void
+uring_send_next(struct uring_server *, struct uring_conn *);
+static void
+uring_sent(struct uring_server *, struct uring_conn *, int, int);
+static void
+uring_keep_alive(struct uring_server *, struct uring_conn *);
+static void
+uring_expire(struct uring_server *, struct conn_list *, time_t);
+
+/**
+ * Creates the io_uring instance and maps its queues.
+ */
+static void
+uring_setup(struct uring * ring)
+{
+  struct io_uring_params p;
+  size_t sq_size;
+  size_t cq_size;
+  char *sq_ptr;
+  char *cq_ptr;
+
+  bzero(&p, sizeof(p));
+  if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+    err(EXIT_FAILURE, "io_uring_setup");
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    cq_size = sq_size;
+  }
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    err(EXIT_FAILURE, "cannot map submission queue");
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  } else {
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) {
+      err(EXIT_FAILURE, "cannot map completion queue");
+    }
+  }
+  ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+      IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    err(EXIT_FAILURE, "cannot map submission queue entries");
+  }
+
+  ring->sq_head = (unsigned *) (sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+}
+
+/**
+ * Registers the ring of provided receive buffers and fills it.
+ */
+static void
+uring_setup_buffers(struct uring * ring)
+{
+  struct io_uring_buf_reg reg;
+  unsigned short i;
+
+  ring->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED) {
+    err(EXIT_FAILURE, "cannot allocate buffer ring");
+  }
+  if ((ring->bufs = malloc(URING_BUFFERS * BUF_SIZE)) == NULL) {
+    err(EXIT_FAILURE, "cannot allocate receive buffers");
+  }
+
+  bzero(&reg, sizeof(reg));
+  reg.ring_addr = (uintptr_t) ring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+      &reg, 1) < 0) {
+    err(EXIT_FAILURE, "cannot register buffer ring (Linux 5.19 or later "
+        "is required)");
+  }
+
+  ring->buf_tail = 0;
+  for (i = 0; i < URING_BUFFERS; i++) {
+    uring_recycle(ring, i);
+  }
+}
+
+/**
+ * Hands receive buffer bid back to the kernel.
+ */
+static void
+uring_recycle(struct uring * ring, unsigned short bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+  buf->addr = (uintptr_t) (ring->bufs + (size_t) bid * BUF_SIZE);
+  buf->len = BUF_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits all prepared SQEs and waits for wait_nr completions.
+ *
+ * @return 0 on success. Otherwise, -1.
+ */
+static int
+uring_enter(struct uring * ring, unsigned wait_nr)
+{
+  unsigned tail;
+  unsigned to_submit;
+
+  /* publish the new entries */
+  for (tail = *ring->sq_tail; tail != ring->sqe_tail; tail++) {
+    ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+  }
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head,
+      __ATOMIC_ACQUIRE);
+
+  if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+      (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Returns a cleared SQE. Submits pending entries first if the queue is full.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring * ring)
+{
+  struct io_uring_sqe *sqe;
+
+  uring_reserve(ring, 1);
+  sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  bzero(sqe, sizeof(*sqe));
+
+  return sqe;
+}
+
+/**
+ * Makes sure that n SQEs can be handed out without an intermediate submit,
+ * which would split linked entries.
+ */
+static void
+uring_reserve(struct uring * ring, unsigned n)
+{
+  while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+      + n > ring->sq_entries) {
+    if ((uring_enter(ring, 0) < 0) && (errno != EINTR) && (errno != EAGAIN)
+        && (errno != EBUSY)) {
+      err(EXIT_FAILURE, "io_uring_enter");
+    }
+  }
+}
+
+/**
+ * Submits a multishot accept on the server socket.
+ */
+static void
+uring_arm_accept(struct uring_server * srv)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&srv->ring);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = srv->server_sock;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  /* like accept_socket(): CGIs must not inherit clients */
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = TAG_ACCEPT;
+}
+
+/**
+ * Submits a receive into a provided buffer for the connection.
+ */
+static void
+uring_arm_recv(struct uring_server * srv, struct uring_conn * uc)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&srv->ring);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->conn.socket;
+  /*
+   * at most what fits conn.buf, which grows while the request header is
+   * incomplete; input after the header stays in the socket, e.g. a body.
+   * An idle connection gets conn.buf only once data arrived.
+   */
+  sqe->len = (uc->conn.buf == NULL) ?
+      BUFPOOL_MIN - 1 : conn_input_space(&uc->conn);
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = (uintptr_t) uc | TAG_RECV;
+  uc->recv_armed = 1;
+}
+
+/**
+ * Submits the timer that drives timeout checks.
+ */
+static void
+uring_arm_timer(struct uring_server * srv)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&srv->ring);
+
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t) &srv->tick;
+  sqe->len = 1;
+  sqe->user_data = TAG_TIMER;
+}
+
+/**
+ * Submits a read of the notifier of the task pool.
+ */
+static void
+uring_arm_task(struct uring_server * srv)
+{
+  struct io_uring_sqe *sqe = uring_sqe(&srv->ring);
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = srv->task_fd;
+  sqe->addr = (uintptr_t) &srv->task_count;
+  sqe->len = sizeof(srv->task_count);
+  sqe->user_data = TAG_TASK;
+}
+
+/**
+ * Prepares a send of len bytes at buf for the connection.
+ */
+static void
+uring_prep_send(struct io_uring_sqe * sqe, struct uring_conn * uc,
+    const void * buf, size_t len, int tag)
+{
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = uc->conn.socket;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = (uintptr_t) uc | tag;
+  uc->pending++;
+}
+
+/**
+ * Restarts the timeout of the connection after activity.
+ */
+static void
+uring_touch(struct uring_server * srv, struct uring_conn * uc)
+{
+  conn_list_remove(&uc->conn);
+  conn_list_append(&srv->active, &uc->conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+}
+
+/**
+ * Marks the connection for release. Memory is freed once the kernel no
+ * longer references it.
+ */
+static void
+uring_close(struct uring_server * srv, struct uring_conn * uc)
+{
+  if (uc->closing) {
+    return;
+  }
+  uc->closing = 1;
+  conn_list_remove(&uc->conn);
+  if (uc->recv_armed) {
+    struct io_uring_sqe *sqe = uring_sqe(&srv->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) uc | TAG_RECV;
+    sqe->user_data = TAG_IGNORE;
+  }
+  uring_release(uc);
+}
+
+/**
+ * Frees a closing connection without operations in flight.
+ */
+static void
+uring_release(struct uring_conn * uc)
+{
+  if (uc->closing && !uc->recv_armed && (uc->pending == 0)) {
+    conn_close(&uc->conn);
+    free(uc->chunk);
+    free(uc);
+  }
+}
+
+/**
+ * Sets up a newly accepted client.
+ */
+static void
+uring_accepted(struct uring_server * srv, int client_sock)
+{
+  struct sockaddr_storage client;
+  socklen_t client_length;
+  char client_ip[INET6_ADDRSTRLEN];
+  struct uring_conn *uc;
+
+  if ((uc = calloc(1, sizeof(*uc))) == NULL) {
+    warn("cannot allocate connection");
+    (void) close(client_sock);
+    return;
+  }
+  /* multishot accept does not report addresses */
+  client_length = sizeof(client);
+  if (getpeername(client_sock, (struct sockaddr *) &client,
+      &client_length) < 0) {
+    client.ss_family = AF_UNSPEC;
+  }
+  (void) client_address(&client, client_ip, sizeof(client_ip));
+  conn_init(&uc->conn, client_sock, client_ip);
+  uc->conn.nonblocking = 1;
+  /* file bodies go out from their mapping, or a buffer */
+  uc->conn.no_sendfile = 1;
+  conn_list_append(&srv->active, &uc->conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+  uring_arm_recv(srv, uc);
+}
+
+/**
+ * Handles a receive completion: appends the data to the request and answers
+ * the request once it is complete.
+ */
+static void
+uring_received(struct uring_server * srv, struct uring_conn * uc,
+    struct io_uring_cqe * cqe)
+{
+  struct connection *conn = &uc->conn;
+  const char *data;
+  size_t remain_buf;
+  int res = cqe->res;
+  int copied;
+
+  uc->recv_armed = 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    data = srv->ring.bufs + (size_t) bid * BUF_SIZE;
+    /* grows conn.buf while the request does not fit */
+    for (copied = 0; (copied < res) && !uc->closing; copied += remain_buf) {
+      if ((remain_buf = conn_input_space(conn)) == 0) {
+        break;
+      } else if (remain_buf > (size_t) (res - copied)) {
+        remain_buf = res - copied;
+      }
+      memcpy(conn->buf + conn->buf_len, data + copied, remain_buf);
+      conn->buf_len += remain_buf;
+      conn->buf[conn->buf_len] = '\0';
+    }
+    uring_recycle(&srv->ring, bid);
+  }
+
+  if (uc->closing) {
+    uring_release(uc);
+    return;
+  }
+
+  if (res == -ENOBUFS) {
+    /* all buffers were in use, they are back by now */
+    uring_arm_recv(srv, uc);
+    return;
+  } else if (res < 0) {
+    uring_close(srv, uc);
+    return;
+  } else if (res == 0) {
+    if (conn->buf_len == 0) {
+      uring_close(srv, uc);
+    } else {
+      /* answer the truncated request */
+      uring_respond(srv, uc);
+    }
+    return;
+  }
+
+  if (!conn_request_complete(conn)
+      && (conn->buf_len < bufpool_limit() - 1)) {
+    /* request incomplete, wait for more */
+    uring_touch(srv, uc);
+    uring_arm_recv(srv, uc);
+  } else {
+    uring_respond(srv, uc);
+  }
+}
+
+/**
+ * Answers the request in the connection buffer and all complete pipelined
+ * requests that follow it, then starts sending their queued responses.
+ */
+static void
+uring_respond(struct uring_server * srv, struct uring_conn * uc)
+{
+  struct connection *conn = &uc->conn;
+
+  for (;;) {
+    if (httpd_respond(conn, srv->flag) < 0) {
+      warnx("httpd failed for client %s", conn->client_ip);
+    }
+
+    switch (conn->state) {
+    case CONN_STATE_CHILD:
+      /* this process served a request that needed blocking I/O */
+      conn_close(conn);
+      exit(EXIT_SUCCESS);
+      /* NOTREACHED */
+      break;
+    case CONN_STATE_DETACHED:
+      uring_close(srv, uc);
+      return;
+      /* NOTREACHED */
+      break;
+    case CONN_STATE_TASK:
+      /* no timeout, the pool finishes every task */
+      conn_list_remove(conn);
+      conn_list_append(&srv->parked, conn, 0);
+      return;
+      /* NOTREACHED */
+      break;
+    default:
+      break;
+    }
+
+    /* a pending file body must be sent before the next response */
+    if (!conn->keep_alive || (conn->body_fd >= 0)
+        || (conn->out_len >= CONN_BATCH_MAX) || !conn_pipelined(conn)) {
+      break;
+    }
+    conn_next_request(conn);
+  }
+
+  conn->state = CONN_STATE_WRITING;
+  uring_touch(srv, uc);
+  uring_send_next(srv, uc);
+}
+
+/**
+ * Answers the requests of all parked connections whose task is done, after
+ * the read of the notifier of the task pool completed.
+ */
+static void
+uring_resume(struct uring_server * srv)
+{
+  struct connection *conn;
+  struct connection *next;
+
+  for (conn = srv->parked.head; conn != NULL; conn = next) {
+    /* the connection may be parked again */
+    next = conn->next;
+    if (task_done(conn->task)) {
+      conn->state = CONN_STATE_READING;
+      uring_respond(srv, (struct uring_conn *) conn);
+    }
+  }
+}
+
+/**
+ * Submits the next part of the response: the queued output linked with the
+ * next chunk of the file body, or only one of them. The head of the next
+ * part of the body is queued once a range is sent. Closes the connection
+ * when the response is complete.
+ */
+static void
+uring_send_next(struct uring_server * srv, struct uring_conn * uc)
+{
+  struct connection *conn = &uc->conn;
+  struct io_uring_sqe *sqe;
+  int have_out;
+  int have_chunk;
+
+  while ((uc->chunk_sent == uc->chunk_len) && (conn->body_fd >= 0)
+      && (conn->body_offset == conn->body_end)
+      && (conn->body_parts_left > 0)) {
+    /* the head of the next part is queued */
+    if (conn_next_part(conn) < 0) {
+      uring_close(srv, uc);
+      return;
+    }
+  }
+  if ((uc->chunk_sent == uc->chunk_len) && (conn->body_fd >= 0)
+      && (conn->body_offset < conn->body_end)) {
+    off_t remain = conn->body_end - conn->body_offset;
+    ssize_t n_bytes;
+
+    if ((conn->body_map != NULL)
+        && (conn->body_end > conn->body_map->size)) {
+      warnx("file shrank while sending it");
+      uring_close(srv, uc);
+      return;
+    } else if (conn->body_map != NULL) {
+      /* no copy, so larger chunks */
+      uc->chunk_data = conn->body_map->addr + conn->body_offset;
+      n_bytes = (remain < URING_MAP_CHUNK_SIZE) ? remain
+          : URING_MAP_CHUNK_SIZE;
+    } else if ((uc->chunk == NULL)
+        && ((uc->chunk = malloc(URING_CHUNK_SIZE)) == NULL)) {
+      warn("cannot allocate send buffer");
+      uring_close(srv, uc);
+      return;
+    } else if ((n_bytes = pread(conn->body_fd, uc->chunk,
+        (remain < URING_CHUNK_SIZE) ? remain : URING_CHUNK_SIZE,
+        conn->body_offset)) <= 0) {
+      warnx("cannot read file to send");
+      uring_close(srv, uc);
+      return;
+    } else {
+      uc->chunk_data = uc->chunk;
+    }
+    uc->chunk_len = n_bytes;
+    uc->chunk_sent = 0;
+    conn->body_offset += n_bytes;
+  }
+
+  have_out = (conn->out_sent < conn->out_len);
+  have_chunk = (uc->chunk_sent < uc->chunk_len);
+  if (!have_out && !have_chunk) {
+    /* response complete */
+    if (conn->keep_alive) {
+      uring_keep_alive(srv, uc);
+    } else {
+      uring_close(srv, uc);
+    }
+    return;
+  }
+
+  uring_reserve(&srv->ring, 2);
+  if (have_out) {
+    sqe = uring_sqe(&srv->ring);
+    uring_prep_send(sqe, uc, conn->out + conn->out_sent,
+        conn->out_len - conn->out_sent, TAG_SEND_OUT);
+    if (have_chunk) {
+      /* the body follows the header without another round trip, and in
+       * the same segment */
+      sqe->flags |= IOSQE_IO_LINK;
+      sqe->msg_flags |= MSG_MORE;
+    }
+  }
+  if (have_chunk) {
+    sqe = uring_sqe(&srv->ring);
+    uring_prep_send(sqe, uc, uc->chunk_data + uc->chunk_sent,
+        uc->chunk_len - uc->chunk_sent, TAG_SEND_BODY);
+    if ((conn->body_offset < conn->body_end)
+        || (conn->body_parts_left > 0)) {
+      sqe->msg_flags |= MSG_MORE;
+    }
+  }
+}
+
+/**
+ * Handles a send completion.
+ */
+static void
+uring_sent(struct uring_server * srv, struct uring_conn * uc, int tag,
+    int res)
+{
+  uc->pending--;
+  if (res > 0) {
+    if (tag == TAG_SEND_OUT) {
+      uc->conn.out_sent += res;
+    } else {
+      uc->chunk_sent += res;
+    }
+  } else if (res != -ECANCELED) {
+    /* canceled sends follow a short send and are retried */
+    uc->failed = 1;
+  }
+
+  if (uc->pending > 0) {
+    return;
+  }
+  if (uc->closing) {
+    uring_release(uc);
+  } else if (uc->failed) {
+    uring_close(srv, uc);
+  } else {
+    uring_touch(srv, uc);
+    uring_send_next(srv, uc);
+  }
+}
+
+/**
+ * Prepares a connection whose response is sent for the next request. A
+ * pipelined request that is already complete is answered right away.
+ */
+static void
+uring_keep_alive(struct uring_server * srv, struct uring_conn * uc)
+{
+  struct connection *conn = &uc->conn;
+
+  conn_end_body(conn);
+  conn->out_len = conn->out_sent = 0;
+  uc->chunk_len = uc->chunk_sent = 0;
+  conn_next_request(conn);
+  if (conn_request_complete(conn)) {
+    uring_respond(srv, uc);
+    return;
+  }
+
+  conn_list_remove(conn);
+  if (conn->buf_len > 0) {
+    /* part of the next request is there */
+    conn_list_append(&srv->active, conn, time(NULL) + CLIENT_TIMEOUT_SEC);
+  } else {
+    conn_list_append(&srv->idle, conn, time(NULL) + KEEPALIVE_TIMEOUT_SEC);
+  }
+  uring_arm_recv(srv, uc);
+}
+
+/**
+ * Handles connections of the list whose deadline has passed. Clients that
+ * did not complete their request are notified of the timeout, idle
+ * persistent connections are closed silently.
+ */
+static void
+uring_expire(struct uring_server * srv, struct conn_list * list, time_t now)
+{
+  struct connection *conn;
+
+  while (((conn = list->head) != NULL) && (conn->deadline <= now)) {
+    struct uring_conn *uc = (struct uring_conn *) conn;
+
+    if ((conn->state == CONN_STATE_READING) && (uc->pending == 0)
+        && ((conn->buf_len > 0) || (conn->requests == 0))) {
+      struct response response;
+
+      init_response(&response, RESPONSE_STATUS_CONNECTION_TIMED_OUT);
+      (void) coderesp(&response, conn, 1);
+      conn->state = CONN_STATE_WRITING;
+      uring_touch(srv, uc);
+      uring_send_next(srv, uc);
+    } else {
+      uring_close(srv, uc);
+    }
+  }
+}
+
+/**
+ * Serves clients with an io_uring event loop. Does not return.
+ *
+ * @param flag user-provided flags.
+ * @param server_sock the listening server socket.
+ */
+void
+run_uring_loop(struct flags * flag, int server_sock)
+{
+  struct uring_server srv;
+  struct io_uring_cqe cqe;
+  unsigned head;
+  int threads;
+
+  bzero(&srv, sizeof(srv));
+  srv.flag = flag;
+  srv.server_sock = server_sock;
+  srv.task_fd = -1;
+  srv.tick.tv_sec = 1;
+
+  uring_setup(&srv.ring);
+  uring_setup_buffers(&srv.ring);
+  uring_arm_accept(&srv);
+  uring_arm_timer(&srv);
+
+  /* CPU-heavy stages run on the task pool, so that the loop goes on */
+  threads = (flag->tasks < 0) ? sysconf(_SC_NPROCESSORS_ONLN) : flag->tasks;
+  if ((threads > 0) && (task_pool_start(threads) < 0)) {
+    warnx("running CPU-heavy stages inline");
+  } else if ((srv.task_fd = task_notifier()) >= 0) {
+    uring_arm_task(&srv);
+  }
+
+  for (;;) {
+    if (uring_enter(&srv.ring, 1) < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {
+        /* e.g. SIGCHLD of a CGI child */
+        continue;
+      }
+      err(EXIT_FAILURE, "io_uring_enter");
+    }
+
+    head = *srv.ring.cq_head;
+    while (head != __atomic_load_n(srv.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct uring_conn *uc;
+      int tag;
+
+      cqe = srv.ring.cqes[head & *srv.ring.cq_mask];
+      head++;
+      __atomic_store_n(srv.ring.cq_head, head, __ATOMIC_RELEASE);
+
+      tag = cqe.user_data & TAG_MASK;
+      uc = (struct uring_conn *) (uintptr_t) (cqe.user_data & ~TAG_MASK);
+      switch (tag) {
+      case TAG_ACCEPT:
+        if (cqe.res >= 0) {
+          uring_accepted(&srv, cqe.res);
+        } else if (cqe.res == -EINVAL) {
+          errx(EXIT_FAILURE, "multishot accept is not supported (Linux 5.19 "
+              "or later is required)");
+        } else {
+          warnx("accept: %s", strerror(-cqe.res));
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          uring_arm_accept(&srv);
+        }
+        break;
+      case TAG_RECV:
+        uring_received(&srv, uc, &cqe);
+        break;
+      case TAG_SEND_OUT:
+      case TAG_SEND_BODY:
+        uring_sent(&srv, uc, tag, cqe.res);
+        break;
+      case TAG_TIMER:
+        uring_expire(&srv, &srv.active, time(NULL));
+        uring_expire(&srv, &srv.idle, time(NULL));
+        uring_arm_timer(&srv);
+        break;
+      case TAG_TASK:
+        if (cqe.res < 0) {
+          warnx("cannot read task notifier: %s", strerror(-cqe.res));
+        }
+        uring_resume(&srv);
+        uring_arm_task(&srv);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,21 @@
+/*
+ * uring.h
+ *
+ * io_uring server engine for Linux.
+ */
+
+#ifndef _SWS_URING_H_
+#define _SWS_URING_H_
+
+#include "util.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+void
+run_uring_loop(struct flags *, int);
+
+#endif /* !_SWS_URING_H_ */
@@ -4,12 +4,17 @@
  * Utility functions for sws.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* O_PATH */
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
 #include <magic.h>
@@ -18,13 +23,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-
-#ifndef __USE_XOPEN
-#define __USE_XOPEN
-#endif
 #include <time.h>
+#include <unistd.h>
 
+#include "bodycache.h"
+#include "bufpool.h"
+#include "mapcache.h"
+#include "event.h"
+#include "fdcache.h"
 #include "net.h"
 #include "util.h"
 
@@ -32,6 +38,17 @@
 #include <strings.h>
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#define HAVE_OPENAT2 1
+#endif
+#endif
+
+static int
+hex_value(char);
+
 /**
  * Writes log data to a file descriptor passed to program.
  * Takes the values in struct logging and writes to fd in the
@@ -40,12 +57,19 @@
 int
 writelog(int fd, struct logging* log)
 {
-  char logstr[sizeof(struct logging) + 16];
+  char size[24];
   int n = 0;
-  snprintf(logstr, sizeof(logstr), "%s [%s] \"%s\" %s %s\n", log->remoteip,
-      log->request_time, log->request_lineq, log->request_status,
-      log->response_size);
-  if ((n = write(fd, logstr, strlen(logstr))) < 0) {
+
+  if (log->response_size >= 0) {
+    snprintf(size, sizeof(size), "%lld", (long long) log->response_size);
+  } else {
+    strcpy(size, "-");
+  }
+  /* formatted by stdio, the request line may be long */
+  if ((n = dprintf(fd, "%s [%s] \"%s\" %d %s\n",
+      (log->remoteip != NULL) ? log->remoteip : "", log->request_time,
+      (log->request_line != NULL) ? log->request_line : "",
+      log->request_status, size)) < 0) {
     perror("Write error");
     exit(EXIT_FAILURE);
   }
@@ -70,6 +94,25 @@ flags_init(struct flags *flag)
   flag->p_port = DEFAULT_PORT;
   flag->dir = NULL;
   flag->logfd = 0;
+#ifdef HAVE_EPOLL
+  flag->engine = ENGINE_EVENT;
+#else
+  flag->engine = ENGINE_FORK;
+#endif
+  flag->workers = 0;
+  flag->threads = 0;
+  flag->backlog = 0;
+  flag->defer_accept = 0;
+  flag->fastopen = 0;
+  flag->accept_batch = DEFAULT_ACCEPT_BATCH;
+  flag->cpus = NULL;
+  flag->ncpus = 0;
+  flag->steering = STEER_CBPF;
+  flag->tasks = -1;
+  flag->header_max = BUFPOOL_DEFAULT_LIMIT;
+  flag->open_files = FDCACHE_DEFAULT_FILES;
+  flag->content_cache = BODYCACHE_DEFAULT_BUDGET;
+  flag->mapped_files = MAPCACHE_DEFAULT_BUDGET;
 }
 
 /*
@@ -163,14 +206,17 @@ write_buffer(char * buf, size_t buf_size, const char * format, ...)
 void
 server_sig_handler(int signo)
 {
+  int saved_errno;
   int status;
 
   switch (signo) {
   case SIGCHLD:
-    /* reap child */
-    if (wait(&status) < 0) {
-      perror("wait");
+    /* reap the children that have exited, never wait for running ones */
+    saved_errno = errno;
+    while (waitpid(-1, &status, WNOHANG) > 0) {
+      continue;
     }
+    errno = saved_errno;
     break;
   default:
     errx(EXIT_FAILURE, "do not know how to handle signal number %d", signo);
@@ -178,108 +224,6 @@ server_sig_handler(int signo)
   }
 }
 
-/**
- * Converts the given time from localtime to GMT.
- * @param time the time to convert from local to GMT.
- * @return -1, if an error occured. The converted time otherwise.
- */
-time_t
-local_to_gmtime(time_t * time)
-{
-  struct tm result;
-
-  if (gmtime_r(time, &result) == NULL) {
-    return -1;
-  }
-  return mktime(&result);
-}
-
-/**
- * Parses the HTTP-date according to RFC 1945 and stores it as a time_t.
- *
- * @param date the date to parse
- * @param dst where to store the time_t
- * @return 0 on success. Otherwise, -1.
- */
-int
-http_date_to_time(const char * date, time_t * dst)
-{
-  char * pos;
-  struct tm tm;
-  time_t time;
-
-  if (date == NULL) {
-    return -1;
-  }
-
-  bzero(&tm, sizeof(tm));
-
-  /*
-   * Possible formats:
-   *
-   * rfc1123-date   = wkday "," SP date1 SP time SP "GMT"
-   * rfc850-date    = weekday "," SP date2 SP time SP "GMT"
-   * asctime-date   = wkday SP date3 SP time SP 4DIGIT
-   */
-  if ((pos = strchr(date, ',')) == NULL) {
-    /* parse asctime-date */
-    if (strptime(date, "%a %b %e %H:%M:%S %Y", &tm) == NULL) {
-      return -1;
-    }
-  } else {
-    int weekday_len = pos - date;
-
-    if (weekday_len == 3) {
-      /* rfc1123-date */
-      if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
-        return -1;
-      }
-    } else {
-      /* rfc850-date */
-      if (strptime(date, "%A, %d-%b-%y %H:%M:%S GMT", &tm) == NULL) {
-        return -1;
-      }
-    }
-  }
-
-  if ((time = mktime(&tm)) == -1) {
-    return -1;
-  } else {
-    *dst = time;
-  }
-
-  return 0;
-}
-
-/**
- * Converts the given time to a string in RFC 1123 format.
- *
- * @param time the time to convert to a RFC 1123 date
- * @param dst the buffer to fill with the HTTP date string
- * @param dst_len the size of the buffer in bytes
- * @return 0 on success. Otherwise, -1.
- */
-int
-time_to_http_date(time_t *time, char * dst, size_t dst_len)
-{
-  struct tm date;
-
-  if (time == NULL) {
-    return -1;
-  }
-  /* Use GMT time */
-  if (gmtime_r(time, &date) == NULL) {
-    return -1;
-  }
-
-  /* use time format from RFC 1123 */
-  if (strftime(dst, dst_len, "%a, %d %b %Y %H:%M:%S GMT", &date) == 0) {
-    return -1;
-  }
-
-  return 0;
-}
-
 /** 
  * Get MIME type/subtype for given file path.
  *
@@ -317,68 +261,178 @@ mime_type(const char * path, char * dst, size_t dst_len)
   strncpy(dst, mime_type, dst_len - 1);
   magic_close(magic);
 }
-/*
- * Returns a null terminated string containing a line of input read from a socket.
- * it supports lines terminated in CRLF "\r\n" as well as just LF '\n'
- * 
- * socket - socket to be read
- * buf - bufer that will be filled with the line of input;
- * buf_size - size of the buffer to be filled
+
+/**
+ * Copies the last component of a path to the given buffer. Unlike
+ * basename(3), neither modifies the path nor uses static storage.
  *
- * return value - size of the returned string or -1 on failure. The max return value
- *  will be buf_size-1 the '\0' character is not counted.
+ * @param path the path
+ * @param dst the buffer to fill with the last path component
+ * @param dst_len the size of the buffer in bytes
  */
-
-int
-get_socket_line(int socket, char * buf, size_t buf_size)
+void
+path_basename(const char * path, char * dst, size_t dst_len)
 {
-  char a;
-  int chars_read, count = 0;
+  const char *end;
+  const char *start;
+  size_t len;
 
-  /* just in case user is trying to be "funny" */
-  if (buf_size == 0) {
-    return count;
+  if (dst_len == 0) {
+    return;
+  }
+  end = path + strlen(path);
+  /* ignore trailing slashes */
+  while ((end > path + 1) && (end[-1] == '/')) {
+    end--;
   }
-  if (buf_size == 1) {
-    buf[count] = '\0';
-    return count;
+  start = end;
+  while ((start > path) && (start[-1] != '/')) {
+    start--;
+  }
+  if ((start == end) && (*path == '/')) {
+    /* path is the root directory */
+    start = path;
+    end = path + 1;
+  } else if (start == end) {
+    start = ".";
+    end = start + 1;
   }
 
-  /*
-   * read socket character by character and add them to buf until new line
-   * character is encountered or until the end of the buffer is reached
-   */
-  while ((chars_read = read(socket, &a, 1)) > 0) {
-    if (a == '\n') {
-      break;
+  len = end - start;
+  if (len >= dst_len) {
+    len = dst_len - 1;
+  }
+  memcpy(dst, start, len);
+  dst[len] = '\0';
+}
+
+/**
+ * Converts a hexadecimal digit.
+ *
+ * @param c the digit.
+ * @return its value, or -1 if c is no hexadecimal digit.
+ */
+static int
+hex_value(char c)
+{
+  if ((c >= '0') && (c <= '9')) {
+    return c - '0';
+  } else if ((c >= 'a') && (c <= 'f')) {
+    return c - 'a' + 10;
+  } else if ((c >= 'A') && (c <= 'F')) {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decodes and normalizes the path of a request URI in one pass: %XX escapes
+ * are decoded, empty and "." segments dropped and ".." segments remove the
+ * segment before them, without looking at the file system. The result
+ * starts with a slash and is relative to the document root; it ends with a
+ * slash if the path did.
+ *
+ * @param uri the path, without the query string.
+ * @param dst the buffer for the normalized path.
+ * @param dst_size the size of dst.
+ * @return the length of the normalized path. -1, if the path holds a bad
+ * escape or a NUL byte (errno EINVAL), leaves the root with ".." (errno
+ * EACCES) or does not fit (errno ENAMETOOLONG).
+ */
+int
+path_normalize(const char * uri, char * dst, size_t dst_size)
+{
+  size_t len = 0;
+  size_t segment = 1; /* start of the current segment in dst */
+  int high;
+  int low;
+  char c;
+
+  if (dst_size < 2) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  dst[len++] = '/';
+  for (;;) {
+    c = *uri;
+    if (c == '%') {
+      if (((high = hex_value(uri[1])) < 0) || ((low = hex_value(uri[2])) < 0)
+          || ((c = (char) (high * 16 + low)) == '\0')) {
+        errno = EINVAL;
+        return -1;
+      }
+      uri += 3;
+    } else if (c != '\0') {
+      uri++;
     }
 
-    buf[count++] = a;
+    if ((c != '/') && (c != '\0')) {
+      if (len == dst_size - 1) {
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+      dst[len++] = c;
+      continue;
+    }
 
-    if (count == buf_size - 1) {
+    /* the segment ends */
+    if ((len - segment == 1) && (dst[segment] == '.')) {
+      len = segment;
+    } else if ((len - segment == 2) && (dst[segment] == '.')
+        && (dst[segment + 1] == '.')) {
+      if (segment == 1) {
+        errno = EACCES;
+        return -1;
+      }
+      /* drop the previous segment, keep its leading slash */
+      len = segment - 1;
+      while (dst[len - 1] != '/') {
+        len--;
+      }
+    } else if ((len > segment) && (c == '/')) {
+      if (len == dst_size - 1) {
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+      dst[len++] = '/';
+    }
+    segment = len;
+    if (c == '\0') {
       break;
     }
   }
+  dst[len] = '\0';
 
-  /* read returns -1 on failure */
-  if (chars_read < 0) {
-    /* return value indicating failure user can check errno for details */
-    return chars_read;
-  }
+  return len;
+}
 
-  /* if first character read is '\n' */
-  if (count == 0) {
-    buf[count] = '\0'; /* empty string */
-    return count;
-  }
-  /*
-   * Discard carriage return character if present and add '\0' character
-   * to the end of the string
-   */
-  if (buf[count - 1] == '\r') {
-    buf[--count] = '\0';
-  } else {
-    buf[count] = '\0';
+/**
+ * Tells whether an absolute path is free of symbolic links, so that it is
+ * its own realpath(3) once normalized. On Linux, openat2(2) with
+ * RESOLVE_NO_SYMLINKS checks all components with one lookup.
+ *
+ * @param path the normalized absolute path.
+ * @return 1, if no component is a symbolic link. 0, if one is or it cannot
+ * be told.
+ */
+int
+path_no_symlinks(const char * path)
+{
+#ifdef HAVE_OPENAT2
+  struct open_how how;
+  int fd;
+
+  bzero(&how, sizeof(how));
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_NO_SYMLINKS;
+  if ((fd = syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof(how))) < 0) {
+    /* ELOOP for a symbolic link, ENOSYS before Linux 5.6 */
+    return 0;
   }
-  return count;
+  (void) close(fd);
+  return 1;
+#else
+  (void) path;
+  return 0;
+#endif
 }
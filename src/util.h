@@ -8,11 +8,23 @@
 #ifndef _SWS_UTIL_H_
 #define _SWS_UTIL_H_
 
+#include <sys/types.h>
+
 #include <time.h>
 
-#define FLAGS_SUPPORTED "c:dhi:l:p:"
+#define FLAGS_SUPPORTED "A:a:b:c:D:dF:fH:hi:l:M:m:O:op:S:T:t:uw:"
 #define BUF_SIZE (4 * 1024)
 
+#define ENGINE_FORK  1 /* fork a process per connection */
+#define ENGINE_EVENT 2 /* one process multiplexing connections with epoll */
+#define ENGINE_THREADS 3 /* a pool of threads serving one client each */
+#define ENGINE_URING 4 /* one process submitting socket I/O to io_uring */
+#define ENGINE_CORO 5 /* one process running a coroutine per connection */
+
+#define STEER_NONE 0 /* let SO_REUSEPORT hash connections to workers */
+#define STEER_CPU  1 /* prefer the worker socket with SO_INCOMING_CPU */
+#define STEER_CBPF 2 /* select the worker with a reuseport BPF program */
+
 
 /**
  * The logging structure is used to store the data if logging is enabled
@@ -21,11 +33,11 @@
  */
 struct logging
 {
-  char remoteip[64];
-  char request_time[128];
-  char request_lineq[BUF_SIZE];
-  char request_status[16];
-  char response_size[64];
+  const char *remoteip;
+  char request_time[32];
+  const char *request_line; /* copy in the request arena, or NULL */
+  int request_status;
+  off_t response_size; /* -1 if unknown */
 };
 
 struct flags
@@ -39,6 +51,21 @@ struct flags
   unsigned int p_port;
   const char *dir;
   int logfd;
+  int engine; /* ENGINE_? */
+  int workers; /* number of prefork workers, 0 to disable prefork */
+  int threads; /* number of threads of the thread pool engine */
+  int backlog; /* listen backlog, 0 for the system maximum */
+  int defer_accept; /* seconds to wait for request data before accept */
+  int fastopen; /* TCP Fast Open queue length, 0 to disable */
+  int accept_batch; /* connections accepted per wakeup of the event loop */
+  int *cpus; /* CPUs to pin workers and threads to, round-robin */
+  int ncpus; /* number of CPUs in cpus, 0 to disable pinning */
+  int steering; /* STEER_?, how connections find the worker of their CPU */
+  int tasks; /* task pool threads of the event engines, -1 for one per CPU */
+  size_t header_max; /* largest request header in bytes */
+  int open_files; /* files kept open by the file cache, 0 to disable it */
+  size_t content_cache; /* bytes of the content cache, 0 to disable it */
+  size_t mapped_files; /* bytes of file mappings, 0 to disable mapping */
 };
 
 int
@@ -53,14 +80,12 @@ int
 write_buffer(char *, size_t, const char *, ...);
 void
 server_sig_handler(int);
-time_t
-local_to_gmtime(time_t *);
-int
-http_date_to_time(const char *, time_t *);
-int
-time_to_http_date(time_t *, char *, size_t);
 void
 mime_type(const char *, char *, size_t);
+void
+path_basename(const char *, char *, size_t);
+int
+path_normalize(const char *, char *, size_t);
 int
-get_socket_line(int, char*, size_t);
+path_no_symlinks(const char *);
 #endif /* _SWS_UTIL_H_ */